@@ -0,0 +1,205 @@
+#!/bin/bash
+#
+# bench.sh
+#
+# Measures how throughput scales with worker threads. Each run starts a
+# fresh server (epoll mode, or $MODE) with the given number of threads
+# and drives it with as many keep-alive, pipelined client threads. Extra
+# arguments are passed to dbserver, e.g. ./bench.sh --shards=1 to compare
+# against a single table lock, or MODE=percore ./bench.sh --pin=cores.
+#
+# BENCH=sizes ./bench.sh instead writes and reads back values from 1K to
+# 64M against a 4-thread server, reporting MB/sec for each size.
+#
+# BENCH=storage ./bench.sh runs the same 8-thread writes, reads and
+# batches against the file backend and then the uring one, with the
+# value cache off so that every read goes to storage.
+#
+# BENCH=durability ./bench.sh runs 32 writers against each --durability
+# mode in turn, reporting throughput and latency percentiles.
+#
+# BENCH=compaction ./bench.sh overwrites a small key set with 8 writers,
+# with compaction off, at its default rate and unthrottled, to show what
+# compaction does to write latency.
+#
+# BENCH=compression ./bench.sh writes and reads back 1K values with each
+# --compress codec, the cache off, reporting throughput, log bytes and
+# the server's compression figures. dbtest's values are random letters:
+# deflate's Huffman coding packs them, LZ4 has none and mostly can't.
+#
+# BENCH=ttl ./bench.sh fills $KEYS keys (default 1M) with a 2 second TTL,
+# then polls the server's metrics until they have all been reclaimed,
+# reporting how long after the fill the last went (a little over the TTL
+# if expiry keeps up) and the fill rate against plain writes.
+#
+# BENCH=eviction ./bench.sh runs read-through cache traffic, Zipf-skewed
+# over 100000 keys, against each --evict policy with and without TinyLFU
+# admission, the budget ($BUDGET, default 5M) holding about a fifth of
+# the keys, reporting hit rates and what was evicted.
+#
+# BENCH=recovery ./bench.sh fills a log-storage server with $KEYS keys
+# (default 1M) and times restarts until the last key can be read: after
+# a clean quit, which leaves a snapshot; after a kill -9 with writes in
+# the log past the snapshot; and with no snapshot, replaying everything.
+#
+
+COUNT=${COUNT:-200000}
+MODE=${MODE:-epoll}
+
+# start_server THREADS ARGS...: the server runs until it reads "quit"
+start_server() {
+  PORT=$((5000 + RANDOM % 1000))
+  local threads=$1
+  shift
+  exec 3> >(./dbserver --mode=$MODE --threads=$threads --storage=log --fresh \
+    "$@" $PORT > /dev/null)
+  SERVER_PID=$!
+  sleep 0.5
+}
+
+stop_server() {
+  echo quit >&3
+  exec 3>&-
+  wait $SERVER_PID
+}
+
+if [ "$BENCH" = sizes ]; then
+  for SIZE in 1K 16K 256K 1M 4M 16M 64M; do
+    start_server 4 "$@"
+    echo "size=$SIZE:"
+    # keep the data set around 256M whatever the value size
+    case $SIZE in
+      *K) KEYS=$((256 * 1024 / ${SIZE%K})) ;;
+      *M) KEYS=$((256 / ${SIZE%M})) ;;
+    esac
+    [ $KEYS -gt 10000 ] && KEYS=10000
+    ./dbtest --port=$PORT --readbench --value-size=$SIZE --max=$KEYS \
+      --count=$((KEYS * 2)) --threads=4 --pipeline=4
+    stop_server
+  done
+  exit 0
+fi
+
+if [ "$BENCH" = storage ]; then
+  for BACKEND in file uring; do
+    start_server 8 --storage=$BACKEND --cache-size=0 "$@"
+    echo "storage=$BACKEND:"
+    ./dbtest --port=$PORT --readbench --value-size=4K --max=5000 \
+      --count=100000 --threads=16 --pipeline=4
+    ./dbtest --port=$PORT --batch=64 --max=5000 --value-size=1000
+    stop_server
+  done
+  exit 0
+fi
+
+if [ "$BENCH" = durability ]; then
+  for DURABILITY in none group sync; do
+    start_server 8 --durability=$DURABILITY "$@"
+    echo "durability=$DURABILITY:"
+    ./dbtest --port=$PORT --writebench --value-size=1K --max=5000 \
+      --count=$((COUNT / 4)) --threads=32
+    stop_server
+  done
+  exit 0
+fi
+
+if [ "$BENCH" = compaction ]; then
+  for ARGS in --compact-garbage=0 "" --compact-rate=0; do
+    start_server 8 $ARGS "$@"
+    echo "compaction ${ARGS:-(default)}:"
+    ./dbtest --port=$PORT --writebench --value-size=4K --max=500 \
+      --count=$COUNT --threads=8 --pipeline=4
+    ./dbtest --port=$PORT --stats | grep -E '^db_(compacted_segments|compaction_copied)'
+    stop_server
+  done
+  exit 0
+fi
+
+if [ "$BENCH" = compression ]; then
+  for CODEC in none zlib lz4; do
+    start_server 4 --compress=$CODEC --cache-size=0 "$@"
+    echo "compress=$CODEC:"
+    ./dbtest --port=$PORT --readbench --value-size=1K --max=20000 \
+      --count=$COUNT --threads=4 --pipeline=4
+    ./dbtest --port=$PORT --stats |
+      grep -E '^db_(log_bytes|compress_(kept|ratio|ns)|expand(ed|_ns))'
+    stop_server
+  done
+  exit 0
+fi
+
+if [ "$BENCH" = ttl ]; then
+  KEYS=${KEYS:-1000000}
+  start_server 4 "$@"
+  ./dbtest --port=$PORT --fill --max=$KEYS --value-size=100 --pipeline=64
+  stop_server
+  start_server 4 "$@"
+  ./dbtest --port=$PORT --fill --max=$KEYS --value-size=100 --pipeline=64 --ttl=2000
+  T0=$(date +%s%N)
+  until ./dbtest --port=$PORT --stats | grep -q '^db_ttl_keys 0$'; do
+    sleep 0.01
+  done
+  echo "all keys reclaimed $((($(date +%s%N) - T0) / 1000000)) ms after the fill"
+  ./dbtest --port=$PORT --stats | grep -E '^db_(expired_keys_total|table_keys)'
+  stop_server
+  exit 0
+fi
+
+if [ "$BENCH" = eviction ]; then
+  for ARGS in "--evict=lru" "--evict=clock" "--evict=lru --admission=tinylfu" \
+              "--evict=clock --admission=tinylfu"; do
+    start_server 4 $ARGS --evict-budget=${BUDGET:-5M} "$@"
+    echo "$ARGS:"
+    ./dbtest --port=$PORT --zipf=${ZIPF:-0.99} --max=100000 --count=$COUNT \
+      --value-size=100 --threads=4
+    ./dbtest --port=$PORT --stats | grep -E '^db_(key_evictions|admission_rejects)_total'
+    stop_server
+  done
+  exit 0
+fi
+
+if [ "$BENCH" = recovery ]; then
+  KEYS=${KEYS:-1000000}
+  LAST=FILL-$(printf %07d $((KEYS - 1)))
+
+  # restart NAME ARGS...: starts a server on the log left behind and
+  # reports how long it takes to serve the last key
+  restart() {
+    local name=$1
+    shift
+    local t0=$(date +%s%N)
+    exec 3> >(exec ./dbserver --mode=$MODE --storage=log "$@" $PORT > /dev/null)
+    SERVER_PID=$!
+    until ./dbtest --port=$PORT --get=$LAST 2> /dev/null | grep -q '^="'; do
+      sleep 0.01
+    done
+    echo "$name: ready in $((($(date +%s%N) - t0) / 1000000)) ms"
+  }
+
+  start_server 4 --snapshot-interval=0 "$@"
+  ./dbtest --port=$PORT --fill --max=$KEYS --value-size=100 --pipeline=64
+  stop_server
+  restart "clean quit, snapshot" --snapshot-interval=0 "$@"
+  ./dbtest --port=$PORT --fill --max=$((KEYS / 10)) --value-size=100 --pipeline=64
+  kill -9 $SERVER_PID
+  exec 3>&-
+  wait $SERVER_PID 2> /dev/null
+  restart "kill -9, snapshot + 10% tail" --snapshot-interval=0 "$@"
+  kill -9 $SERVER_PID
+  exec 3>&-
+  wait $SERVER_PID 2> /dev/null
+  rm -f /tmp/index.snap
+  restart "no snapshot, full replay" --snapshot-interval=0 "$@"
+  stop_server
+  exit 0
+fi
+
+for WORKERS in 1 2 4 8 16; do
+  start_server $WORKERS "$@"
+
+  echo -n "workers=$WORKERS: "
+  ./dbtest --port=$PORT --threads=$WORKERS --count=$COUNT --max=10000 \
+    --keepalive --pipeline=16 | tail -1
+
+  stop_server
+done
@@ -0,0 +1,189 @@
+/*
+ * file:        crc32c.c
+ * description: CRC32C (Castagnoli), with the SSE4.2 crc32 instruction
+ *              when the CPU has it and slicing-by-8 tables otherwise
+ */
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "crc32c.h"
+
+#define POLY 0x82f63b78         // reflected Castagnoli polynomial
+
+static uint32_t crc32c_table[8][256];
+
+const char *crc32c_impl = "table";
+
+uint32_t crc32c_portable(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+
+    crc = ~crc;
+    while (len > 0 && ((uintptr_t)p & 7)) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v ^= crc;
+        crc = crc32c_table[7][v & 0xff] ^
+              crc32c_table[6][(v >> 8) & 0xff] ^
+              crc32c_table[5][(v >> 16) & 0xff] ^
+              crc32c_table[4][(v >> 24) & 0xff] ^
+              crc32c_table[3][(v >> 32) & 0xff] ^
+              crc32c_table[2][(v >> 40) & 0xff] ^
+              crc32c_table[1][(v >> 48) & 0xff] ^
+              crc32c_table[0][v >> 56];
+    }
+    while (len-- > 0) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint32_t (*crc32c_fn)(uint32_t, const void *, size_t) = crc32c_portable;
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    return crc32c_fn(crc, buf, len);
+}
+
+#if defined(__x86_64__)
+/*
+ * The crc32 instruction takes three cycles but can start one every
+ * cycle, so long buffers are done as three interleaved streams whose
+ * CRCs are then combined: running a CRC over n more zero bytes is a
+ * linear operator, kept as four byte-indexed tables per block length.
+ */
+#define LONG_BLOCK  8192
+#define SHORT_BLOCK 256
+
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+
+    for (; vec; vec >>= 1, mat++) {
+        if (vec & 1) {
+            sum ^= *mat;
+        }
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+}
+
+/*
+ * Fills zeros with the operator for len zero bytes, len a power of two.
+ */
+static void crc32c_zeros(uint32_t zeros[4][256], size_t len) {
+    uint32_t odd[32], even[32];
+
+    // one zero bit
+    odd[0] = POLY;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = 1u << (n - 1);
+    }
+    gf2_matrix_square(even, odd);   // two bits
+    gf2_matrix_square(odd, even);   // four bits
+    uint32_t *op = odd;
+    do {
+        gf2_matrix_square(even, odd);
+        op = even;
+        len >>= 1;
+        if (len == 0) {
+            break;
+        }
+        gf2_matrix_square(odd, even);
+        op = odd;
+        len >>= 1;
+    } while (len);
+
+    for (uint32_t n = 0; n < 256; n++) {
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+static inline uint32_t crc32c_shift(uint32_t zeros[4][256], uint32_t crc) {
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+           zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint64_t crc0 = ~crc;
+
+    while (len > 0 && ((uintptr_t)p & 7)) {
+        crc0 = _mm_crc32_u8(crc0, *p++);
+        len--;
+    }
+
+    static const size_t blocks[2] = {LONG_BLOCK, SHORT_BLOCK};
+    for (int b = 0; b < 2; b++) {
+        size_t block = blocks[b];
+        while (len >= 3 * block) {
+            uint64_t crc1 = 0, crc2 = 0;
+            const unsigned char *end = p + block;
+            do {
+                crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)p);
+                crc1 = _mm_crc32_u64(crc1, *(const uint64_t *)(p + block));
+                crc2 = _mm_crc32_u64(crc2, *(const uint64_t *)(p + 2 * block));
+                p += 8;
+            } while (p < end);
+            uint32_t (*zeros)[256] = b == 0 ? crc32c_long : crc32c_short;
+            crc0 = crc32c_shift(zeros, crc0) ^ crc1;
+            crc0 = crc32c_shift(zeros, crc0) ^ crc2;
+            p += 2 * block;
+            len -= 3 * block;
+        }
+    }
+
+    for (; len >= 8; len -= 8, p += 8) {
+        crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)p);
+    }
+    while (len-- > 0) {
+        crc0 = _mm_crc32_u8(crc0, *p++);
+    }
+    return ~(uint32_t)crc0;
+}
+#endif
+
+/*
+ * Builds the tables and picks an implementation before main() runs.
+ */
+__attribute__((constructor))
+static void crc32c_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        }
+        crc32c_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = crc32c_table[0][n];
+        for (int k = 1; k < 8; k++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][n] = crc;
+        }
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_zeros(crc32c_long, LONG_BLOCK);
+        crc32c_zeros(crc32c_short, SHORT_BLOCK);
+        crc32c_fn = crc32c_sse42;
+        crc32c_impl = "sse4.2";
+    }
+#endif
+}
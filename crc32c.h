@@ -0,0 +1,24 @@
+/*
+ * file:        crc32c.h
+ * description: CRC32C (Castagnoli) checksums
+ */
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Same calling convention as zlib's crc32(): start from 0 and pass the
+ * previous result to continue, so crc32c(crc32c(0, a), b) is the CRC of
+ * a followed by b. Uses the SSE4.2 crc32 instruction when the CPU has
+ * it, the table-driven version otherwise.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* the table-driven version, whatever the CPU */
+uint32_t crc32c_portable(uint32_t crc, const void *buf, size_t len);
+
+/* "sse4.2" or "table", for whichever crc32c() uses */
+extern const char *crc32c_impl;
+
+#endif
@@ -1,494 +1,6715 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <argp.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <endian.h>
+#include <zlib.h>
 #include "proj2.h"
+#include "crc32c.h"
+#include "uring.h"
+#include "lz4.h"
 
-#define MAX_KEYS 200
 #define BUFFER_LENGTH 4096
+#define CONN_BUFFER_LENGTH (sizeof(struct request) + BUFFER_LENGTH)
+#define MAX_VALUE_LENGTH REQUEST_MAX_LEN  // values over BUFFER_LENGTH are streamed
+#define BATCH_MAX_LENGTH (BATCH_MAX_KEYS * CONN_BUFFER_LENGTH)
 #define STATE_INVALID 0
-#define STATE_BUSY    1
+#define STATE_PENDING 1         // indexed, but no version committed yet
 #define STATE_VALID   2
 
 static int server_socket;
 
-static pthread_mutex_t q_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t q_cond = PTHREAD_COND_INITIALIZER;
-
-static int stats_writes = 0;
-static int stats_reads  = 0;
-static int stats_deletes = 0;
-static int stats_fails  = 0;
+/*
+ * The database table, split into shards by key hash. Each shard has its
+ * own lock, entries, index, free list and share of the value cache, so
+ * requests for keys in different shards never wait for each other. No
+ * shard lock is held across storage I/O.
+ *
+ * Entries are allocated CHUNK_KEYS at a time and never move, so a slot
+ * number stays valid for as long as the server runs and growing a shard
+ * never copies existing entries. Storage sees a single slot id space:
+ * local slot * n_shards + shard number.
+ */
+#define CHUNK_KEYS 4096
+#define MAX_SHARDS 1024
 
+/*
+ * Where a stored value lives. The log backend keeps the segment and the
+ * offset of the record header; the file backend keeps the slot id and
+ * the version number in the file name. Either way the value's CRC32C is
+ * kept alongside, and whatever is read back is checked against it. So
+ * are how it was packed and when it lapses, which the log also records.
+ */
+struct location {
+    uint32_t seg;
+    uint32_t len;               /* bytes stored */
+    uint64_t off;
+    uint32_t crc;               /* CRC32C of them */
+    uint8_t codec;              /* how they pack the value, CODEC_* */
+    uint16_t gen;               /* log: the segment slot's, see log_pin_loc() */
+    uint64_t expires;           /* ms since the epoch, 0 = never */
+};
 
-static struct {
+struct entry {
     char name[32];
     int state;
-} table[MAX_KEYS]; // database table
+    uint32_t version;           /* bumped whenever the stored value changes */
+    uint64_t committed;         /* ticket of the version at loc */
+    int writers;                /* writes in flight */
+    uint64_t hash;
+    struct location loc;
+    char *value;                /* cached copy of the value, or NULL */
+    int value_len;
+    uint32_t lru_prev, lru_next;
+    uint32_t timer_prev, timer_next;
+    uint16_t timer_slot;        /* wheel list it is on plus one, 0 = none */
+    uint8_t referenced;         /* used since the CLOCK hand went by */
+    uint32_t last_used;         /* shard's access_clock when last used */
+};
+
+/*
+ * Hash index over a shard's entries.
+ *
+ * Open addressing over 64-byte buckets, each holding eight (fingerprint,
+ * slot) pairs, probed bucket by bucket. The fingerprint is the high half
+ * of the key's 64-bit hash, so a probe only falls back to strcmp() when
+ * 32 bits of hash already match. Deleted pairs become tombstones.
+ *
+ * When live pairs plus tombstones pass 3/4 of capacity a new array is
+ * allocated and pairs are moved over a few buckets per index operation,
+ * so a resize never stalls a request. While that is going on a key may
+ * be in either array; lookups check both.
+ */
+#define BUCKET_SLOTS 8
+#define SLOT_EMPTY   0xffffffffu
+#define SLOT_TOMB    0xfffffffeu
+#define MIN_BUCKETS  64
+#define REHASH_STEP  8          /* buckets moved per index operation */
+
+struct bucket {
+    uint32_t fp[BUCKET_SLOTS];
+    uint32_t slot[BUCKET_SLOTS];
+} __attribute__((aligned(64)));
+
+struct index {
+    struct bucket *buckets;
+    uint32_t nbuckets;          // power of two
+    uint32_t used;              // live pairs
+    uint32_t tombs;             // tombstones
+};
+
+/*
+ * Value cache. Valid entries may keep a copy of their value so reads don't
+ * have to touch storage; cached entries are linked on their shard's LRU
+ * list and the least recently read are dropped once the copies add up to
+ * more than the shard's share of cache_limit.
+ */
+#define LRU_NONE 0xffffffffu
+
+/*
+ * Expiry timing wheel, per shard: WHEEL_LEVELS wheels of WHEEL_SLOTS
+ * lists of keys, a slot on level l spanning WHEEL_SLOTS^l ticks. See
+ * timer_insert().
+ */
+#define WHEEL_BITS    6
+#define WHEEL_SLOTS   (1 << WHEEL_BITS)
+#define WHEEL_LEVELS  5         // 64^5 ticks, 124 days; later ones go round again
+#define WHEEL_TICK_MS 10
+
+struct shard {
+    pthread_mutex_t lock;       // guards everything below
+    int num;
+
+    struct entry **chunks;
+    uint32_t n_chunks, chunks_cap;
+
+    struct index cur;           // where new keys go
+    struct index old;           // being drained into cur, if buckets != NULL
+    uint32_t rehash_pos;        // next old bucket to move
+
+    uint32_t *free_slots;       // stack of unused entries
+    uint32_t n_free, free_cap;
+
+    size_t mem_used;            // chunks and index arrays
+
+    // Writes and deletes take tickets from here rather than per key, so
+    // a key's tickets keep growing even when its entry is dropped and
+    // reused: the log keeps them, and recovery compares them.
+    uint64_t last_ticket;
+    int in_flight[2];           // writes begun, by snapshot epoch
+
+    uint32_t lru_head, lru_tail;
+    size_t cache_bytes;
+    uint64_t cache_hits, cache_misses, cache_evictions;
+
+    // keys with a TTL, see the timing wheel
+    uint32_t wheel[WHEEL_LEVELS * WHEEL_SLOTS];
+    uint64_t wheel_tick;        // the next tick to run
+    uint32_t timers;
+
+    // cache mode, see evict_one()
+    size_t key_bytes;           // KEY_COST() of every committed key
+    uint32_t access_clock;      // ticks on every key used
+    uint32_t clock_hand;
+    uint32_t evict_rand;
+    uint8_t *sketch;            // SKETCH_ROWS x SKETCH_WIDTH counters, or NULL
+    uint32_t sketch_adds;
+    uint64_t key_evictions, evicted_bytes, admit_rejects;
+} __attribute__((aligned(64)));
+
+#define ENTRY(sh, idx) (&(sh)->chunks[(idx) / CHUNK_KEYS][(idx) % CHUNK_KEYS])
+
+static struct shard *shards;
+static int n_shards = 16;
+
+static size_t mem_limit;        // 0 = no ceiling, split evenly over shards
+static size_t cache_limit = 64 << 20;
 
-struct work_item {
+// cache mode: keys evicted to make room rather than writes refused
+#define EVICT_NONE  0
+#define EVICT_LRU   1           // sampled: the least recently used of a few
+#define EVICT_CLOCK 2
+static int evict_policy = EVICT_NONE;
+static size_t evict_budget;     // bytes for keys and values, 0 = until full
+static int evict_admission;     // TinyLFU: don't evict for colder keys
+
+#define KEY_COST(e)    (sizeof(struct entry) + (e)->loc.len)
+#define EVICT_SAMPLES  5
+#define EVICT_MAX      8        // keys one write may evict
+#define EVICT_PENDING  128      // evicted keys a thread holds until unlocked
+
+// uncached values at least this big are sent straight from storage
+static int zero_copy_min = 16384;
+// read them once first to check their CRC32C, rather than leave that to
+// clients checking the one sent with v2 replies
+static int zero_copy_verify;
+
+/*
+ * A value to be sent straight from storage, without copying it through a
+ * user-space buffer: either a range of an open file (sent with sendfile,
+ * fd closed once done) or of a mapped log segment (written from the
+ * mapping).
+ */
+struct value_ref {
+    int fd;                     /* -1 when sending from map */
+    const char *map;
+    off_t off;
+    int len;
+};
+
+/*
+ * Storage backends. Each one is a set of functions that store, fetch and
+ * remove the value for a table slot; the table and index don't care which
+ * one is in use. Neither is called with a shard lock held. Writes and
+ * removes come with the ticket they took (see struct shard), for backends
+ * that keep it.
+ *
+ *   write   stores len bytes for the key, filling in *loc; loc->codec
+ *           and loc->expires come in set, and are kept with the bytes
+ *           where the backend keeps anything
+ *   read    reads the value at loc into buf, returning its length or -1
+ *   remove  forgets the value stored for a key that was just dropped
+ *   release called when loc was superseded by a newer write
+ *   discard the same for a version that was never published because a
+ *           later write or delete overtook it; it must not come back
+ *           after a restart
+ *   open_ref fills in a value_ref for sending the value at loc without
+ *           reading it, returning 0 if that isn't possible; only with
+ *           zero_copy_verify does it read the value to check it
+ *   write_begin, write_end
+ *           store a value too big to hold in memory: write_begin fills in
+ *           *loc and points a value_writer at where the len bytes go,
+ *           which are then handed over piece by piece with
+ *           value_writer_put(); write_end is always called afterwards,
+ *           with ok clear if a piece failed, and returns whether the
+ *           value is now stored
+ *   write_many stores several values at once, as one piece of I/O where
+ *           the backend can, setting ok and loc on each
+ *   sync    makes everything written so far durable, for group commit
+ *
+ * Writes and removes call commit_note() once they are done, and under
+ * --durability=sync flush their own data before returning.
+ */
+struct value_writer {
     int fd;
-    struct work_item *next;
+    off_t off;                  /* where the next piece goes */
+    uint32_t crc;               /* CRC32C of the pieces so far */
+    // log: the record's place, listed on log_streams until it ends
+    uint32_t seg;
+    uint64_t start;
+    struct value_writer *prev, *next;
 };
 
-static struct {
-    struct work_item *head;
-    struct work_item *tail;
-} work_queue = {NULL, NULL}; // work queue
+struct batch_write {
+    uint32_t idx;
+    const char *name;
+    uint64_t ticket;
+    const char *data;
+    int len;
+    int ok;
+    struct location loc;
+};
+
+struct storage {
+    const char *name;
+    int (*write)(uint32_t idx, const char *name, uint64_t ticket,
+                 const char *data, int len, struct location *loc);
+    int (*read)(uint32_t idx, const struct location *loc, char *buf, int len);
+    void (*remove)(uint32_t idx, const char *name, uint64_t ticket,
+                   const struct location *loc);
+    void (*release)(const struct location *loc);
+    void (*discard)(const struct location *loc);
+    int (*open_ref)(uint32_t idx, const struct location *loc,
+                    struct value_ref *ref);
+    int (*write_begin)(uint32_t idx, const char *name, uint64_t ticket, int len,
+                       struct location *loc, struct value_writer *w);
+    int (*write_end)(struct value_writer *w, struct location *loc, int ok);
+    void (*write_many)(struct batch_write *w, int n);
+    void (*sync)(void);
+};
+
+static struct storage *storage;
+
+/*
+ * Log backend state. Values are appended to segment files of up to
+ * SEGMENT_SIZE bytes, each value as a record_hdr followed by its bytes;
+ * a delete appends a header-only tombstone. log_lock only covers handing
+ * out space at the end of the active segment, the writes themselves run
+ * in parallel.
+ *
+ * A segment's file is named after its id, which only ever grows, so ids
+ * give the order of the log. In memory it sits in one of MAX_SEGMENTS
+ * slots, and locations name the slot. Slots are reused once compaction
+ * has emptied them, so MAX_SEGMENTS only bounds the segments alive at
+ * once; each reuse bumps the slot's gen, which locations carry too.
+ */
+#define SEGMENT_SIZE (64 << 20)
+#define MAX_SEGMENTS 65536
+#define RECORD_MAGIC 0x33524244 /* "DBR3" */
+#define RECORD_TOMBSTONE 1
+#define RECORD_DISCARDED 2      /* a write that lost to a later one */
+#define RECORD_CODEC_SHIFT 8    /* the value's codec, in flags bits 8-15 */
+#define RECORD_CODEC_MASK  (0xffu << RECORD_CODEC_SHIFT)
+
+struct record_hdr {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t len;               /* value bytes that follow */
+    uint32_t crc;               /* CRC32C of them */
+    uint64_t seq;               /* order of appends across segments */
+    uint64_t ticket;            /* the write's or delete's, see struct shard */
+    uint64_t expires;           /* see struct location */
+    char name[32];
+};
+
+struct segment {
+    int fd;
+    char *map;                  /* read-only mapping of the whole segment */
+    size_t map_len;
+    uint64_t size;              /* bytes handed out so far */
+    uint64_t dead;              /* bytes of superseded records */
+    int dirty;                  /* written since the committer last synced it */
+    int writing;                /* records reserved but not yet written */
+    int readers;                /* reading from map right now */
+    int retired;                /* compacted away: map is going */
+    uint64_t id;                /* names its file; higher is later */
+    uint16_t gen;               /* bumped each time the slot is reused */
+};
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct segment segments[MAX_SEGMENTS];
+static int n_segments;              // slots ever used
+static int log_active = -1;         // the slot appends go to
+static uint64_t log_next_id;
+static int free_slots[MAX_SEGMENTS], n_free;    // emptied by compaction
+static uint64_t log_seq;
+static uint64_t log_appended;       // bytes, compaction's copies included
+static struct value_writer *log_streams;    // streamed records not yet ended
+static int64_t compact_from_id = -1;    // where the running compaction's
+static uint64_t compact_from_off;       // copies start, see compact_segment()
+
+/*
+ * Index snapshots, for restarting the log backend (file names don't say
+ * which key a file holds, so the file backends start empty). A snapshot
+ * is the table's committed keys and locations, plus the point in the log
+ * it covers; on startup it is loaded and only the log after that point
+ * is replayed. See snapshot_take() and log_recover().
+ */
+#define SNAPSHOT_FILE  "/tmp/index.snap"
+#define SNAPSHOT_MAGIC 0x34504e53 /* "SNP4" */
+
+static int snapshot_interval = 60;  // seconds, 0 = only on quit
+static uint32_t snapshot_epoch;     // bumped by each snapshot, see write_begin_locked()
+
+/*
+ * Logging. Messages are formatted by the calling thread into a ring of
+ * its own and written out by a background flusher, so a slow stdout
+ * never holds up a request; when a ring is full the message is dropped
+ * and counted instead. Each ring has one writer and one reader, so the
+ * two positions are all the synchronization it needs.
+ *
+ * Messages above log_level are skipped before any formatting; requests
+ * are logged at LOG_DEBUG, which is off by default.
+ */
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+
+#define LOG_RING_SIZE (64 * 1024)  // power of two
+#define LOG_LINE_MAX  512
+
+struct log_ring {
+    uint64_t head __attribute__((aligned(64)));  // flushed up to here
+    uint64_t tail __attribute__((aligned(64)));  // written up to here
+    uint64_t dropped;
+    struct log_ring *next;
+    char buf[LOG_RING_SIZE];
+};
+
+static int log_level = LOG_INFO;
+static struct log_ring *log_rings;
+static pthread_mutex_t log_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct log_ring *my_log;
+
+#define LOG(level, ...) \
+    do { \
+        if ((level) <= log_level) { \
+            log_msg(__VA_ARGS__); \
+        } \
+    } while (0)
+
+// perror() for threads that keep running
+#define LOG_ERRNO(what) LOG(LOG_ERROR, "%s: %s\n", (what), strerror(errno))
+
+void log_msg(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+void log_msg(const char *fmt, ...) {
+    char line[LOG_LINE_MAX];
+    va_list ap;
+
+    if (!my_log) {
+        my_log = calloc(1, sizeof(*my_log));
+        if (!my_log) {
+            return;
+        }
+        pthread_mutex_lock(&log_rings_lock);
+        my_log->next = log_rings;
+        log_rings = my_log;
+        pthread_mutex_unlock(&log_rings_lock);
+    }
+
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+        return;
+    }
+    if (len >= sizeof(line)) {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+
+    struct log_ring *r = my_log;
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (r->tail + len - head > LOG_RING_SIZE) {
+        __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    size_t pos = r->tail % LOG_RING_SIZE;
+    size_t first = len < LOG_RING_SIZE - pos ? len : LOG_RING_SIZE - pos;
+    memcpy(r->buf + pos, line, first);
+    memcpy(r->buf, line + first, len - first);
+    __atomic_store_n(&r->tail, r->tail + len, __ATOMIC_RELEASE);
+}
+
+/*
+ * Writes out everything queued in the rings.
+ *
+ * Returns the number of bytes written.
+ */
+size_t log_flush(void) {
+    size_t total = 0;
+
+    pthread_mutex_lock(&log_rings_lock);
+    for (struct log_ring *r = log_rings; r; r = r->next) {
+        uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        uint64_t head = r->head;
+        while (head < tail) {
+            size_t pos = head % LOG_RING_SIZE;
+            size_t n = tail - head < LOG_RING_SIZE - pos ? tail - head : LOG_RING_SIZE - pos;
+            ssize_t w = write(STDOUT_FILENO, r->buf + pos, n);
+            if (w <= 0) {
+                break; // lost; don't spin on a dead stdout
+            }
+            head += w;
+        }
+        total += tail - r->head;
+        __atomic_store_n(&r->head, tail, __ATOMIC_RELEASE);
+
+        uint64_t dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) {
+            fprintf(stderr, "log: dropped %llu messages\n", (unsigned long long)dropped);
+        }
+    }
+    pthread_mutex_unlock(&log_rings_lock);
+    return total;
+}
+
+void* log_flusher_thread(void *arg) {
+    while (1) {
+        if (log_flush() == 0) {
+            usleep(10000);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Statistics. Every thread that serves requests counts into a
+ * thread_stats of its own, padded to a cache line so no two threads
+ * write the same line; print_stats() adds them up. Only the owning
+ * thread writes its counters, so a relaxed load and store is enough.
+ *
+ * Latencies go into log-bucketed histograms per op (R/W/D) and phase:
+ * four buckets per power of two of nanoseconds, so a percentile is off
+ * by at most a quarter.
+ */
+#define HIST_BUCKETS 256
+
+#define OP_READ   0
+#define OP_WRITE  1
+#define OP_DELETE 2
+#define OP_BATCH  3
+#define N_OPS     4
+
+#define PHASE_TOTAL   0         // from arrival to response queued
+#define PHASE_QUEUE   1         // arrived, waiting for a thread
+#define PHASE_LOCK    2         // waiting for shard locks
+#define PHASE_STORAGE 3         // in storage calls
+#define PHASE_WRITE   4         // socket writes, per flush, under the last op flushed
+#define N_PHASES      5
+
+struct thread_stats {
+    uint64_t writes, reads, deletes, fails;
+    uint64_t batches;           // the keys in them count as writes etc.
+    uint64_t zero_copy;
+    uint64_t storage_crc_errors;    // values that didn't match their checksum
+    uint64_t request_crc_errors;    // v2 request bodies that didn't
+    uint64_t compress_tried;        // values big enough to compress
+    uint64_t compress_kept;         // ...that saved enough to stay packed
+    uint64_t compress_in, compress_out;     // their bytes, and as stored
+    uint64_t compress_ns;
+    uint64_t expanded, expand_ns;   // packed values read back
+    uint64_t ttl_writes;            // writes that set a TTL
+    uint64_t expired;               // keys reclaimed once their TTL was up
+    uint64_t expired_reads;         // requests that found a key lapsed
+    uint64_t hist[N_OPS][N_PHASES][HIST_BUCKETS];
+    struct thread_stats *next;
+} __attribute__((aligned(64)));
+
+static struct thread_stats *all_stats;
+static pthread_mutex_t all_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct thread_stats *my_stats;
+
+// lock and storage time of the request being executed on this thread
+static __thread uint64_t lock_ns, storage_ns;
+
+#define STAT_ADD(field, n) \
+    __atomic_store_n(&my_stats->field, my_stats->field + (n), __ATOMIC_RELAXED)
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Gives the calling thread its own counters, the first time it needs them.
+ */
+void stats_attach(void) {
+    if (my_stats) {
+        return;
+    }
+    my_stats = aligned_alloc(64, sizeof(*my_stats));
+    if (!my_stats) {
+        perror("aligned_alloc");
+        exit(1);
+    }
+    memset(my_stats, 0, sizeof(*my_stats));
+    pthread_mutex_lock(&all_stats_lock);
+    my_stats->next = all_stats;
+    all_stats = my_stats;
+    pthread_mutex_unlock(&all_stats_lock);
+}
+
+int hist_bucket(uint64_t ns) {
+    if (ns < 4) {
+        return ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    return (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+}
+
+/*
+ * Smallest value that falls in the bucket after b.
+ */
+uint64_t hist_bound(int b) {
+    b++;
+    if (b < 4) {
+        return b;
+    }
+    return (uint64_t)(4 + b % 4) << (b / 4 - 1);
+}
+
+void hist_record(int op, int phase, uint64_t ns) {
+    STAT_ADD(hist[op][phase][hist_bucket(ns)], 1);
+}
+
+int op_index(char op) {
+    switch (op) {
+    case 'R': return OP_READ;
+    case 'W': case 'T': return OP_WRITE;
+    case 'D': return OP_DELETE;
+    case 'B': return OP_BATCH;
+    }
+    return -1;
+}
+
+/*
+ * Durability (--durability). With none, a write is acknowledged once
+ * the kernel has it. With sync, every write flushes its own data to disk
+ * before it returns. With group, the flush is shared: each write takes a
+ * ticket from commit_note(), a committer thread syncs the backend once
+ * commit_interval_ms have passed since the first write it hasn't
+ * covered, or sooner once commit_bytes have piled up, and a reply isn't
+ * sent until the sync covering its request's ticket is done. Readers may
+ * see a value before it is durable; only the acknowledgement waits.
+ *
+ * Blocking workers wait in commit_wait(). The event loops park their
+ * connections instead (commit_hold()) and hear from the committer
+ * through an eventfd each after every sync.
+ */
+#define DURABLE_NONE  0
+#define DURABLE_GROUP 1
+#define DURABLE_SYNC  2
+
+static int durability = DURABLE_NONE;
+static int commit_interval_ms = 2;
+static size_t commit_bytes = 1 << 20;
+
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_work;      // the committer waits for writes, see main()
+static pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;
+static uint64_t commit_written;         // tickets handed out
+static uint64_t commit_synced;          // tickets covered by a finished sync
+static size_t commit_pending;           // bytes written since the last sync began
+static uint64_t commit_syncs, commit_sync_ns;
+
+struct commit_loop {
+    int efd;
+    struct conn *held;          /* connections whose replies wait for a sync */
+    struct commit_loop *next;
+};
+
+static struct commit_loop *commit_loops;    // under commit_lock
+static __thread struct commit_loop *my_commit_loop;
+
+// ticket the request being executed on this thread waits for, or 0
+static __thread uint64_t commit_needed;
+
+// the directory values live in, synced along with them
+static int data_dir_fd = -1;
+
+/*
+ * Hands the write that was just done a ticket, under group commit.
+ */
+void commit_note(size_t bytes) {
+    if (durability != DURABLE_GROUP) {
+        return;
+    }
+    pthread_mutex_lock(&commit_lock);
+    commit_needed = ++commit_written;
+    commit_pending += bytes;
+    // the committer only needs a nudge to start a group or to cut it short
+    if (commit_written == commit_synced + 1 || commit_pending >= commit_bytes) {
+        pthread_cond_signal(&commit_work);
+    }
+    pthread_mutex_unlock(&commit_lock);
+}
+
+/*
+ * Blocks until the writes up to ticket are durable.
+ */
+void commit_wait(uint64_t ticket) {
+    if (ticket <= __atomic_load_n(&commit_synced, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_mutex_lock(&commit_lock);
+    while (commit_synced < ticket) {
+        pthread_cond_wait(&commit_done, &commit_lock);
+    }
+    pthread_mutex_unlock(&commit_lock);
+}
+
+void* committer_thread(void *arg) {
+    pthread_mutex_lock(&commit_lock);
+    while (1) {
+        while (commit_written == commit_synced) {
+            pthread_cond_wait(&commit_work, &commit_lock);
+        }
+
+        // the group's first write starts the clock
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += commit_interval_ms * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (commit_pending < commit_bytes &&
+               pthread_cond_timedwait(&commit_work, &commit_lock, &deadline) != ETIMEDOUT)
+            ;
+
+        uint64_t target = commit_written;
+        commit_pending = 0;
+        pthread_mutex_unlock(&commit_lock);
+
+        uint64_t start = now_ns();
+        storage->sync();
+        uint64_t took = now_ns() - start;
+
+        pthread_mutex_lock(&commit_lock);
+        __atomic_store_n(&commit_synced, target, __ATOMIC_RELEASE);
+        commit_syncs++;
+        commit_sync_ns += took;
+        pthread_cond_broadcast(&commit_done);
+        for (struct commit_loop *l = commit_loops; l; l = l->next) {
+            uint64_t one = 1;
+            write(l->efd, &one, sizeof(one));
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Gives the calling event loop an eventfd in ep for the committer to
+ * kick, under group commit.
+ *
+ * Returns it, or NULL when replies are never held.
+ */
+struct commit_loop *commit_attach(int ep) {
+    if (durability != DURABLE_GROUP) {
+        return NULL;
+    }
+    struct commit_loop *l = calloc(1, sizeof(*l));
+    if (!l || (l->efd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        perror("commit_attach");
+        exit(1);
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = l};
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, l->efd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    pthread_mutex_lock(&commit_lock);
+    l->next = commit_loops;
+    commit_loops = l;
+    pthread_mutex_unlock(&commit_lock);
+    my_commit_loop = l;
+    return l;
+}
+
+/*
+ * Work queue: a bounded lock-free ring of accepted fds, shared by the
+ * listener (producer) and the worker threads (consumers).
+ *
+ * Each cell carries a sequence number saying whose turn it is: a cell at
+ * position pos is free for the producer that claims pos when seq == pos,
+ * and holds an fd for the consumer that claims pos when seq == pos + 1.
+ * Positions are claimed with a compare-and-swap, so no thread ever holds
+ * a lock. The depth is just enq_pos - deq_pos.
+ *
+ * Threads only sleep when the queue is empty (consumers) or full (the
+ * producer), on a futex word that the other side bumps when it makes
+ * progress and sees someone asleep.
+ */
+#define WORK_QUEUE_SIZE 1024    // power of two
+
+struct work_cell {
+    uint64_t seq;
+    int fd;
+    uint64_t queued_at;         // now_ns() when it was queued
+};
+
+struct work_queue {
+    uint64_t enq_pos __attribute__((aligned(64)));
+    uint64_t deq_pos __attribute__((aligned(64)));
+    uint32_t not_empty __attribute__((aligned(64)));
+    uint32_t not_full;
+    struct work_cell cells[WORK_QUEUE_SIZE] __attribute__((aligned(64)));
+};
+
+static struct work_queue work_queue;
+
+void work_queue_init(struct work_queue *q) {
+    memset(q, 0, sizeof(*q));
+    for (int i = 0; i < WORK_QUEUE_SIZE; i++) {
+        q->cells[i].seq = i;
+    }
+}
+
+/*
+ * Number of fds waiting in the queue.
+ */
+int work_queue_depth(struct work_queue *q) {
+    uint64_t enq = __atomic_load_n(&q->enq_pos, __ATOMIC_SEQ_CST);
+    uint64_t deq = __atomic_load_n(&q->deq_pos, __ATOMIC_SEQ_CST);
+    return enq > deq ? enq - deq : 0;
+}
+
+/*
+ * Adds an fd unless the queue is full.
+ */
+int work_try_push(struct work_queue *q, int fd, uint64_t queued_at) {
+    uint64_t pos = __atomic_load_n(&q->enq_pos, __ATOMIC_RELAXED);
+    struct work_cell *cell;
+
+    for (;;) {
+        cell = &q->cells[pos & (WORK_QUEUE_SIZE - 1)];
+        int64_t diff = (int64_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) -
+                       (int64_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->enq_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->enq_pos, __ATOMIC_RELAXED);
+        }
+    }
+    cell->fd = fd;
+    cell->queued_at = queued_at;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * Takes the oldest fd, or returns -1 if the queue is empty.
+ */
+int work_try_pop(struct work_queue *q, uint64_t *queued_at) {
+    uint64_t pos = __atomic_load_n(&q->deq_pos, __ATOMIC_RELAXED);
+    struct work_cell *cell;
+
+    for (;;) {
+        cell = &q->cells[pos & (WORK_QUEUE_SIZE - 1)];
+        int64_t diff = (int64_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) -
+                       (int64_t)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->deq_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&q->deq_pos, __ATOMIC_RELAXED);
+        }
+    }
+    int fd = cell->fd;
+    *queued_at = cell->queued_at;
+    __atomic_store_n(&cell->seq, pos + WORK_QUEUE_SIZE, __ATOMIC_RELEASE);
+    return fd;
+}
+
+/*
+ * Wakes the threads sleeping on event, if there are any. The low bit of
+ * the event word says someone is asleep; clearing it means only the
+ * first waker after they went to sleep pays for the system call. The
+ * fence orders our update of the queue before the check, pairing with
+ * the sleeper setting the bit before it rechecks the queue.
+ */
+static void queue_wake(uint32_t *event) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint32_t v = __atomic_load_n(event, __ATOMIC_SEQ_CST);
+    while (v & 1) {
+        if (__atomic_compare_exchange_n(event, &v, v + 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            syscall(SYS_futex, event, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+            break;
+        }
+    }
+}
+
+/*
+ * Sleeps on event unless the queue's depth is no longer what we waited
+ * for (0 for consumers, full for the producer) once we've announced
+ * ourselves.
+ */
+static void queue_sleep(struct work_queue *q, uint32_t *event, int depth) {
+    uint32_t seen = __atomic_or_fetch(event, 1, __ATOMIC_SEQ_CST);
+
+    if (work_queue_depth(q) == depth) {
+        syscall(SYS_futex, event, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+    }
+}
+
+/*
+ * Enqueues a new work item to the work queue, waiting while it is full.
+ */
+void enqueue_work(struct work_queue *q, int fd, uint64_t queued_at) {
+    while (!work_try_push(q, fd, queued_at)) {
+        queue_sleep(q, &q->not_full, WORK_QUEUE_SIZE);
+    }
+    queue_wake(&q->not_empty);
+}
+
+/*
+ * Dequeues a work item from the work queue, waiting while it is empty.
+ */
+int dequeue_work(struct work_queue *q, uint64_t *queued_at) {
+    int fd;
+
+    while ((fd = work_try_pop(q, queued_at)) < 0) {
+        queue_sleep(q, &q->not_empty, 0);
+    }
+    queue_wake(&q->not_full);
+    return fd;
+}
+
+/*
+ * Reads a fixed number of bytes from a file descriptor.
+ */
+int read_bytes(int fd, void *buf, int count) {
+    int n;
+    int bytes_read = 0;
+    while (bytes_read < count) {
+        n = read(fd, buf + bytes_read, count - bytes_read);
+        if (n <= 0) {
+            return 0;
+        }
+        bytes_read += n;
+    }
+    return 1;
+}
+
+/*
+ * Writes a fixed number of bytes to a file descriptor.
+ */
+int write_bytes(int fd, void *buf, int count) {
+    int n;
+    int bytes_written = 0;
+    while (bytes_written < count) {
+        n = write(fd, buf + bytes_written, count - bytes_written);
+        if (n <= 0) {
+            return 0;
+        }
+        bytes_written += n;
+    }
+    return 1;
+}
+
+/*
+ * A value_ref queued on a connection. It goes out once the first mark
+ * bytes of the connection's out buffer have been sent.
+ */
+struct out_ref {
+    struct value_ref ref;
+    int mark;
+    struct out_ref *next;
+};
+
+/*
+ * A persistent client connection. Requests are read through rbuf so that
+ * several pipelined frames can be consumed with a single read(), and
+ * responses are collected in out and only flushed when the client has
+ * no more requests waiting, so a pipelined burst is answered in one write.
+ *
+ * The same structure backs both server modes: thread-pool workers block
+ * on it, while the epoll loops feed it from non-blocking sockets and use
+ * state/req to remember how far the current frame has been parsed.
+ */
+struct conn {
+    int fd;
+    int state;                  /* CONN_HEADER, CONN_BODY or CONN_STREAM */
+    int eof;                    /* client shut down its side */
+    int closing;                /* hang up once out is drained */
+    struct request req;         /* header of the frame being parsed */
+    uint64_t req_id;            /* and its id, for v2 */
+    int req_flags;              /* v2 flags */
+    uint32_t req_crc;           /* v2 checksum of the request's value */
+    uint32_t reply_crc;         /* and of the reply's, if asked for */
+    int proto;                  /* 1 or 2 once the first byte is in, else 0 */
+    int body_len;
+    char *rbuf;                 /* rcap bytes, or NULL */
+    int rpos, rlen, rcap;
+    char *out;
+    int out_pos, out_len, out_cap;
+    struct out_ref *refs, *refs_tail;
+    int ref_bytes;              /* still to send from refs */
+    uint64_t filled_at;         /* when bytes last arrived */
+    uint64_t queued_at;         /* when a worker was asked for, until the first frame */
+    int last_op;                /* OP_* of the last response queued, or -1 */
+    struct remote_op *remote;   /* frame being run by another core */
+    int orphaned;               /* hung up while remote or held */
+    struct stream *stream;      /* value being passed on to storage */
+    uint64_t commit_ticket;     /* group commit the queued replies wait for */
+    int held;                   /* on its loop's commit_loop list */
+    struct conn *held_next;
+};
+
+#define CONN_HEADER 0
+#define CONN_BODY   1
+#define CONN_STREAM 2           // body too big to buffer, see stream_begin()
+
+// rbuf size while streaming a value
+#define STREAM_CHUNK (64 * 1024)
+
+#define OUT_HIGH_WATER (64 * 1024)
+
+/*
+ * Queues bytes for the client.
+ */
+int conn_write_bytes(struct conn *c, void *buf, int count) {
+    if (c->out_len + count > c->out_cap) {
+        int cap = c->out_cap ? c->out_cap : CONN_BUFFER_LENGTH;
+        while (cap < c->out_len + count) {
+            cap *= 2;
+        }
+        char *out = realloc(c->out, cap);
+        if (!out) {
+            LOG_ERRNO("realloc");
+            return 0;
+        }
+        c->out = out;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, buf, count);
+    c->out_len += count;
+    return 1;
+}
+
+/*
+ * Queues a response header for the request in c->req, in the
+ * connection's protocol. len is left out of legacy headers when -1.
+ * A v2 reply carries c->reply_crc when the request asked for it.
+ */
+int conn_reply(struct conn *c, char status, int len) {
+    if (c->proto == 2) {
+        struct request_v2 h = {
+            .magic = REQUEST_V2_MAGIC,
+            .version = REQUEST_V2_VERSION,
+            .op = status,
+            .value_len = htole32(len < 0 ? 0 : len),
+            .id = htole64(c->req_id),
+        };
+        if (c->req_flags & REQUEST_V2_CHECKSUM) {
+            h.flags = REQUEST_V2_CHECKSUM;
+            h.crc = htole32(status == 'K' ? c->reply_crc : 0);
+        }
+        return conn_write_bytes(c, &h, sizeof(h));
+    }
+    struct request res;
+    memset(&res, 0, sizeof(res));
+    res.op_status = status;
+    if (len >= 0) {
+        set_request_len(&res, len);
+    }
+    return conn_write_bytes(c, &res, sizeof(res));
+}
+
+/*
+ * Queues a value to be sent from storage after what is already buffered.
+ * The connection takes over ref's file descriptor.
+ */
+int conn_write_ref(struct conn *c, struct value_ref *ref) {
+    struct out_ref *r = malloc(sizeof(*r));
+    if (!r) {
+        LOG_ERRNO("malloc");
+        if (ref->fd >= 0) {
+            close(ref->fd);
+        }
+        return 0;
+    }
+    r->ref = *ref;
+    r->mark = c->out_len;
+    r->next = NULL;
+    if (c->refs_tail) {
+        c->refs_tail->next = r;
+    } else {
+        c->refs = r;
+    }
+    c->refs_tail = r;
+    c->ref_bytes += ref->len;
+    return 1;
+}
+
+/*
+ * Sends the rest of a file ref.
+ *
+ * Returns 1 once all of it is sent, 0 if the socket would block, -1 on
+ * error (including the file turning out shorter than promised).
+ */
+int ref_send(int fd, struct value_ref *ref, int *ref_bytes) {
+    while (ref->len > 0) {
+        ssize_t n = sendfile(fd, ref->fd, &ref->off, ref->len);
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        ref->len -= n;
+        *ref_bytes -= n;
+    }
+    return 1;
+}
+
+/*
+ * Writes queued output, buffered bytes and storage refs in order, until
+ * the socket would block. Buffered bytes and mapped values are gathered
+ * into one writev; file refs go out with sendfile on their own.
+ *
+ * Returns 1 once everything is sent, 0 if output is still pending, -1 on
+ * error.
+ */
+int conn_send_pending(struct conn *c) {
+    while (c->out_pos < c->out_len || c->refs) {
+        struct iovec iov[64];
+        int n_iov = 0;
+        int pos = c->out_pos;
+        struct out_ref *r = c->refs;
+
+        // gather up to the first file ref
+        while (n_iov < 63) {
+            int limit = r ? r->mark : c->out_len;
+            if (pos < limit) {
+                iov[n_iov].iov_base = c->out + pos;
+                iov[n_iov++].iov_len = limit - pos;
+                pos = limit;
+            }
+            if (!r || r->ref.fd >= 0) {
+                break;
+            }
+            if (r->ref.len > 0) {
+                iov[n_iov].iov_base = (char *)r->ref.map + r->ref.off;
+                iov[n_iov++].iov_len = r->ref.len;
+            }
+            r = r->next;
+        }
+
+        if (n_iov > 0) {
+            ssize_t n = writev(c->fd, iov, n_iov);
+            if (n < 0) {
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+            }
+            // account for what went out, retiring finished mapped refs
+            while (n > 0) {
+                int limit = c->refs ? c->refs->mark : c->out_len;
+                if (c->out_pos < limit) {
+                    int k = n < limit - c->out_pos ? n : limit - c->out_pos;
+                    c->out_pos += k;
+                    n -= k;
+                    continue;
+                }
+                struct value_ref *ref = &c->refs->ref;
+                int k = n < ref->len ? n : ref->len;
+                ref->off += k;
+                ref->len -= k;
+                c->ref_bytes -= k;
+                n -= k;
+                if (ref->len == 0) {
+                    struct out_ref *done = c->refs;
+                    c->refs = done->next;
+                    free(done);
+                }
+            }
+        }
+
+        // retire mapped refs with nothing left, e.g. empty values
+        while (c->refs && c->out_pos == c->refs->mark &&
+               c->refs->ref.fd < 0 && c->refs->ref.len == 0) {
+            struct out_ref *done = c->refs;
+            c->refs = done->next;
+            free(done);
+        }
+        if (c->refs && c->out_pos == c->refs->mark && c->refs->ref.fd >= 0) {
+            int r = ref_send(c->fd, &c->refs->ref, &c->ref_bytes);
+            if (r <= 0) {
+                return r;
+            }
+            struct out_ref *done = c->refs;
+            c->refs = done->next;
+            close(done->ref.fd);
+            free(done);
+        }
+        if (!c->refs) {
+            c->refs_tail = NULL;
+        }
+    }
+    c->out_pos = c->out_len = 0;
+    if (c->out_cap > OUT_HIGH_WATER) {
+        free(c->out);
+        c->out = NULL;
+        c->out_cap = 0;
+    }
+    return 1;
+}
+
+/*
+ * conn_send_pending(), timed as the socket write phase of the last op
+ * answered.
+ */
+int conn_send(struct conn *c) {
+    if (c->out_pos == c->out_len && !c->refs) {
+        return 1;
+    }
+    uint64_t start = now_ns();
+    int r = conn_send_pending(c);
+    if (c->last_op >= 0) {
+        hist_record(c->last_op, PHASE_WRITE, now_ns() - start);
+    }
+    return r;
+}
+
+/*
+ * Sends everything queued for the client on a blocking socket, once the
+ * writes it acknowledges are durable.
+ */
+int conn_flush(struct conn *c) {
+    commit_wait(c->commit_ticket);
+    return conn_send(c) > 0;
+}
+
+/*
+ * Drops whatever is still queued for a connection.
+ */
+void conn_discard(struct conn *c) {
+    while (c->refs) {
+        struct out_ref *r = c->refs;
+        c->refs = r->next;
+        if (r->ref.fd >= 0) {
+            close(r->ref.fd);
+        }
+        free(r);
+    }
+    c->refs_tail = NULL;
+    c->ref_bytes = 0;
+    c->out_pos = c->out_len = 0;
+}
+
+/*
+ * Refills the empty rbuf of a blocking connection. Pending responses are
+ * flushed before blocking, otherwise a client waiting for its reply and
+ * the server waiting for the next request would deadlock.
+ *
+ * Returns 1 if bytes arrived, 0 on EOF or error.
+ */
+int conn_refill(struct conn *c) {
+    if ((c->out_len > 0 || c->refs) && !conn_flush(c)) {
+        return 0;
+    }
+    int n = read(c->fd, c->rbuf, c->rcap);
+    if (n <= 0) {
+        return 0;
+    }
+    c->rpos = 0;
+    c->rlen = n;
+    c->filled_at = now_ns();
+    return 1;
+}
+
+/*
+ * Reads a fixed number of bytes from a blocking connection.
+ *
+ * Returns 1 on success, 0 on clean EOF before any byte, -1 on a short read.
+ */
+int conn_read_bytes(struct conn *c, void *buf, int count) {
+    int copied = 0;
+    while (copied < count) {
+        if (c->rpos == c->rlen && !conn_refill(c)) {
+            return copied == 0 ? 0 : -1;
+        }
+        int n = c->rlen - c->rpos;
+        if (n > count - copied) {
+            n = count - copied;
+        }
+        memcpy(buf + copied, c->rbuf + c->rpos, n);
+        c->rpos += n;
+        copied += n;
+    }
+    return 1;
+}
+
+/*
+ * FNV-1a, 64 bits.
+ */
+uint64_t hash_key(const char *key_name) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (const unsigned char *p = (const unsigned char *)key_name; *p; p++) {
+        h ^= *p;
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+/*
+ * Picks the shard for a key. The index uses the hash's low bits for the
+ * bucket and high bits for the fingerprint, so mix before choosing.
+ */
+struct shard *shard_of(uint64_t h) {
+    return &shards[((h * 0x9e3779b97f4a7c15ull) >> 32) % n_shards];
+}
+
+/*
+ * The id storage knows a shard's slot by.
+ */
+uint32_t slot_id(struct shard *sh, uint32_t idx) {
+    return idx * n_shards + sh->num;
+}
+
+int find_key_index(struct shard *sh, const char *key_name, uint64_t h);
+int find_free_slot(struct shard *sh);
+void index_insert(struct shard *sh, uint32_t idx);
+void drop_key(struct shard *sh, uint32_t idx);
+void clear_value(struct shard *sh, uint32_t idx);
+void lru_unlink(struct shard *sh, uint32_t idx);
+void lru_push(struct shard *sh, uint32_t idx);
+void cache_insert(struct shard *sh, uint32_t idx, char *value, int len);
+void cache_drop(struct shard *sh, uint32_t idx);
+void timer_set(struct shard *sh, uint32_t idx);
+void timer_unlink(struct shard *sh, uint32_t idx);
+int entry_expired(const struct entry *e);
+uint64_t wall_ms(void);
+void sketch_add(struct shard *sh, uint64_t h);
+void evict_touch(struct shard *sh, uint32_t idx);
+int evict_one(struct shard *sh, int idx, uint64_t h);
+int evict_to_budget(struct shard *sh, int idx, uint64_t h);
+void evict_release(void);
+
+int write_to_file(const char *filename, const char *data, int len);
+int read_from_file(const char *filename, char *buf, int len);
+
+/*
+ * Takes a shard lock, adding any time spent waiting for it to the
+ * request's lock wait.
+ */
+void shard_lock(struct shard *sh) {
+    if (pthread_mutex_trylock(&sh->lock) == 0) {
+        return;
+    }
+    uint64_t t = now_ns();
+    pthread_mutex_lock(&sh->lock);
+    lock_ns += now_ns() - t;
+}
+
+/*
+ * Value compression. A value of at least compress_min bytes is packed
+ * with the --compress codec on its way to storage, and stays packed only
+ * if that saves compress_save percent of it; the codec is kept in its
+ * location (and in the log record's flags) and reads unpack it. The
+ * cache keeps values as stored, so packed ones take less of it. A packed
+ * value is the raw length, 4 bytes little-endian, then the codec's
+ * output. Values too big to buffer are streamed to storage as they are.
+ */
+#define CODEC_NONE 0
+#define CODEC_ZLIB 1            // raw deflate, fastest level
+#define CODEC_LZ4  2            // LZ4 block, see lz4.c
+#define N_CODECS   3
+#define CODEC_HDR  4
+
+static const char *codec_names[N_CODECS] = {"none", "zlib", "lz4"};
+static int compress_codec = CODEC_NONE;
+static int compress_min = 256;      // bytes
+static int compress_save = 10;      // percent
+
+// each thread keeps its streams, as setting one up costs more than a value
+static __thread z_stream *deflater, *inflater;
+
+static int zlib_compress(const char *src, int len, char *dst, int cap) {
+    z_stream *z = deflater;
+
+    if (!z) {
+        // values are at most BUFFER_LENGTH, so a 4K window sees all of one
+        z = calloc(1, sizeof(*z));
+        if (!z || deflateInit2(z, 1, Z_DEFLATED, -12, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(z);
+            return 0;
+        }
+        deflater = z;
+    }
+    deflateReset(z);
+    z->next_in = (Bytef *)src;
+    z->avail_in = len;
+    z->next_out = (Bytef *)dst;
+    z->avail_out = cap;
+    return deflate(z, Z_FINISH) == Z_STREAM_END ? cap - z->avail_out : 0;
+}
+
+static int zlib_decompress(const char *src, int len, char *dst, int cap) {
+    z_stream *z = inflater;
+
+    if (!z) {
+        z = calloc(1, sizeof(*z));
+        if (!z || inflateInit2(z, -15) != Z_OK) {
+            free(z);
+            return -1;
+        }
+        inflater = z;
+    }
+    inflateReset(z);
+    z->next_in = (Bytef *)src;
+    z->avail_in = len;
+    z->next_out = (Bytef *)dst;
+    z->avail_out = cap;
+    return inflate(z, Z_FINISH) == Z_STREAM_END ? cap - z->avail_out : -1;
+}
+
+/*
+ * Whether a value of len bytes is worth trying to pack.
+ */
+int value_compressible(int len) {
+    return compress_codec != CODEC_NONE && len >= compress_min &&
+           len <= BUFFER_LENGTH;
+}
+
+/*
+ * Packs len bytes of data into out, which has room for len bytes, and
+ * sets *codec to how.
+ *
+ * Returns the packed length, or 0 if the value is to be stored as it is.
+ */
+int value_compress(const char *data, int len, char *out, uint8_t *codec) {
+    if (!value_compressible(len)) {
+        return 0;
+    }
+    // anything longer than this doesn't save enough to keep
+    int cap = len - len * compress_save / 100 - CODEC_HDR;
+    if (cap <= 0) {
+        return 0;
+    }
+
+    uint64_t t = now_ns();
+    int n = compress_codec == CODEC_LZ4 ?
+        lz4_compress(data, len, out + CODEC_HDR, cap) :
+        zlib_compress(data, len, out + CODEC_HDR, cap);
+    STAT_ADD(compress_ns, now_ns() - t);
+    STAT_ADD(compress_tried, 1);
+    STAT_ADD(compress_in, len);
+    if (n <= 0) {
+        STAT_ADD(compress_out, len);
+        return 0;
+    }
+    uint32_t raw = htole32(len);
+    memcpy(out, &raw, sizeof(raw));
+    STAT_ADD(compress_kept, 1);
+    STAT_ADD(compress_out, CODEC_HDR + n);
+    *codec = compress_codec;
+    return CODEC_HDR + n;
+}
+
+/*
+ * Unpacks len bytes of a value packed with codec into buf, which has
+ * room for cap bytes.
+ *
+ * Returns the value's length, or -1 if it doesn't unpack.
+ */
+int value_expand(int codec, const char *packed, int len, char *buf, int cap) {
+    uint32_t raw = 0;
+    int n = -1;
+
+    if (len >= CODEC_HDR) {
+        memcpy(&raw, packed, sizeof(raw));
+        raw = le32toh(raw);
+    }
+    if (len >= CODEC_HDR && raw <= cap) {
+        uint64_t t = now_ns();
+        if (codec == CODEC_LZ4) {
+            n = lz4_decompress(packed + CODEC_HDR, len - CODEC_HDR, buf, raw);
+        } else if (codec == CODEC_ZLIB) {
+            n = zlib_decompress(packed + CODEC_HDR, len - CODEC_HDR, buf, raw);
+        }
+        STAT_ADD(expand_ns, now_ns() - t);
+        STAT_ADD(expanded, 1);
+    }
+    if (n < 0 || n != raw) {
+        LOG(LOG_ERROR, "Stored value won't unpack: %d bytes, codec %d\n",
+            len, codec);
+        return -1;
+    }
+    return n;
+}
+
+/*
+ * A write between taking its ticket and publishing the result.
+ */
+struct write_ctx {
+    struct shard *sh;
+    uint32_t idx;
+    uint64_t ticket;
+    int epoch;                  /* snapshot_epoch & 1 when it began, -1 if suspended */
+    struct location drop;       /* version to release once unlocked */
+    int dropping;               /* 1 superseded, 2 never published */
+};
+
+/*
+ * write_begin() for a caller already holding the key's shard lock.
+ */
+int write_begin_locked(struct shard *sh, const char *key_name, uint64_t h,
+                       struct write_ctx *wc) {
+    int idx = find_key_index(sh, key_name, h);
+
+    if (evict_policy != EVICT_NONE && !evict_to_budget(sh, idx, h)) {
+        return 0;
+    }
+    // if the key does not exist, find a free slot, in cache mode evicting
+    // for one if the table is full
+    if (idx < 0) {
+        idx = find_free_slot(sh);
+        for (int n = 0; idx < 0 && evict_policy != EVICT_NONE && n < EVICT_MAX &&
+                        evict_one(sh, -1, h) > 0; n++) {
+            idx = find_free_slot(sh);
+        }
+        if (idx < 0) {
+            return 0;
+        }
+        struct entry *e = ENTRY(sh, idx);
+        strncpy(e->name, key_name, sizeof(e->name) - 1);
+        e->name[sizeof(e->name) - 1] = '\0';
+        e->hash = h;
+        index_insert(sh, idx);
+        e->state = STATE_PENDING;
+    }
+    evict_touch(sh, idx);
+    wc->sh = sh;
+    wc->idx = idx;
+    wc->ticket = ++sh->last_ticket;
+    wc->epoch = __atomic_load_n(&snapshot_epoch, __ATOMIC_SEQ_CST) & 1;
+    sh->in_flight[wc->epoch]++;
+    wc->dropping = 0;
+    ENTRY(sh, idx)->writers++;
+    return 1;
+}
+
+/*
+ * Starts a write: finds or creates the key's entry and takes a ticket.
+ *
+ * Returns 0 if there was no room for a new key.
+ */
+int write_begin(const char *key_name, struct write_ctx *wc) {
+    uint64_t h = hash_key(key_name);
+    struct shard *sh = shard_of(h);
+
+    shard_lock(sh);
+    int ok = write_begin_locked(sh, key_name, h, wc);
+    pthread_mutex_unlock(&sh->lock);
+    evict_release();
+    return ok;
+}
+
+/*
+ * Takes a write out of the count snapshots wait on, for a stream whose
+ * body may take as long as the client likes. Storage must already have
+ * reserved its record; log storage keeps snapshots from covering it
+ * until it ends, see snapshot_take().
+ */
+void write_suspend(struct write_ctx *wc) {
+    shard_lock(wc->sh);
+    wc->sh->in_flight[wc->epoch]--;
+    wc->epoch = -1;
+    pthread_mutex_unlock(&wc->sh->lock);
+}
+
+/*
+ * Puts a suspended write back in the count before it ends, so that a
+ * snapshot no longer covering its record waits for it to publish.
+ */
+void write_resume(struct write_ctx *wc) {
+    shard_lock(wc->sh);
+    wc->epoch = __atomic_load_n(&snapshot_epoch, __ATOMIC_SEQ_CST) & 1;
+    wc->sh->in_flight[wc->epoch]++;
+    pthread_mutex_unlock(&wc->sh->lock);
+}
+
+/*
+ * The locked half of write_finish(). Takes over copy. Whatever version
+ * this makes garbage is left in wc for write_release().
+ */
+void write_publish_locked(struct write_ctx *wc, int ok,
+                          const struct location *loc, char *copy, int len) {
+    struct shard *sh = wc->sh;
+    uint32_t idx = wc->idx;
+    struct entry *e = ENTRY(sh, idx);
+    int won = ok && wc->ticket > e->committed;
+
+    e->writers--;
+    if (wc->epoch >= 0) {
+        sh->in_flight[wc->epoch]--;
+    }
+    if (won) {
+        if (e->state == STATE_VALID) {
+            wc->drop = e->loc;
+            wc->dropping = 1;
+            sh->key_bytes -= KEY_COST(e);
+        }
+        // publish the new version
+        cache_drop(sh, idx);
+        e->loc = *loc;
+        sh->key_bytes += KEY_COST(e);
+        e->committed = wc->ticket;
+        e->state = STATE_VALID;
+        e->version++;
+        timer_set(sh, idx);
+        if (copy) {
+            cache_insert(sh, idx, copy, len);
+            copy = NULL;
+        }
+    } else {
+        if (ok) {
+            // overtaken by a later write or delete
+            wc->drop = *loc;
+            wc->dropping = 2;
+        }
+        if (e->state == STATE_PENDING && e->writers == 0) {
+            // nothing was ever committed and nobody else is trying
+            drop_key(sh, idx);
+        }
+    }
+    free(copy);
+}
+
+/*
+ * The unlocked half of write_finish(): hands storage back the version the
+ * write made garbage, if any.
+ */
+void write_release(struct write_ctx *wc) {
+    if (wc->dropping) {
+        uint64_t t = now_ns();
+        if (wc->dropping == 2) {
+            storage->discard(&wc->drop);
+        } else {
+            storage->release(&wc->drop);
+        }
+        storage_ns += now_ns() - t;
+        wc->dropping = 0;
+    }
+}
+
+/*
+ * Ends a write started with write_begin(). If storage took the value
+ * (ok), it is published at loc unless a later write got there first,
+ * and copy, if given, becomes the cached copy of its len bytes.
+ *
+ * Returns ok.
+ */
+int write_finish(struct write_ctx *wc, int ok, const struct location *loc,
+                 char *copy, int len) {
+    shard_lock(wc->sh);
+    write_publish_locked(wc, ok, loc, copy, len);
+    pthread_mutex_unlock(&wc->sh->lock);
+    write_release(wc);
+    return ok;
+}
+
+/*
+ * Writes data to the database.
+ *
+ * The value is stored as a new version off to the side, without holding
+ * the shard lock, and then published by pointing the entry at it. Until
+ * then readers keep getting the previous version. Writes to the same key
+ * may overlap; each takes a ticket up front and the highest ticket wins,
+ * so the key ends up holding whatever was written last. A losing or
+ * failed write leaves the committed version alone. A key written with a
+ * ttl_ms other than 0 expires that many milliseconds later.
+ */
+int do_write(const char *key_name, const char *data, int len, uint64_t ttl_ms) {
+    struct write_ctx wc;
+    struct location loc = {.codec = CODEC_NONE};
+    char packed[BUFFER_LENGTH];
+
+    if (ttl_ms) {
+        loc.expires = wall_ms() + ttl_ms;
+        STAT_ADD(ttl_writes, 1);
+    }
+
+    // packed before taking a ticket, which holds up snapshots until done
+    int n = value_compress(data, len, packed, &loc.codec);
+    if (n > 0) {
+        data = packed;
+        len = n;
+    }
+    if (!write_begin(key_name, &wc)) {
+        return 0;
+    }
+
+    uint64_t t = now_ns();
+    int ok = storage->write(slot_id(wc.sh, wc.idx), key_name, wc.ticket, data,
+                            len, &loc);
+    storage_ns += now_ns() - t;
+
+    // copy the value for the cache before taking the lock again
+    char *copy = ok && cache_limit > 0 ? malloc(len ? len : 1) : NULL;
+    if (copy) {
+        memcpy(copy, data, len);
+    }
+    return write_finish(&wc, ok, &loc, copy, len);
+}
+
+/*
+ * Reads data from the database. An uncached value of at least
+ * zero_copy_min bytes isn't read at all when ref is given: ref is filled
+ * in so the caller can send it straight from storage, and buf is unused.
+ * Values bigger than BUFFER_LENGTH can only be read that way. Packed
+ * values are always read, to unpack them into buf.
+ *
+ * Never waits for writers: it reads the last committed version, and if
+ * that was replaced and released under it, tries again with the new one.
+ * The value's CRC32C goes in *crc, if given.
+ */
+int do_read(char *key_name, char *buf, int *length, struct value_ref *ref,
+            uint32_t *crc) {
+    uint64_t h = hash_key(key_name);
+    struct shard *sh = shard_of(h);
+    char packed[BUFFER_LENGTH];
+    struct location loc;
+    uint32_t version;
+    int idx, n, stored;
+
+    for (;;) {
+        if (ref) {
+            ref->len = -1;
+        }
+
+        shard_lock(sh);
+
+        idx = find_key_index(sh, key_name, h);
+        sketch_add(sh, h);
+        if (idx < 0 || ENTRY(sh, idx)->state != STATE_VALID) {
+            pthread_mutex_unlock(&sh->lock);
+            return 0;
+        }
+        struct entry *e = ENTRY(sh, idx);
+        if (entry_expired(e)) {
+            // gone, though expire_thread() may not have got to it yet
+            pthread_mutex_unlock(&sh->lock);
+            STAT_ADD(expired_reads, 1);
+            return 0;
+        }
+        evict_touch(sh, idx);
+
+        // served from memory if we have a copy
+        loc = e->loc;
+        if (e->value) {
+            n = e->value_len;
+            memcpy(loc.codec ? packed : buf, e->value, n);
+            lru_unlink(sh, idx);
+            lru_push(sh, idx);
+            sh->cache_hits++;
+            pthread_mutex_unlock(&sh->lock);
+
+            // unpacked outside the lock
+            if (loc.codec &&
+                (n = value_expand(loc.codec, packed, n, buf, BUFFER_LENGTH)) < 0) {
+                return 0;
+            }
+            *length = n;
+            if (crc) {
+                *crc = loc.codec ? crc32c(0, buf, n) : loc.crc;
+            }
+            return 1;
+        }
+        sh->cache_misses++;
+        version = e->version;
+
+        pthread_mutex_unlock(&sh->lock);
+
+        int big = loc.len > BUFFER_LENGTH;
+        if (big && !ref) {
+            return 0;
+        }
+
+        uint64_t t = now_ns();
+        if (ref && !loc.codec &&
+            (big || (zero_copy_min > 0 && loc.len >= zero_copy_min)) &&
+            storage->open_ref(slot_id(sh, idx), &loc, ref)) {
+            storage_ns += now_ns() - t;
+            *length = ref->len;
+            if (crc) {
+                *crc = loc.crc;
+            }
+            STAT_ADD(zero_copy, 1);
+            return 1;
+        }
+        if (ref) {
+            ref->len = -1;
+        }
+
+        // a big value that can't be opened is as good as unreadable
+        stored = big ? -1 : storage->read(slot_id(sh, idx), &loc,
+                                          loc.codec ? packed : buf, BUFFER_LENGTH);
+        storage_ns += now_ns() - t;
+        n = stored >= 0 && loc.codec ?
+            value_expand(loc.codec, packed, stored, buf, BUFFER_LENGTH) : stored;
+        if (n >= 0) {
+            break;
+        }
+
+        shard_lock(sh);
+        if (ENTRY(sh, idx)->version == version &&
+            ENTRY(sh, idx)->state == STATE_VALID) {
+            // the committed version itself is unreadable: forget it
+            clear_value(sh, idx);
+            pthread_mutex_unlock(&sh->lock);
+            return 0;
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+    *length = n;
+    if (crc) {
+        *crc = loc.codec ? crc32c(0, buf, n) : loc.crc;
+    }
+
+    // keep a copy as stored, unless the value was rewritten or deleted
+    // meanwhile
+    char *copy = cache_limit > 0 ? malloc(stored ? stored : 1) : NULL;
+    if (copy) {
+        memcpy(copy, loc.codec ? packed : buf, stored);
+        shard_lock(sh);
+        if (ENTRY(sh, idx)->version == version &&
+            ENTRY(sh, idx)->state == STATE_VALID && !ENTRY(sh, idx)->value) {
+            cache_insert(sh, idx, copy, stored);
+            copy = NULL;
+        }
+        pthread_mutex_unlock(&sh->lock);
+        free(copy);
+    }
+    return 1;
+}
+
+/*
+ * Deletes data from the database. A delete takes a ticket like a write,
+ * so writes that started before it can't bring the key back.
+ */
+int do_delete(const char *key_name) {
+    uint64_t h = hash_key(key_name);
+    struct shard *sh = shard_of(h);
+
+    shard_lock(sh);
+
+    int idx = find_key_index(sh, key_name, h);
+    if (idx < 0 || ENTRY(sh, idx)->state != STATE_VALID ||
+        entry_expired(ENTRY(sh, idx))) {
+        pthread_mutex_unlock(&sh->lock);
+        return 0;
+    }
+
+    struct location loc = ENTRY(sh, idx)->loc;
+    uint64_t ticket = ENTRY(sh, idx)->committed = ++sh->last_ticket;
+    clear_value(sh, idx);
+
+    pthread_mutex_unlock(&sh->lock);
+
+    uint64_t t = now_ns();
+    storage->remove(slot_id(sh, idx), key_name, ticket, &loc);
+    storage_ns += now_ns() - t;
+    return 1;
+}
+
+/*
+ * Searches one index array for a key.
+ *
+ * Returns a pointer to the slot field holding it, or NULL.
+ */
+uint32_t *index_find(struct shard *sh, struct index *ix, const char *key_name,
+                     uint64_t h) {
+    uint32_t fp = h >> 32;
+
+    for (uint32_t b = h; ; b++) {
+        struct bucket *bk = &ix->buckets[b & (ix->nbuckets - 1)];
+        for (int i = 0; i < BUCKET_SLOTS; i++) {
+            if (bk->slot[i] == SLOT_EMPTY) {
+                return NULL;
+            }
+            if (bk->fp[i] == fp && bk->slot[i] != SLOT_TOMB &&
+                strcmp(ENTRY(sh, bk->slot[i])->name, key_name) == 0) {
+                return &bk->slot[i];
+            }
+        }
+    }
+}
+
+/*
+ * Puts a pair into the first free place on its probe sequence.
+ */
+void index_place(struct index *ix, uint64_t h, uint32_t idx) {
+    for (uint32_t b = h; ; b++) {
+        struct bucket *bk = &ix->buckets[b & (ix->nbuckets - 1)];
+        for (int i = 0; i < BUCKET_SLOTS; i++) {
+            if (bk->slot[i] == SLOT_EMPTY || bk->slot[i] == SLOT_TOMB) {
+                ix->tombs -= bk->slot[i] == SLOT_TOMB;
+                bk->fp[i] = h >> 32;
+                bk->slot[i] = idx;
+                ix->used++;
+                return;
+            }
+        }
+    }
+}
+
+/*
+ * Moves a few buckets of the old array, freeing it once it is empty.
+ * Called with the shard lock held.
+ */
+void index_rehash_step(struct shard *sh) {
+    if (!sh->old.buckets) {
+        return;
+    }
+    for (int n = 0; n < REHASH_STEP && sh->rehash_pos < sh->old.nbuckets; n++) {
+        struct bucket *bk = &sh->old.buckets[sh->rehash_pos++];
+        for (int i = 0; i < BUCKET_SLOTS; i++) {
+            uint32_t idx = bk->slot[i];
+            if (idx != SLOT_EMPTY && idx != SLOT_TOMB) {
+                index_place(&sh->cur, ENTRY(sh, idx)->hash, idx);
+                sh->old.used--;
+            }
+        }
+    }
+    if (sh->rehash_pos == sh->old.nbuckets) {
+        free(sh->old.buckets);
+        sh->mem_used -= (size_t)sh->old.nbuckets * sizeof(struct bucket);
+        sh->old.buckets = NULL;
+    }
+}
+
+/*
+ * Allocates an empty index array of the given size, or fails if that
+ * would take the shard over its share of the memory ceiling.
+ */
+int index_alloc(struct shard *sh, struct index *ix, uint32_t nbuckets) {
+    size_t bytes = (size_t)nbuckets * sizeof(struct bucket);
+    if (mem_limit && sh->mem_used + bytes > mem_limit / n_shards) {
+        return 0;
+    }
+    ix->buckets = aligned_alloc(64, bytes);
+    if (!ix->buckets) {
+        LOG_ERRNO("aligned_alloc");
+        return 0;
+    }
+    memset(ix->buckets, 0xff, bytes);
+    ix->nbuckets = nbuckets;
+    ix->used = ix->tombs = 0;
+    sh->mem_used += bytes;
+    return 1;
+}
+
+/*
+ * Makes sure the index can take one more key, starting a resize if it is
+ * getting full. A resize doubles the array if the live keys need it,
+ * otherwise it just sweeps out tombstones. Called with the shard lock
+ * held.
+ *
+ * Returns 0 if the index is full and can't grow under the memory ceiling.
+ */
+int index_reserve(struct shard *sh) {
+    struct index *ix = &sh->cur;
+    uint32_t capacity = ix->nbuckets * BUCKET_SLOTS;
+
+    if (ix->used + ix->tombs + 1 <= capacity / 4 * 3) {
+        return 1;
+    }
+    if (sh->old.buckets) {
+        // still draining the previous resize; finish it first
+        while (sh->old.buckets) {
+            index_rehash_step(sh);
+        }
+        if (ix->used + ix->tombs + 1 <= capacity / 8 * 7) {
+            return 1;
+        }
+    }
+
+    uint32_t nbuckets = ix->nbuckets;
+    if (ix->used + 1 > capacity / 8 * 3) {
+        nbuckets *= 2;
+    }
+    struct index grown;
+    if (!index_alloc(sh, &grown, nbuckets)) {
+        return ix->used + ix->tombs + 1 <= capacity / 8 * 7;
+    }
+    sh->old = *ix;
+    sh->cur = grown;
+    sh->rehash_pos = 0;
+    return 1;
+}
+
+/*
+ * Finds the index of a key in its shard, whatever its state. Called with
+ * the shard lock held.
+ */
+int find_key_index(struct shard *sh, const char *key_name, uint64_t h) {
+    uint32_t *slot;
+
+    index_rehash_step(sh);
+    slot = index_find(sh, &sh->cur, key_name, h);
+    if (!slot && sh->old.buckets) {
+        slot = index_find(sh, &sh->old, key_name, h);
+    }
+    return slot ? *slot : -1;
+}
+
+/*
+ * Adds an entry, whose name and hash are set and which is known not to be
+ * present, to the index; index_reserve() must have succeeded first.
+ * Called with the shard lock held.
+ */
+void index_insert(struct shard *sh, uint32_t idx) {
+    index_place(&sh->cur, ENTRY(sh, idx)->hash, idx);
+}
+
+/*
+ * Removes an entry from the index. Called with the shard lock held.
+ */
+void index_remove(struct shard *sh, uint32_t idx) {
+    struct entry *e = ENTRY(sh, idx);
+    struct index *ix = &sh->cur;
+    uint32_t *slot = index_find(sh, ix, e->name, e->hash);
+
+    if (!slot && sh->old.buckets) {
+        ix = &sh->old;
+        slot = index_find(sh, ix, e->name, e->hash);
+    }
+    if (slot) {
+        *slot = SLOT_TOMB;
+        ix->used--;
+        ix->tombs++;
+    }
+}
+
+/*
+ * Finds a free slot in a shard, adding a chunk of entries if none is left.
+ * Called with the shard lock held.
+ */
+int find_free_slot(struct shard *sh) {
+    if (!index_reserve(sh)) {
+        return -1;
+    }
+    if (sh->n_free == 0) {
+        size_t bytes = CHUNK_KEYS * sizeof(struct entry);
+        uint64_t slots = (uint64_t)(sh->n_chunks + 1) * CHUNK_KEYS;
+        if (slots * n_shards >= SLOT_TOMB ||
+            (mem_limit && sh->mem_used + bytes > mem_limit / n_shards)) {
+            return -1;
+        }
+        if (sh->n_chunks == sh->chunks_cap) {
+            uint32_t cap = sh->chunks_cap ? sh->chunks_cap * 2 : 16;
+            struct entry **p = realloc(sh->chunks, cap * sizeof(*p));
+            if (!p) {
+                LOG_ERRNO("realloc");
+                return -1;
+            }
+            sh->chunks = p;
+            sh->chunks_cap = cap;
+        }
+        // the stack needs room for every entry, so drop_key can't fail
+        if (sh->free_cap < slots) {
+            uint32_t cap = sh->free_cap ? sh->free_cap * 2 : CHUNK_KEYS;
+            uint32_t *p = realloc(sh->free_slots, cap * sizeof(*p));
+            if (!p) {
+                LOG_ERRNO("realloc");
+                return -1;
+            }
+            sh->free_slots = p;
+            sh->free_cap = cap;
+        }
+        struct entry *chunk = calloc(CHUNK_KEYS, sizeof(struct entry));
+        if (!chunk) {
+            LOG_ERRNO("calloc");
+            return -1;
+        }
+        sh->chunks[sh->n_chunks] = chunk;
+        sh->mem_used += bytes;
+        for (int i = CHUNK_KEYS - 1; i >= 0; i--) {
+            sh->free_slots[sh->n_free++] = sh->n_chunks * CHUNK_KEYS + i;
+        }
+        sh->n_chunks++;
+    }
+    return sh->free_slots[--sh->n_free];
+}
+
+/*
+ * Forgets a key and returns its slot to the free list. Called with the
+ * shard lock held.
+ */
+void drop_key(struct shard *sh, uint32_t idx) {
+    struct entry *e = ENTRY(sh, idx);
+
+    if (e->state == STATE_VALID) {
+        sh->key_bytes -= KEY_COST(e);
+    }
+    index_remove(sh, idx);
+    cache_drop(sh, idx);
+    timer_unlink(sh, idx);
+    e->version++;
+    e->state = STATE_INVALID;
+    e->name[0] = '\0';
+    sh->free_slots[sh->n_free++] = idx;
+}
+
+/*
+ * Forgets a key's committed value. The entry stays in the index while
+ * writes to it are still in flight, so they have somewhere to land.
+ * Called with the shard lock held.
+ */
+void clear_value(struct shard *sh, uint32_t idx) {
+    struct entry *e = ENTRY(sh, idx);
+
+    if (e->writers > 0) {
+        if (e->state == STATE_VALID) {
+            sh->key_bytes -= KEY_COST(e);
+        }
+        cache_drop(sh, idx);
+        timer_unlink(sh, idx);
+        e->version++;
+        e->state = STATE_PENDING;
+    } else {
+        drop_key(sh, idx);
+    }
+}
+
+/*
+ * Takes a cached entry off the LRU list. Called with the shard lock held.
+ */
+void lru_unlink(struct shard *sh, uint32_t idx) {
+    struct entry *e = ENTRY(sh, idx);
+
+    if (e->lru_prev != LRU_NONE) {
+        ENTRY(sh, e->lru_prev)->lru_next = e->lru_next;
+    } else {
+        sh->lru_head = e->lru_next;
+    }
+    if (e->lru_next != LRU_NONE) {
+        ENTRY(sh, e->lru_next)->lru_prev = e->lru_prev;
+    } else {
+        sh->lru_tail = e->lru_prev;
+    }
+}
+
+/*
+ * Puts a cached entry at the most recently used end of the LRU list.
+ * Called with the shard lock held.
+ */
+void lru_push(struct shard *sh, uint32_t idx) {
+    struct entry *e = ENTRY(sh, idx);
+
+    e->lru_prev = LRU_NONE;
+    e->lru_next = sh->lru_head;
+    if (sh->lru_head != LRU_NONE) {
+        ENTRY(sh, sh->lru_head)->lru_prev = idx;
+    } else {
+        sh->lru_tail = idx;
+    }
+    sh->lru_head = idx;
+}
+
+/*
+ * Frees an entry's cached value, if it has one. Called with the shard
+ * lock held.
+ */
+void cache_drop(struct shard *sh, uint32_t idx) {
+    struct entry *e = ENTRY(sh, idx);
+
+    if (e->value) {
+        lru_unlink(sh, idx);
+        sh->cache_bytes -= e->value_len;
+        free(e->value);
+        e->value = NULL;
+    }
+}
+
+/*
+ * Attaches a malloc'd copy of an entry's value, evicting the least
+ * recently used values until the shard's cache fits its budget again. A
+ * value larger than the whole budget is not kept. Called with the shard
+ * lock held.
+ */
+void cache_insert(struct shard *sh, uint32_t idx, char *value, int len) {
+    size_t budget = cache_limit / n_shards;
+
+    if (len > budget) {
+        free(value);
+        return;
+    }
+    while (sh->cache_bytes + len > budget) {
+        cache_drop(sh, sh->lru_tail);
+        sh->cache_evictions++;
+    }
+    ENTRY(sh, idx)->value = value;
+    ENTRY(sh, idx)->value_len = len;
+    sh->cache_bytes += len;
+    lru_push(sh, idx);
+}
+
+/*
+ * Key expiry. A key written with a TTL (op T) keeps the time it lapses
+ * in its location, and requests treat it as gone from then on; reclaiming
+ * it is left to expire_thread(), which deletes it like a D would. It
+ * finds what is due without scanning through each shard's timing wheel:
+ * a key goes on the lowest level whose span reaches its expiry, each
+ * time the wheel below comes round the next slot up is cascaded, its
+ * keys moved down to where they now belong, and a level 0 slot holds
+ * the keys due at one tick. Setting, clearing and expiring a TTL are all
+ * O(1). The wheel is under the shard lock, like the rest of the entry.
+ */
+#define EXPIRE_BATCH 256        // keys reclaimed per hold of a shard lock
+
+uint64_t wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Whether an entry's TTL is up. Called with the shard lock held.
+ */
+int entry_expired(const struct entry *e) {
+    return e->loc.expires && e->loc.expires <= wall_ms();
+}
+
+/*
+ * Takes an entry off the wheel, if it is on it. Called with the shard
+ * lock held.
+ */
+void timer_unlink(struct shard *sh, uint32_t idx) {
+    struct entry *e = ENTRY(sh, idx);
+
+    if (!e->timer_slot) {
+        return;
+    }
+    if (e->timer_prev != LRU_NONE) {
+        ENTRY(sh, e->timer_prev)->timer_next = e->timer_next;
+    } else {
+        sh->wheel[e->timer_slot - 1] = e->timer_next;
+    }
+    if (e->timer_next != LRU_NONE) {
+        ENTRY(sh, e->timer_next)->timer_prev = e->timer_prev;
+    }
+    e->timer_slot = 0;
+    sh->timers--;
+}
+
+/*
+ * Puts an entry on the wheel for the tick its TTL is up, or tick first
+ * if that is later. A slot on level l is cascaded at the first tick
+ * whose low l * WHEEL_BITS bits are 0 and whose next ones are the
+ * slot's; choosing the lowest level that spans the wait makes that the
+ * last cascade before the entry is due. Waits past the top level's span
+ * are cut short, and the entry is placed again when it is cascaded.
+ * Called with the shard lock held.
+ */
+static void timer_insert(struct shard *sh, uint32_t idx, uint64_t first) {
+    struct entry *e = ENTRY(sh, idx);
+    uint64_t due = (e->loc.expires + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    uint64_t max_wait = (1ull << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    int level = 0;
+
+    if (due < first) {
+        due = first;
+    }
+    if (due - sh->wheel_tick > max_wait) {
+        due = sh->wheel_tick + max_wait;
+    }
+    while (level < WHEEL_LEVELS - 1 &&
+           due - sh->wheel_tick >= 1ull << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    int slot = level * WHEEL_SLOTS +
+               ((due >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+
+    e->timer_prev = LRU_NONE;
+    e->timer_next = sh->wheel[slot];
+    if (e->timer_next != LRU_NONE) {
+        ENTRY(sh, e->timer_next)->timer_prev = idx;
+    }
+    sh->wheel[slot] = idx;
+    e->timer_slot = slot + 1;
+    sh->timers++;
+}
+
+/*
+ * Puts an entry on the wheel for the TTL of its committed version, or
+ * takes it off if that has none. Called with the shard lock held.
+ */
+void timer_set(struct shard *sh, uint32_t idx) {
+    timer_unlink(sh, idx);
+    if (ENTRY(sh, idx)->state == STATE_VALID && ENTRY(sh, idx)->loc.expires) {
+        timer_insert(sh, idx, sh->wheel_tick);
+    }
+}
+
+/*
+ * A key taken out of the table by expiry or eviction, to be removed from
+ * storage once the shard is unlocked.
+ */
+struct dropped_key {
+    uint32_t slot;
+    char name[32];
+    uint64_t ticket;
+    struct location loc;
+};
+
+/*
+ * Takes a key out of the table as a delete would, into *k. Called with
+ * the shard lock held.
+ */
+void drop_for_storage(struct shard *sh, uint32_t idx, struct dropped_key *k) {
+    struct entry *e = ENTRY(sh, idx);
+
+    k->slot = slot_id(sh, idx);
+    memcpy(k->name, e->name, sizeof(k->name));
+    k->loc = e->loc;
+    k->ticket = e->committed = ++sh->last_ticket;
+    clear_value(sh, idx);
+}
+
+/*
+ * Runs a shard's wheel up to tick now, taking out the keys that are due
+ * into out[], at most EXPIRE_BATCH of them. A tick cut short is run
+ * again next time; cascading a slot twice does no harm. Called with the
+ * shard lock held.
+ *
+ * Returns the number of keys taken out.
+ */
+int wheel_run(struct shard *sh, uint64_t now, struct dropped_key *out) {
+    int n = 0;
+
+    if (sh->timers == 0 && sh->wheel_tick <= now) {
+        sh->wheel_tick = now + 1;
+        return 0;
+    }
+    for (; sh->wheel_tick <= now; sh->wheel_tick++) {
+        uint64_t t = sh->wheel_tick;
+
+        // from the top down, so keys can cascade more than one level
+        for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+            if (t & ((1ull << (WHEEL_BITS * level)) - 1)) {
+                continue;
+            }
+            uint32_t *head = &sh->wheel[level * WHEEL_SLOTS +
+                                        ((t >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1))];
+            while (*head != LRU_NONE) {
+                uint32_t idx = *head;
+                timer_unlink(sh, idx);
+                timer_insert(sh, idx, t);
+            }
+        }
+
+        uint32_t *head = &sh->wheel[t & (WHEEL_SLOTS - 1)];
+        while (*head != LRU_NONE) {
+            uint32_t idx = *head;
+            struct entry *e = ENTRY(sh, idx);
+            if (n == EXPIRE_BATCH) {
+                return n;
+            }
+            timer_unlink(sh, idx);
+            if (!entry_expired(e) || e->writers > 0) {
+                // the clock went back, or a write is about to replace
+                // the key anyway: look again next tick
+                timer_insert(sh, idx, t + 1);
+                continue;
+            }
+            drop_for_storage(sh, idx, &out[n++]);
+        }
+    }
+    return n;
+}
+
+/*
+ * Reclaims expired keys every tick, deleting each from storage the way
+ * do_delete() does.
+ */
+void* expire_thread(void *arg) {
+    struct dropped_key out[EXPIRE_BATCH];
+
+    stats_attach();
+    while (1) {
+        usleep(WHEEL_TICK_MS * 1000);
+        uint64_t now = wall_ms() / WHEEL_TICK_MS;
+        for (int i = 0; i < n_shards; i++) {
+            struct shard *sh = &shards[i];
+            int n;
+            do {
+                pthread_mutex_lock(&sh->lock);
+                n = wheel_run(sh, now, out);
+                pthread_mutex_unlock(&sh->lock);
+                for (int j = 0; j < n; j++) {
+                    storage->remove(out[j].slot, out[j].name, out[j].ticket,
+                                    &out[j].loc);
+                }
+                STAT_ADD(expired, n);
+            } while (n == EXPIRE_BATCH);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Cache mode (--evict). When a write finds its shard over its share of
+ * --evict-budget, or the table full, the shard's coldest key goes to make
+ * room, taken out and removed from storage as a delete would. Which key
+ * is coldest is up to the policy:
+ *
+ *   lru    the least recently used of EVICT_SAMPLES keys picked at
+ *          random, which comes close to true LRU without a list to keep
+ *          in order on every read
+ *   clock  the first key the hand comes to that wasn't used since it
+ *          last went by, clearing the mark on those that were
+ *
+ * With --admission=tinylfu a new key may only take the place of one
+ * that was asked for less often. How often is estimated by a count-min
+ * sketch of every key's reads and writes, misses included, halved each
+ * SKETCH_RESET adds so that old popularity fades. A key turned away is
+ * a failed write, as it would have been without eviction.
+ *
+ * The budget is soft: it is checked when writes begin, so it can be
+ * overrun by what the writes in flight add.
+ */
+#define SKETCH_ROWS    4
+#define SKETCH_WIDTH   (1 << 16)
+#define SKETCH_MAX     15
+#define SKETCH_RESET   (10 * SKETCH_WIDTH)
+
+static __thread struct dropped_key evicted[EVICT_PENDING];
+static __thread int n_evicted;
+
+static inline uint32_t sketch_index(uint64_t h, int row) {
+    uint32_t h2 = (h >> 32) | 1;
+    return row * SKETCH_WIDTH + (((uint32_t)h + row * h2) & (SKETCH_WIDTH - 1));
+}
+
+/*
+ * Counts a use of the key hashing to h. Called with the shard lock held.
+ */
+void sketch_add(struct shard *sh, uint64_t h) {
+    if (!sh->sketch) {
+        return;
+    }
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        uint8_t *c = &sh->sketch[sketch_index(h, row)];
+        if (*c < SKETCH_MAX) {
+            (*c)++;
+        }
+    }
+    if (++sh->sketch_adds == SKETCH_RESET) {
+        for (int i = 0; i < SKETCH_ROWS * SKETCH_WIDTH; i++) {
+            sh->sketch[i] >>= 1;
+        }
+        sh->sketch_adds /= 2;
+    }
+}
+
+/*
+ * How many times the key hashing to h was used, give or take the keys
+ * it collides with. Called with the shard lock held.
+ */
+int sketch_estimate(struct shard *sh, uint64_t h) {
+    int n = SKETCH_MAX;
+    for (int row = 0; row < SKETCH_ROWS; row++) {
+        int c = sh->sketch[sketch_index(h, row)];
+        if (c < n) {
+            n = c;
+        }
+    }
+    return n;
+}
+
+/*
+ * Notes a use of a key, for the policy to go by; the sketch is fed
+ * separately, as it counts keys that aren't there too. Called with the
+ * shard lock held.
+ */
+void evict_touch(struct shard *sh, uint32_t idx) {
+    struct entry *e = ENTRY(sh, idx);
+
+    e->last_used = ++sh->access_clock;
+    e->referenced = 1;
+}
+
+/*
+ * Whether a key could be evicted: committed, and with no write about to
+ * replace it anyway.
+ */
+static int evictable(struct shard *sh, uint32_t idx, int skip) {
+    struct entry *e = ENTRY(sh, idx);
+    return idx != skip && e->state == STATE_VALID && e->writers == 0;
+}
+
+/*
+ * Picks the key to evict under the policy, never skip.
+ *
+ * Returns its index, or -1 if there is nothing to evict.
+ */
+int evict_pick(struct shard *sh, int skip) {
+    uint32_t slots = sh->n_chunks * CHUNK_KEYS;
+    int victim = -1;
+
+    if (slots == 0) {
+        return -1;
+    }
+    if (evict_policy == EVICT_CLOCK) {
+        // two turns at most: the first may only clear marks
+        for (uint32_t n = 0; n < 2 * slots; n++) {
+            uint32_t idx = sh->clock_hand++ % slots;
+            if (!evictable(sh, idx, skip)) {
+                continue;
+            }
+            if (!ENTRY(sh, idx)->referenced) {
+                return idx;
+            }
+            ENTRY(sh, idx)->referenced = 0;
+        }
+        return -1;
+    }
+
+    // sampled from the index rather than the slots, which may be mostly
+    // free: a bucket holds a few keys, all of them samples
+    int found = 0;
+    for (int n = 0; n < 4 * EVICT_SAMPLES && found < EVICT_SAMPLES; n++) {
+        uint32_t x = sh->evict_rand;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        sh->evict_rand = x;
+        struct index *ix = sh->old.buckets && (x & 1) ? &sh->old : &sh->cur;
+        struct bucket *bk = &ix->buckets[(x >> 1) % ix->nbuckets];
+        for (int i = 0; i < BUCKET_SLOTS; i++) {
+            uint32_t idx = bk->slot[i];
+            if (idx == SLOT_EMPTY || idx == SLOT_TOMB || !evictable(sh, idx, skip)) {
+                continue;
+            }
+            found++;
+            // ages relative to the clock, which may have wrapped
+            if (victim < 0 || sh->access_clock - ENTRY(sh, idx)->last_used >
+                              sh->access_clock - ENTRY(sh, victim)->last_used) {
+                victim = idx;
+            }
+        }
+    }
+    return victim;
+}
+
+/*
+ * Evicts one key to make room for a write to the key hashing to h, at
+ * idx if it exists already. The key evicted waits in evicted[] for
+ * evict_release(). Called with the shard lock held.
+ *
+ * Returns 1 if a key was evicted, 0 if none could be, or -1 if admission
+ * turned the new key away.
+ */
+int evict_one(struct shard *sh, int idx, uint64_t h) {
+    if (n_evicted == EVICT_PENDING) {
+        return 0;
+    }
+    int victim = evict_pick(sh, idx);
+    if (victim < 0) {
+        return 0;
+    }
+    struct entry *e = ENTRY(sh, victim);
+    if (idx < 0 && sh->sketch &&
+        sketch_estimate(sh, h) <= sketch_estimate(sh, e->hash)) {
+        sh->admit_rejects++;
+        return -1;
+    }
+    sh->key_evictions++;
+    sh->evicted_bytes += e->loc.len;
+    drop_for_storage(sh, victim, &evicted[n_evicted++]);
+    return 1;
+}
+
+/*
+ * Before a write to the key hashing to h, at idx if it exists: counts
+ * the use, then evicts keys until the shard is within its share of the
+ * budget. Called with the shard lock held.
+ *
+ * Returns 0 if admission turned the key away.
+ */
+int evict_to_budget(struct shard *sh, int idx, uint64_t h) {
+    size_t share = evict_budget / n_shards;
+
+    sketch_add(sh, h);
+    for (int n = 0; n < EVICT_MAX && evict_budget && sh->key_bytes >= share; n++) {
+        int r = evict_one(sh, idx, h);
+        if (r <= 0) {
+            return r == 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Removes the keys this thread evicted from storage. Called with no
+ * shard lock held.
+ */
+void evict_release(void) {
+    for (int i = 0; i < n_evicted; i++) {
+        storage->remove(evicted[i].slot, evicted[i].name, evicted[i].ticket,
+                        &evicted[i].loc);
+    }
+    n_evicted = 0;
+}
+
+/*
+ * Called once all len bytes of a value are in its still open file: under
+ * --durability=sync flushes them, and the directory entry pointing at
+ * them, before the write counts as done.
+ */
+int file_written(int fd, int len) {
+    if (durability == DURABLE_SYNC && (fdatasync(fd) < 0 || fsync(data_dir_fd) < 0)) {
+        LOG_ERRNO("Cannot sync file");
+        return 0;
+    }
+    commit_note(len);
+    return 1;
+}
+
+/*
+ * Writes data to a file.
+ */
+int write_to_file(const char *filename, const char *data, int len) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+
+    if (fd < 0) {
+        LOG_ERRNO("Cannot open file");
+        return 0;
+    }
+
+    // a short write is not an error, just something to finish
+    int left = len;
+    while (left > 0) {
+        int n = write(fd, data, left);
+        if (n <= 0) {
+            LOG_ERRNO("Cannot write to file");
+            close(fd);
+            return 0;
+        }
+        data += n;
+        left -= n;
+    }
+
+    if (!file_written(fd, len)) {
+        close(fd);
+        return 0;
+    }
+    if (close(fd) < 0) {
+        LOG_ERRNO("Cannot write to file");
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Reads data from a file.
+ *
+ * Returns the number of bytes read, or -1 if the file could not be read.
+ */
+int read_from_file(const char *filename, char *buf, int len) {
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+        LOG_ERRNO("Cannot open file");
+        return -1;
+    }
+
+    int n = 0;
+    while (n < len) {
+        int r = read(fd, buf + n, len - n);
+        if (r < 0) {
+            LOG_ERRNO("Cannot read from file");
+            close(fd);
+            return -1;
+        }
+        if (r == 0) {
+            break;
+        }
+        n += r;
+    }
+    close(fd);
+
+    LOG(LOG_DEBUG, "read_from_file: read %d bytes. First few bytes: '%.*s'\n",
+        n, n > 20 ? 20 : n, buf);
+
+    return n;
+}
+
+/*
+ * Hands the next piece of a value being streamed to storage.
+ */
+int value_writer_put(struct value_writer *w, const char *data, int len) {
+    while (len > 0) {
+        ssize_t n = pwrite(w->fd, data, len, w->off);
+        if (n <= 0) {
+            LOG_ERRNO("Cannot write value");
+            return 0;
+        }
+        w->crc = crc32c(w->crc, data, n);
+        data += n;
+        len -= n;
+        w->off += n;
+    }
+    return 1;
+}
+
+/*
+ * Counts and logs a value that came back from storage different from
+ * how it went in.
+ */
+void value_corrupt(const struct location *loc, int len) {
+    STAT_ADD(storage_crc_errors, 1);
+    LOG(LOG_ERROR, "Stored value is corrupt: %d of %u bytes, checksum mismatch\n",
+        len, loc->len);
+}
+
+/*
+ * Checks len bytes of a value read back from storage against the
+ * checksum it was stored with.
+ */
+int value_check(const struct location *loc, const char *data, int len) {
+    if (len == loc->len && crc32c(0, data, len) == loc->crc) {
+        return 1;
+    }
+    value_corrupt(loc, len);
+    return 0;
+}
+
+/*
+ * File backend: one file per stored version, data.<slot>.<n>. A new
+ * version never touches the file a reader may be reading; the old file
+ * is unlinked once the new one is published.
+ */
+static uint64_t file_seq;
+
+static void file_name(char *filename, uint32_t idx, const struct location *loc) {
+    sprintf(filename, "/tmp/data.%u.%llu", idx, (unsigned long long)loc->off);
+}
+
+int file_write(uint32_t idx, const char *name, uint64_t ticket,
+               const char *data, int len, struct location *loc) {
+    char filename[64];
+    loc->seg = idx;
+    loc->off = __atomic_add_fetch(&file_seq, 1, __ATOMIC_RELAXED);
+    loc->len = len;
+    loc->crc = crc32c(0, data, len);
+    file_name(filename, idx, loc);
+    if (!write_to_file(filename, data, len)) {
+        unlink(filename);
+        return 0;
+    }
+    return 1;
+}
+
+int file_read(uint32_t idx, const struct location *loc, char *buf, int len) {
+    char filename[64];
+    file_name(filename, idx, loc);
+    int n = read_from_file(filename, buf, len);
+    return n < 0 || value_check(loc, buf, n) ? n : -1;
+}
+
+void file_remove(uint32_t idx, const char *name, uint64_t ticket,
+                 const struct location *loc) {
+    char filename[64];
+    file_name(filename, idx, loc);
+    unlink(filename); // delete the file by unlinking it
+    if (durability == DURABLE_SYNC && fsync(data_dir_fd) < 0) {
+        LOG_ERRNO("Cannot sync directory");
+    }
+    commit_note(0);
+}
+
+void file_release(const struct location *loc) {
+    char filename[64];
+    file_name(filename, loc->seg, loc);
+    unlink(filename);
+}
+
+int file_open_ref(uint32_t idx, const struct location *loc,
+                  struct value_ref *ref) {
+    char filename[64];
+    struct stat st;
+
+    file_name(filename, idx, loc);
+    ref->fd = open(filename, O_RDONLY);
+    if (ref->fd < 0) {
+        return 0;
+    }
+    if (fstat(ref->fd, &st) < 0) {
+        close(ref->fd);
+        return 0;
+    }
+    ref->map = NULL;
+    ref->off = 0;
+    ref->len = st.st_size;
+    if (ref->len != loc->len) {
+        value_corrupt(loc, ref->len);
+        close(ref->fd);
+        return 0;
+    }
+    if (!zero_copy_verify) {
+        return 1;
+    }
+
+    // the bytes go out with sendfile(), so this reads them an extra time
+    char buf[STREAM_CHUNK];
+    uint32_t crc = 0;
+    for (off_t off = 0; off < ref->len; ) {
+        ssize_t n = pread(ref->fd, buf, sizeof(buf), off);
+        if (n <= 0) {
+            break;
+        }
+        crc = crc32c(crc, buf, n);
+        off += n;
+    }
+    if (crc != loc->crc) {
+        value_corrupt(loc, ref->len);
+        close(ref->fd);
+        return 0;
+    }
+    return 1;
+}
+
+int file_write_begin(uint32_t idx, const char *name, uint64_t ticket, int len,
+                     struct location *loc, struct value_writer *w) {
+    char filename[64];
+    loc->seg = idx;
+    loc->off = __atomic_add_fetch(&file_seq, 1, __ATOMIC_RELAXED);
+    loc->len = len;
+    file_name(filename, idx, loc);
+    w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+    if (w->fd < 0) {
+        LOG_ERRNO("Cannot open file");
+        return 0;
+    }
+    w->off = 0;
+    w->crc = 0;
+    return 1;
+}
+
+int file_write_end(struct value_writer *w, struct location *loc, int ok) {
+    if (ok) {
+        ok = file_written(w->fd, loc->len);
+    }
+    if (close(w->fd) < 0) {
+        LOG_ERRNO("Cannot write to file");
+        ok = 0;
+    }
+    if (!ok) {
+        file_release(loc);
+    }
+    loc->crc = w->crc;
+    return ok;
+}
+
+void file_write_many(struct batch_write *w, int n) {
+    for (int i = 0; i < n; i++) {
+        w[i].ok = file_write(w[i].idx, w[i].name, w[i].ticket, w[i].data,
+                             w[i].len, &w[i].loc);
+    }
+}
+
+/*
+ * A group commit: everything on the filesystem values live on, which
+ * covers new files, their directory entries and unlinks alike.
+ */
+void file_sync(void) {
+    if (syncfs(data_dir_fd) < 0) {
+        LOG_ERRNO("Cannot sync files");
+    }
+}
+
+static struct storage file_storage = {
+    "file", file_write, file_read, file_remove, file_release, file_release,
+    file_open_ref, file_write_begin, file_write_end, file_write_many, file_sync
+};
+
+/*
+ * io_uring backend: the file backend's files, but each write, read and
+ * unlink goes to the kernel as one chain on the shared ring (uring.c)
+ * instead of a run of blocking calls: open into a registered file slot,
+ * write or read through it, close it. A batch's writes are queued
+ * together and submitted at once, and unlinks aren't waited for.
+ * Streams and zero-copy refs use the file backend's calls, as does any
+ * request that finds all the file slots taken.
+ */
+#define URING_ENTRIES 1024
+#define URING_FILES   1024
+
+struct uring_file {
+    struct uring_op op;
+    int slot;
+    int n_sqes;
+    char filename[64];
+};
+
+/*
+ * Queues the open, opcode and close chain for f. A write under
+ * --durability=sync also flushes the file before closing it and then
+ * the directory. Called between uring_lock() and uring_submit().
+ */
+void uring_prep_file(struct uring_file *f, int flags, int opcode, const void *buf,
+                     int len) {
+    struct io_uring_sqe *sqe[5];
+    int sync = opcode == IORING_OP_WRITE && durability == DURABLE_SYNC;
+
+    f->n_sqes = sync ? 5 : 3;
+    uring_prep(&f->op, f->n_sqes, sqe);
+    sqe[0]->opcode = IORING_OP_OPENAT;
+    sqe[0]->fd = AT_FDCWD;
+    sqe[0]->addr = (uintptr_t)f->filename;
+    sqe[0]->len = 0777;
+    sqe[0]->open_flags = flags;
+    sqe[0]->file_index = f->slot + 1;
+    sqe[0]->flags = IOSQE_IO_LINK;
+    sqe[1]->opcode = opcode;
+    sqe[1]->fd = f->slot;
+    sqe[1]->addr = (uintptr_t)buf;
+    sqe[1]->len = len;
+    sqe[1]->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK; // close it regardless
+    if (sync) {
+        sqe[2]->opcode = IORING_OP_FSYNC;
+        sqe[2]->fd = f->slot;
+        sqe[2]->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe[2]->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    }
+    struct io_uring_sqe *close_sqe = sqe[sync ? 3 : 2];
+    close_sqe->opcode = IORING_OP_CLOSE;
+    close_sqe->file_index = f->slot + 1;
+    if (sync) {
+        close_sqe->flags = IOSQE_IO_HARDLINK;
+        sqe[4]->opcode = IORING_OP_FSYNC;
+        sqe[4]->fd = data_dir_fd;
+    }
+}
+
+/*
+ * Waits for f's chain and gives back its slot.
+ *
+ * Returns the result of the read or write, or -errno of whatever failed.
+ */
+int uring_file_done(struct uring_file *f) {
+    uring_wait(&f->op);
+    uring_file_put(f->slot);
+    for (int i = 0; i < f->n_sqes; i++) {
+        if (f->op.res[i] < 0) {
+            return f->op.res[i];
+        }
+    }
+    return f->op.res[1];
+}
+
+void uring_write_many(struct batch_write *w, int n) {
+    struct uring_file one, *f = n == 1 ? &one : malloc(n * sizeof(*f));
+
+    if (!f) {
+        LOG_ERRNO("malloc");
+        file_write_many(w, n);
+        return;
+    }
+    uring_lock();
+    for (int i = 0; i < n; i++) {
+        struct location *loc = &w[i].loc;
+        loc->seg = w[i].idx;
+        loc->off = __atomic_add_fetch(&file_seq, 1, __ATOMIC_RELAXED);
+        loc->len = w[i].len;
+        loc->crc = crc32c(0, w[i].data, w[i].len);
+        file_name(f[i].filename, w[i].idx, loc);
+        f[i].slot = uring_file_get();
+        if (f[i].slot >= 0) {
+            uring_prep_file(&f[i], O_WRONLY | O_CREAT | O_TRUNC, IORING_OP_WRITE,
+                            w[i].data, w[i].len);
+        }
+    }
+    uring_submit();
+
+    for (int i = 0; i < n; i++) {
+        if (f[i].slot < 0) {
+            w[i].ok = write_to_file(f[i].filename, w[i].data, w[i].len);
+        } else {
+            int r = uring_file_done(&f[i]);
+            w[i].ok = r == w[i].len;
+            if (!w[i].ok) {
+                LOG(LOG_ERROR, "Cannot write to file: %s\n",
+                    r < 0 ? strerror(-r) : "short write");
+            } else {
+                commit_note(w[i].len);
+            }
+        }
+        if (!w[i].ok) {
+            unlink(f[i].filename);
+        }
+    }
+    if (f != &one) {
+        free(f);
+    }
+}
+
+int uring_write(uint32_t idx, const char *name, uint64_t ticket,
+                const char *data, int len, struct location *loc) {
+    struct batch_write w = {idx, name, ticket, data, len, 0, *loc};
+
+    uring_write_many(&w, 1);
+    *loc = w.loc;
+    return w.ok;
+}
+
+int uring_read(uint32_t idx, const struct location *loc, char *buf, int len) {
+    struct uring_file f;
+
+    f.slot = uring_file_get();
+    if (f.slot < 0) {
+        return file_read(idx, loc, buf, len);
+    }
+    file_name(f.filename, idx, loc);
+    uring_lock();
+    uring_prep_file(&f, O_RDONLY, IORING_OP_READ, buf, len);
+    uring_submit();
+
+    int n = uring_file_done(&f);
+    if (n < 0) {
+        LOG(LOG_ERROR, "Cannot read from file: %s\n", strerror(-n));
+        return -1;
+    }
+    return value_check(loc, buf, n) ? n : -1;
+}
+
+void uring_release(const struct location *loc) {
+    struct uring_file *f = malloc(sizeof(*f)); // freed by the ring
+    struct io_uring_sqe *sqe;
+
+    if (!f) {
+        file_release(loc);
+        return;
+    }
+    file_name(f->filename, loc->seg, loc);
+    uring_lock();
+    uring_prep(&f->op, 1, &sqe);
+    f->op.detached = 1;
+    sqe->opcode = IORING_OP_UNLINKAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)f->filename;
+    uring_submit();
+}
+
+void uring_remove(uint32_t idx, const char *name, uint64_t ticket,
+                  const struct location *loc) {
+    if (durability != DURABLE_NONE) {
+        file_remove(idx, name, ticket, loc); // the unlink must be done before the sync
+    } else {
+        uring_release(loc);
+    }
+}
+
+static struct storage uring_storage = {
+    "uring", uring_write, uring_read, uring_remove, uring_release,
+    uring_release, file_open_ref, file_write_begin, file_write_end, uring_write_many, file_sync
+};
+
+void segment_name(char *filename, uint64_t id) {
+    sprintf(filename, "/tmp/seg.%llu", (unsigned long long)id);
+}
+
+/*
+ * Reserves space for n consecutive records at the end of the log,
+ * starting a new segment when the active one can't take them. Records
+ * bigger than a whole segment get a segment of their own. A streamed
+ * record (n is 1) goes on log_streams in the same breath, so that a
+ * snapshot either sees it there or points before it.
+ *
+ * Returns the segment number, or -1 if no segment could be created.
+ */
+int log_reserve(struct record_hdr *hdr, int n, uint64_t *off,
+                struct value_writer *stream) {
+    uint64_t size = 0;
+    for (int i = 0; i < n; i++) {
+        size += sizeof(*hdr) + hdr[i].len;
+    }
+
+    pthread_mutex_lock(&log_lock);
+    int seg = log_active;
+    if (seg < 0 || (segments[seg].size > 0 &&
+                    segments[seg].size + size > SEGMENT_SIZE)) {
+        char filename[64];
+        if (n_free == 0 && n_segments == MAX_SEGMENTS) {
+            // every slot holds live data: nothing to be done but stop
+            fprintf(stderr, "All %d log segments are live, stopping\n",
+                    MAX_SEGMENTS);
+            exit(1);
+        }
+        seg = n_free > 0 ? free_slots[n_free - 1] : n_segments;
+        segment_name(filename, log_next_id);
+        int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            LOG_ERRNO("Cannot create segment");
+            pthread_mutex_unlock(&log_lock);
+            return -1;
+        }
+        // reads are served from a mapping of the whole segment; pages
+        // past the end of the file are never touched
+        size_t map_len = size > SEGMENT_SIZE ? size : SEGMENT_SIZE;
+        char *map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            LOG_ERRNO("Cannot map segment");
+            close(fd);
+            pthread_mutex_unlock(&log_lock);
+            return -1;
+        }
+        segments[seg].fd = fd;
+        segments[seg].map = map;
+        segments[seg].map_len = map_len;
+        segments[seg].size = segments[seg].dead = 0;
+        segments[seg].id = log_next_id++;
+        if (seg < n_segments) {
+            n_free--;
+            __atomic_add_fetch(&segments[seg].gen, 1, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&segments[seg].retired, 0, __ATOMIC_SEQ_CST);
+        } else {
+            n_segments++;
+        }
+        log_active = seg;
+    }
+    *off = segments[seg].size;
+    segments[seg].size += size;
+    segments[seg].writing += n;
+    log_appended += size;
+    for (int i = 0; i < n; i++) {
+        hdr[i].seq = ++log_seq;
+    }
+    if (stream) {
+        stream->seg = seg;
+        stream->start = *off;
+        stream->prev = NULL;
+        stream->next = log_streams;
+        if (log_streams) {
+            log_streams->prev = stream;
+        }
+        log_streams = stream;
+    }
+    pthread_mutex_unlock(&log_lock);
+    return seg;
+}
+
+/*
+ * Called once n records reserved in seg are written, or have failed.
+ */
+void log_done(int seg, int n) {
+    __atomic_sub_fetch(&segments[seg].writing, n, __ATOMIC_RELEASE);
+}
+
+/*
+ * Keeps a segment mapped while a reader uses it. Returns 0 if it has
+ * been compacted away; the entry pointing into it has moved on.
+ */
+int log_pin(uint32_t seg) {
+    __atomic_add_fetch(&segments[seg].readers, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&segments[seg].retired, __ATOMIC_SEQ_CST)) {
+        __atomic_sub_fetch(&segments[seg].readers, 1, __ATOMIC_RELEASE);
+        return 0;
+    }
+    return 1;
+}
+
+void log_unpin(uint32_t seg) {
+    __atomic_sub_fetch(&segments[seg].readers, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * log_pin() for the record at loc. The entry loc came from may have moved
+ * on and the slot been reused since; then the gens differ.
+ */
+int log_pin_loc(const struct location *loc) {
+    if (!log_pin(loc->seg)) {
+        return 0;
+    }
+    if (__atomic_load_n(&segments[loc->seg].gen, __ATOMIC_SEQ_CST) != loc->gen) {
+        log_unpin(loc->seg);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Writes out a gather list in full, at most IOV_MAX entries per call.
+ * Consumes iov.
+ */
+int pwritev_all(int fd, struct iovec *iov, int n_iov, off_t off) {
+    while (n_iov > 0) {
+        ssize_t n = pwritev(fd, iov, n_iov < IOV_MAX ? n_iov : IOV_MAX, off);
+        if (n <= 0) {
+            return 0;
+        }
+        off += n;
+        // skip over what went out
+        while (n_iov > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            n_iov--;
+        }
+        if (n_iov > 0) {
+            iov->iov_base += n;
+            iov->iov_len -= n;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Called once bytes of records are written to seg: under
+ * --durability=sync flushes the segment, under group commit leaves it
+ * for the committer.
+ */
+int log_written(int seg, size_t bytes) {
+    if (durability == DURABLE_SYNC && fdatasync(segments[seg].fd) < 0) {
+        LOG_ERRNO("Cannot sync segment");
+        return 0;
+    }
+    if (durability == DURABLE_GROUP) {
+        __atomic_store_n(&segments[seg].dirty, 1, __ATOMIC_SEQ_CST);
+        commit_note(bytes);
+    }
+    return 1;
+}
+
+/*
+ * Appends a record to the log.
+ */
+int log_append(struct record_hdr *hdr, const char *data, struct location *loc) {
+    uint64_t off;
+    int seg = log_reserve(hdr, 1, &off, NULL);
+    if (seg < 0) {
+        return 0;
+    }
+
+    struct iovec iov[2] = {
+        {hdr, sizeof(*hdr)},
+        {(void *)data, hdr->len}
+    };
+    int ok = pwritev_all(segments[seg].fd, iov, 2, off);
+    log_done(seg, 1);
+    if (!ok) {
+        LOG_ERRNO("Cannot append to segment");
+        return 0;
+    }
+    if (!log_written(seg, sizeof(*hdr) + hdr->len)) {
+        return 0;
+    }
+
+    loc->seg = seg;
+    loc->gen = segments[seg].gen;
+    loc->off = off;
+    loc->len = hdr->len;
+    loc->crc = hdr->crc;
+    return 1;
+}
+
+/*
+ * Counts a record as garbage.
+ */
+void log_mark_dead(uint32_t seg, uint64_t bytes) {
+    pthread_mutex_lock(&log_lock);
+    if (segments[seg].map) {
+        segments[seg].dead += bytes;
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+int log_write(uint32_t idx, const char *name, uint64_t ticket,
+              const char *data, int len, struct location *loc) {
+    struct record_hdr hdr = {
+        .magic = RECORD_MAGIC, .flags = loc->codec << RECORD_CODEC_SHIFT,
+        .len = len, .crc = crc32c(0, data, len), .ticket = ticket,
+        .expires = loc->expires
+    };
+
+    strncpy(hdr.name, name, sizeof(hdr.name) - 1);
+    return log_append(&hdr, data, loc);
+}
+
+int log_read(uint32_t idx, const struct location *loc, char *buf, int len) {
+    if (!log_pin_loc(loc)) {
+        return -1;
+    }
+    const char *value = segments[loc->seg].map + loc->off + sizeof(struct record_hdr);
+    int want = loc->len < len ? loc->len : len;
+    int ok = value_check(loc, value, loc->len);
+
+    if (ok) {
+        memcpy(buf, value, want);
+    }
+    log_unpin(loc->seg);
+    return ok ? want : -1;
+}
+
+/*
+ * Sent from the segment file rather than the mapping, so compaction can
+ * unmap the segment while a slow client is still being sent the value.
+ */
+int log_open_ref(uint32_t idx, const struct location *loc,
+                 struct value_ref *ref) {
+    if (!log_pin_loc(loc)) {
+        return 0;
+    }
+    ref->map = NULL;
+    ref->off = loc->off + sizeof(struct record_hdr);
+    ref->len = loc->len;
+    ref->fd = -1;
+    if (!zero_copy_verify ||
+        value_check(loc, segments[loc->seg].map + ref->off, ref->len)) {
+        ref->fd = dup(segments[loc->seg].fd);
+    }
+    log_unpin(loc->seg);
+    return ref->fd >= 0;
+}
+
+void log_release(const struct location *loc) {
+    pthread_mutex_lock(&log_lock);
+    if (segments[loc->seg].map && segments[loc->seg].gen == loc->gen) {
+        segments[loc->seg].dead += sizeof(struct record_hdr) + loc->len;
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+void log_remove(uint32_t idx, const char *name, uint64_t ticket,
+                const struct location *loc) {
+    struct record_hdr hdr = {
+        .magic = RECORD_MAGIC, .flags = RECORD_TOMBSTONE, .ticket = ticket
+    };
+    struct location tomb;
+
+    strncpy(hdr.name, name, sizeof(hdr.name) - 1);
+    log_release(loc);
+    log_append(&hdr, NULL, &tomb); // live until compaction can drop it
+}
+
+/*
+ * Flags the record at loc, in a segment that can't go meanwhile, so a
+ * restart doesn't replay it.
+ */
+void log_flag_discarded(const struct location *loc) {
+    uint32_t flags = RECORD_DISCARDED | loc->codec << RECORD_CODEC_SHIFT;
+
+    if (pwrite(segments[loc->seg].fd, &flags, sizeof(flags),
+               loc->off + offsetof(struct record_hdr, flags)) != sizeof(flags)) {
+        LOG_ERRNO("Cannot discard record");
+    }
+}
+
+/*
+ * Flags the record so a restart doesn't replay it: if the key is deleted
+ * meanwhile, nothing else would say the record lost.
+ */
+void log_discard(const struct location *loc) {
+    if (!log_pin_loc(loc)) {
+        return;
+    }
+    log_flag_discarded(loc);
+    log_unpin(loc->seg);
+    log_release(loc);
+}
+
+/*
+ * Takes a streamed record off log_streams.
+ */
+void log_unlist(struct value_writer *w) {
+    pthread_mutex_lock(&log_lock);
+    if (w->prev) {
+        w->prev->next = w->next;
+    } else {
+        log_streams = w->next;
+    }
+    if (w->next) {
+        w->next->prev = w->prev;
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+/*
+ * Reserves the whole record up front and writes its header; the value
+ * follows it in pieces. Reservations are handed out in order, so the
+ * record's place in the log doesn't depend on how long the value takes
+ * to arrive. The checksum goes into the header once the value is in.
+ */
+int log_write_begin(uint32_t idx, const char *name, uint64_t ticket, int len,
+                    struct location *loc, struct value_writer *w) {
+    struct record_hdr hdr = {.magic = RECORD_MAGIC, .len = len, .ticket = ticket};
+    uint64_t off;
+
+    strncpy(hdr.name, name, sizeof(hdr.name) - 1);
+    int seg = log_reserve(&hdr, 1, &off, w);
+    if (seg < 0) {
+        return 0;
+    }
+    loc->seg = seg;
+    loc->gen = segments[seg].gen;
+    loc->off = off;
+    loc->len = len;
+    w->fd = segments[seg].fd;
+    w->off = off;
+    if (!value_writer_put(w, (const char *)&hdr, sizeof(hdr))) {
+        log_unlist(w);
+        log_done(seg, 1);
+        log_release(loc);
+        return 0;
+    }
+    w->crc = 0;
+    return 1;
+}
+
+int log_write_end(struct value_writer *w, struct location *loc, int ok) {
+    log_unlist(w);
+    loc->crc = w->crc;
+    if (ok && pwrite(w->fd, &loc->crc, sizeof(loc->crc),
+                     loc->off + offsetof(struct record_hdr, crc)) != sizeof(loc->crc)) {
+        LOG_ERRNO("Cannot write value");
+        ok = 0;
+    }
+    log_done(loc->seg, 1);
+    if (ok) {
+        ok = log_written(loc->seg, sizeof(struct record_hdr) + loc->len);
+    }
+    if (!ok) {
+        log_release(loc); // the space stays reserved, as garbage
+    }
+    return ok;
+}
+
+/*
+ * Appends all the records with one reservation and one gathered write.
+ */
+void log_write_many(struct batch_write *w, int n) {
+    struct record_hdr *hdr = calloc(n, sizeof(*hdr));
+    struct iovec *iov = malloc(2 * n * sizeof(*iov));
+    uint64_t off;
+    int seg = -1;
+
+    if (hdr && iov) {
+        for (int i = 0; i < n; i++) {
+            hdr[i].magic = RECORD_MAGIC;
+            hdr[i].flags = w[i].loc.codec << RECORD_CODEC_SHIFT;
+            hdr[i].len = w[i].len;
+            hdr[i].crc = crc32c(0, w[i].data, w[i].len);
+            hdr[i].ticket = w[i].ticket;
+            hdr[i].expires = w[i].loc.expires;
+            strncpy(hdr[i].name, w[i].name, sizeof(hdr[i].name) - 1);
+            iov[2 * i] = (struct iovec){&hdr[i], sizeof(hdr[i])};
+            iov[2 * i + 1] = (struct iovec){(void *)w[i].data, w[i].len};
+        }
+        seg = log_reserve(hdr, n, &off, NULL);
+    } else {
+        LOG_ERRNO("malloc");
+    }
+    for (int i = 0; i < n; i++) {
+        w[i].ok = 0;
+        if (seg >= 0) {
+            w[i].loc.seg = seg;
+            w[i].loc.gen = segments[seg].gen;
+            w[i].loc.off = off;
+            w[i].loc.len = w[i].len;
+            w[i].loc.crc = hdr[i].crc;
+            off += sizeof(*hdr) + w[i].len;
+        }
+    }
+    if (seg >= 0) {
+        int written = pwritev_all(segments[seg].fd, iov, 2 * n, w[0].loc.off);
+        log_done(seg, n);
+        if (written && log_written(seg, off - w[0].loc.off)) {
+            for (int i = 0; i < n; i++) {
+                w[i].ok = 1;
+            }
+        } else {
+            LOG_ERRNO("Cannot append to segment");
+            log_mark_dead(seg, off - w[0].loc.off);
+        }
+    }
+    free(hdr);
+    free(iov);
+}
+
+/*
+ * A group commit: flushes every segment written since the last one.
+ * A writer marks its segment after its write, so a segment found clean
+ * here was synced after that writer's data went in. Each is pinned while
+ * synced, so compaction can't close its fd meanwhile; one compacted away
+ * needs no sync.
+ */
+void log_sync(void) {
+    pthread_mutex_lock(&log_lock);
+    int n = n_segments;
+    pthread_mutex_unlock(&log_lock);
+
+    for (int i = 0; i < n; i++) {
+        if (!__atomic_load_n(&segments[i].dirty, __ATOMIC_SEQ_CST) || !log_pin(i)) {
+            continue;
+        }
+        if (__atomic_exchange_n(&segments[i].dirty, 0, __ATOMIC_SEQ_CST) &&
+            fdatasync(segments[i].fd) < 0) {
+            LOG_ERRNO("Cannot sync segment");
+        }
+        log_unpin(i);
+    }
+}
+
+static struct storage log_storage = {
+    "log", log_write, log_read, log_remove, log_release, log_discard,
+    log_open_ref, log_write_begin, log_write_end, log_write_many, log_sync
+};
+
+/*
+ * Snapshot file layout: a snapshot_hdr, then n snapshot_entry.
+ */
+struct snapshot_hdr {
+    uint32_t magic;
+    uint32_t crc;               /* CRC32C of the entries */
+    uint64_t n;
+    uint64_t seq;               /* records up to here are covered... */
+    uint64_t off;               /* ...which all come before off in seg */
+    uint64_t seg;               /* a segment id */
+    uint64_t max_ticket;        /* highest ticket handed out */
+};
+
+struct snapshot_entry {
+    char name[32];
+    uint64_t ticket;
+    uint64_t seg;               /* loc's segment id: slots change on restart */
+    struct location loc;
+};
+
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t snapshot_seq;       // the last snapshot's, under snapshot_lock
+static uint64_t snapshots, snapshot_ns;     // taken and time spent, atomic
+
+/*
+ * Recovery figures, for the stats.
+ */
+static struct {
+    uint64_t ns;
+    uint64_t keys, snapshot_keys;
+    uint64_t records, bytes;    /* replayed from the log */
+} recovery;
+
+/*
+ * Waits until every write begun before the call has published its
+ * result: bumps snapshot_epoch and waits out the writes begun under the
+ * old one. Called with snapshot_lock held.
+ */
+void writes_quiesce(void) {
+    int old = __atomic_fetch_add(&snapshot_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+    for (int i = 0; i < n_shards; ) {
+        pthread_mutex_lock(&shards[i].lock);
+        int busy = shards[i].in_flight[old];
+        pthread_mutex_unlock(&shards[i].lock);
+        if (busy) {
+            usleep(100);
+        } else {
+            i++;
+        }
+    }
+}
+
+/*
+ * Writes a snapshot of the table to SNAPSHOT_FILE, replacing the last.
+ *
+ * The point it covers is the end of the log as it begins. Writes still
+ * in flight then may have records before that point that they only
+ * publish later, so it waits them out first: it bumps snapshot_epoch and
+ * waits for the writes begun under the old one. Anything begun after
+ * has its record past the point and is replayed. A key written meanwhile
+ * may end up both in the snapshot and in the replay; recovery keeps the
+ * higher ticket, so that does no harm.
+ *
+ * Streams are the exception: their bodies arrive at the client's pace, so
+ * they are suspended from the count (see write_suspend()) and the point
+ * is instead pulled back to the earliest streamed record still open. That
+ * record and everything after it is replayed; replay skips it if it never
+ * ends. Likewise it goes no later than a running compaction's first copy,
+ * as the segment being copied may be gone by the time it is loaded.
+ *
+ * Returns 0 on failure, leaving the last snapshot in place.
+ */
+int snapshot_take(void) {
+    struct snapshot_hdr hdr = {.magic = SNAPSHOT_MAGIC};
+    uint64_t start = now_ns();
+
+    pthread_mutex_lock(&snapshot_lock);
+    pthread_mutex_lock(&log_lock);
+    hdr.seq = log_seq;
+    hdr.seg = log_active >= 0 ? segments[log_active].id : 0;
+    hdr.off = log_active >= 0 ? segments[log_active].size : 0;
+    uint64_t last = hdr.seg;
+    for (struct value_writer *w = log_streams; w; w = w->next) {
+        uint64_t id = segments[w->seg].id;
+        if (id < hdr.seg || (id == hdr.seg && w->start < hdr.off)) {
+            hdr.seg = id;
+            hdr.off = w->start;
+        }
+    }
+    if (compact_from_id >= 0 && ((uint64_t)compact_from_id < hdr.seg ||
+        ((uint64_t)compact_from_id == hdr.seg && compact_from_off < hdr.off))) {
+        hdr.seg = compact_from_id;
+        hdr.off = compact_from_off;
+    }
+    pthread_mutex_unlock(&log_lock);
+    if (hdr.seq == snapshot_seq) {
+        pthread_mutex_unlock(&snapshot_lock);
+        return 1; // nothing new
+    }
+
+    writes_quiesce();
+
+    // the records it points at must be on disk before it is
+    pthread_mutex_lock(&log_lock);
+    int n_slots = n_segments;
+    pthread_mutex_unlock(&log_lock);
+    for (int i = 0; i < n_slots; i++) {
+        if (segments[i].fd >= 0 && segments[i].id <= last &&
+            fdatasync(segments[i].fd) < 0) {
+            LOG_ERRNO("Cannot sync segment");
+        }
+    }
+
+    FILE *f = fopen(SNAPSHOT_FILE ".tmp", "w");
+    if (!f) {
+        LOG_ERRNO("Cannot create snapshot");
+        pthread_mutex_unlock(&snapshot_lock);
+        return 0;
+    }
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    // copied out a shard at a time, and written with no lock held
+    struct snapshot_entry *buf = NULL;
+    size_t cap = 0;
+    for (int i = 0; i < n_shards; i++) {
+        struct shard *sh = &shards[i];
+        size_t n = 0;
+        pthread_mutex_lock(&sh->lock);
+        size_t need = sh->cur.used + (sh->old.buckets ? sh->old.used : 0);
+        if (need > cap) {
+            struct snapshot_entry *p = realloc(buf, need * sizeof(*buf));
+            if (!p) {
+                pthread_mutex_unlock(&sh->lock);
+                LOG_ERRNO("realloc");
+                fclose(f);
+                free(buf);
+                pthread_mutex_unlock(&snapshot_lock);
+                return 0;
+            }
+            buf = p;
+            cap = need;
+        }
+        for (uint32_t idx = 0; idx < sh->n_chunks * CHUNK_KEYS; idx++) {
+            struct entry *e = ENTRY(sh, idx);
+            if (e->state == STATE_VALID) {
+                memcpy(buf[n].name, e->name, sizeof(buf[n].name));
+                buf[n].ticket = e->committed;
+                buf[n].seg = segments[e->loc.seg].id;
+                buf[n].loc = e->loc;
+                n++;
+            }
+        }
+        if (sh->last_ticket > hdr.max_ticket) {
+            hdr.max_ticket = sh->last_ticket;
+        }
+        pthread_mutex_unlock(&sh->lock);
+
+        fwrite(buf, sizeof(*buf), n, f);
+        hdr.crc = crc32c(hdr.crc, buf, n * sizeof(*buf));
+        hdr.n += n;
+    }
+    free(buf);
+
+    rewind(f);
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    int ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(SNAPSHOT_FILE ".tmp", SNAPSHOT_FILE) < 0) {
+        LOG_ERRNO("Cannot write snapshot");
+        unlink(SNAPSHOT_FILE ".tmp");
+        pthread_mutex_unlock(&snapshot_lock);
+        return 0;
+    }
+    fsync(data_dir_fd);
+    snapshot_seq = hdr.seq;
+    __atomic_add_fetch(&snapshots, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&snapshot_ns, now_ns() - start, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&snapshot_lock);
+
+    LOG(LOG_INFO, "Snapshot of %llu keys up to record %llu in %.3f sec\n",
+        (unsigned long long)hdr.n, (unsigned long long)hdr.seq,
+        (now_ns() - start) / 1e9);
+    return 1;
+}
+
+void* snapshot_thread(void *arg) {
+    while (1) {
+        sleep(snapshot_interval);
+        snapshot_take();
+    }
+    return NULL;
+}
+
+/*
+ * Puts a recovered version of a key into the table, unless it already
+ * holds a later one. A delete (loc NULL) leaves the key pending so its
+ * ticket still overrides older records; log_recover() drops it at the end.
+ * The same version again is a compaction's copy of it, which the key
+ * moves to: the segment it was copied from may be gone.
+ *
+ * Returns 0 if the table is full.
+ */
+int recover_key(const char *name, uint64_t ticket, const struct location *loc) {
+    uint64_t h = hash_key(name);
+    struct shard *sh = shard_of(h);
+    int idx = find_key_index(sh, name, h);
+
+    if (idx < 0) {
+        idx = find_free_slot(sh);
+        if (idx < 0) {
+            return 0;
+        }
+        struct entry *e = ENTRY(sh, idx);
+        strncpy(e->name, name, sizeof(e->name) - 1);
+        e->name[sizeof(e->name) - 1] = '\0';
+        e->hash = h;
+        e->committed = 0;
+        index_insert(sh, idx);
+        e->state = STATE_PENDING;
+    }
+    struct entry *e = ENTRY(sh, idx);
+    if (ticket < e->committed || (ticket == e->committed &&
+                                  (!loc || e->state != STATE_VALID))) {
+        return 1; // overtaken: the record is garbage
+    }
+    e->committed = ticket;
+    if (e->state == STATE_VALID) {
+        sh->key_bytes -= KEY_COST(e);
+    }
+    if (loc) {
+        e->loc = *loc;
+        e->state = STATE_VALID;
+        sh->key_bytes += KEY_COST(e);
+    } else {
+        e->state = STATE_PENDING;
+    }
+    // keys that lapsed while we were down are reclaimed once running
+    timer_set(sh, idx);
+    if (ticket > sh->last_ticket) {
+        sh->last_ticket = ticket;
+    }
+    return 1;
+}
+
+/*
+ * Finds the slot of the segment with the given id, which log_recover()
+ * puts in id order. Returns -1 if there is none.
+ */
+int segment_slot(uint64_t id) {
+    int lo = 0, hi = n_segments;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (segments[mid].id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < n_segments && segments[lo].id == id && segments[lo].map ? lo : -1;
+}
+
+/*
+ * Loads SNAPSHOT_FILE into the table.
+ *
+ * Returns 1 with *hdr filled in, 0 if there is no snapshot, or -1 if it
+ * turned out unusable partway through.
+ */
+int snapshot_load(struct snapshot_hdr *hdr) {
+    FILE *f = fopen(SNAPSHOT_FILE, "r");
+    if (!f) {
+        return 0;
+    }
+    if (fread(hdr, sizeof(*hdr), 1, f) != 1 || hdr->magic != SNAPSHOT_MAGIC) {
+        LOG(LOG_WARN, "Ignoring %s: not a snapshot\n", SNAPSHOT_FILE);
+        fclose(f);
+        return 0;
+    }
+
+    struct snapshot_entry buf[4096];
+    uint32_t crc = 0;
+    uint64_t done = 0;
+    int ok = 1;
+    while (ok && done < hdr->n) {
+        size_t want = hdr->n - done < 4096 ? hdr->n - done : 4096;
+        size_t n = fread(buf, sizeof(*buf), want, f);
+        crc = crc32c(crc, buf, n * sizeof(*buf));
+        ok = n == want;
+        for (size_t i = 0; ok && i < n; i++) {
+            // a segment compacted away since: the key's copy is past
+            // the snapshot and gets replayed
+            int seg = segment_slot(buf[i].seg);
+            if (seg < 0) {
+                continue;
+            }
+            buf[i].loc.seg = seg;
+            buf[i].loc.gen = segments[seg].gen;
+            buf[i].name[sizeof(buf[i].name) - 1] = '\0';
+            ok = recover_key(buf[i].name, buf[i].ticket, &buf[i].loc);
+        }
+        done += n;
+    }
+    fclose(f);
+
+    if (!ok || crc != hdr->crc) {
+        LOG(LOG_WARN, "Ignoring %s: truncated, corrupt or too big\n", SNAPSHOT_FILE);
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * Checks for a whole record at off in a segment whose first end bytes are
+ * written, copying its header to hdr.
+ */
+int log_record_ok(const struct segment *sg, uint64_t off, uint64_t end,
+                  struct record_hdr *hdr) {
+    if (end - off < sizeof(*hdr)) {
+        return 0;
+    }
+    memcpy(hdr, sg->map + off, sizeof(*hdr));
+    return hdr->magic == RECORD_MAGIC &&
+           !(hdr->flags & ~(RECORD_TOMBSTONE | RECORD_DISCARDED |
+                            RECORD_CODEC_MASK)) &&
+           hdr->len <= end - off - sizeof(*hdr) &&
+           memchr(hdr->name, '\0', sizeof(hdr->name)) &&
+           crc32c(0, sg->map + off + sizeof(*hdr), hdr->len) == hdr->crc;
+}
+
+/*
+ * Replays a segment's records from off on, setting *valid to where the
+ * last whole record ends (off if there is none).
+ *
+ * Returns 0 if the table filled up.
+ */
+int log_replay(uint32_t seg, uint64_t off, uint64_t end, uint64_t *valid) {
+    struct segment *sg = &segments[seg];
+    struct record_hdr hdr;
+
+    *valid = off;
+
+    while (off < end) {
+        if (!log_record_ok(sg, off, end, &hdr)) {
+            off++; // torn by a crash: look for the next record
+            continue;
+        }
+        struct location loc = {
+            seg, hdr.len, off, hdr.crc, hdr.flags >> RECORD_CODEC_SHIFT,
+            sg->gen, hdr.expires
+        };
+        int tomb = hdr.flags & RECORD_TOMBSTONE;
+        if (!(hdr.flags & RECORD_DISCARDED) &&
+            !recover_key(hdr.name, hdr.ticket, tomb ? NULL : &loc)) {
+            return 0;
+        }
+        if (hdr.seq > log_seq) {
+            log_seq = hdr.seq;
+        }
+        off += sizeof(hdr) + hdr.len;
+        *valid = off;
+        recovery.records++;
+        recovery.bytes += sizeof(hdr) + hdr.len;
+    }
+    return 1;
+}
+
+int segment_cmp(const void *a, const void *b) {
+    uint64_t x = ((const struct segment *)a)->id;
+    uint64_t y = ((const struct segment *)b)->id;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Rebuilds the table from the log segments left in /tmp: the latest
+ * snapshot, then the records written after it. With no snapshot, the
+ * whole log is replayed. Called before any thread serves requests.
+ */
+void log_recover(void) {
+    uint64_t start = now_ns();
+    DIR *dir = opendir("/tmp");
+    struct dirent *de;
+    int max_seg = -1;
+
+    // compaction leaves gaps in the ids; the slots are packed in id order
+    while (dir && (de = readdir(dir))) {
+        char *end;
+        if (strncmp(de->d_name, "seg.", 4) == 0 && isdigit(de->d_name[4])) {
+            uint64_t id = strtoull(de->d_name + 4, &end, 10);
+            if (*end != '\0') {
+                continue;
+            }
+            if (max_seg + 1 == MAX_SEGMENTS) {
+                fprintf(stderr, "More than %d log segments in /tmp\n",
+                        MAX_SEGMENTS);
+                exit(1);
+            }
+            segments[++max_seg].id = id;
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    qsort(segments, max_seg + 1, sizeof(*segments), segment_cmp);
+    log_next_id = max_seg >= 0 ? segments[max_seg].id + 1 : 0;
+    log_active = max_seg;
+
+    uint64_t *size = calloc(max_seg + 2, sizeof(*size));
+    uint64_t *live = calloc(max_seg + 2, sizeof(*live));
+    if (!size || !live) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i <= max_seg; i++) {
+        char filename[64];
+        struct stat st;
+        segment_name(filename, segments[i].id);
+        segments[i].fd = open(filename, O_RDWR);
+        if (segments[i].fd < 0 || fstat(segments[i].fd, &st) < 0) {
+            continue;
+        }
+        size[i] = st.st_size;
+        segments[i].map_len = st.st_size > SEGMENT_SIZE ? st.st_size : SEGMENT_SIZE;
+        segments[i].map = mmap(NULL, segments[i].map_len, PROT_READ, MAP_SHARED,
+                               segments[i].fd, 0);
+        if (segments[i].map == MAP_FAILED) {
+            perror("Cannot map segment");
+            exit(1);
+        }
+        segments[i].size = size[i];
+    }
+    n_segments = max_seg + 1;
+
+    struct snapshot_hdr hdr = {0};
+    int loaded = snapshot_load(&hdr);
+    if (loaded < 0) {
+        // a partial load: start over from the log alone
+        for (int i = 0; i < n_shards; i++) {
+            struct shard *sh = &shards[i];
+            for (uint32_t idx = 0; idx < sh->n_chunks * CHUNK_KEYS; idx++) {
+                if (ENTRY(sh, idx)->state != STATE_INVALID) {
+                    drop_key(sh, idx);
+                }
+            }
+            sh->last_ticket = 0;
+        }
+    }
+    if (loaded <= 0) {
+        memset(&hdr, 0, sizeof(hdr));
+    } else {
+        recovery.snapshot_keys = hdr.n;
+    }
+    log_seq = hdr.seq;
+    snapshot_seq = loaded > 0 ? hdr.seq : 0;
+
+    for (int i = 0; i <= max_seg; i++) {
+        if (!segments[i].map || segments[i].id < hdr.seg) {
+            continue;
+        }
+        // a segment with nothing whole in it, say one given over to a
+        // big value that never finished, holds up nothing after it
+        uint64_t valid;
+        if (!log_replay(i, segments[i].id == hdr.seg ? hdr.off : 0, size[i],
+                        &valid)) {
+            fprintf(stderr, "Table full recovering segment %llu: the log holds "
+                    "more keys than --max-memory allows\n",
+                    (unsigned long long)segments[i].id);
+            exit(1);
+        }
+        if (i == max_seg && valid < size[i]) {
+            // a torn tail: appends carry on from the last whole record
+            LOG(LOG_WARN, "Dropping %llu torn bytes at the end of segment %llu\n",
+                (unsigned long long)(size[i] - valid),
+                (unsigned long long)segments[i].id);
+            if (ftruncate(segments[i].fd, valid) == 0) {
+                segments[i].size = valid;
+            }
+        }
+    }
+
+    // forget deleted keys, and snapshotted ones whose record was cut off
+    // after a crash; whatever isn't live is garbage
+    uint64_t max_ticket = hdr.max_ticket;
+    for (int i = 0; i < n_shards; i++) {
+        struct shard *sh = &shards[i];
+        for (uint32_t idx = 0; idx < sh->n_chunks * CHUNK_KEYS; idx++) {
+            struct entry *e = ENTRY(sh, idx);
+            if (e->state == STATE_PENDING ||
+                (e->state == STATE_VALID &&
+                 e->loc.off + sizeof(struct record_hdr) + e->loc.len >
+                 segments[e->loc.seg].size)) {
+                drop_key(sh, idx);
+            } else if (e->state == STATE_VALID) {
+                live[e->loc.seg] += sizeof(struct record_hdr) + e->loc.len;
+                recovery.keys++;
+            }
+        }
+        if (sh->last_ticket > max_ticket) {
+            max_ticket = sh->last_ticket;
+        }
+    }
+    for (int i = 0; i < n_shards; i++) {
+        shards[i].last_ticket = max_ticket;
+    }
+    for (int i = 0; i < n_segments; i++) {
+        segments[i].dead = segments[i].size - live[i];
+        if (!segments[i].map && i != log_active) {
+            free_slots[n_free++] = i;
+        }
+    }
+    free(size);
+    free(live);
+
+    recovery.ns = now_ns() - start;
+    LOG(LOG_INFO, "Recovered %llu keys in %.3f sec: %llu from the snapshot, "
+        "%llu records (%llu bytes) replayed from the log\n",
+        (unsigned long long)recovery.keys, recovery.ns / 1e9,
+        (unsigned long long)recovery.snapshot_keys,
+        (unsigned long long)recovery.records, (unsigned long long)recovery.bytes);
+}
+
+/*
+ * Compaction. Overwrites and deletes leave dead records in the log; a
+ * background thread takes the sealed segment with the most garbage, once
+ * at least compact_garbage percent of it is dead, copies its live records
+ * to the end of the log and deletes it. A record is live if its key's
+ * entry points at it. Copies keep their ticket, so after a crash halfway
+ * through recovery can take either the original or the copy. Copying is
+ * paced at compact_rate bytes per second so it doesn't crowd out
+ * requests.
+ *
+ * Readers take a location out of the table and read it unlocked, so a
+ * segment is only unmapped once nothing can reach it: a moved entry gets
+ * a new version, which sends a reader holding the old location round
+ * again, and the segment waits for the readers already in it.
+ *
+ * A tombstone must outlive every older record of its key, so it is
+ * carried forward unless its segment is the oldest one left.
+ */
+#define COMPACT_BATCH 256           // records per gathered write
+#define COMPACT_BATCH_BYTES (1 << 20)
+
+static int compact_garbage = 50;        // percent, 0 = never compact
+static size_t compact_rate = 32 << 20;  // bytes copied per second, 0 = no limit
+
+/*
+ * Compaction figures, for the stats. Atomic, so that reading them never
+ * waits on a compaction.
+ */
+static struct {
+    int64_t seg;                /* the id of the one being compacted, or -1 */
+    uint64_t seg_size, seg_done;    /* its bytes, and how far it got */
+    uint64_t segments;          /* compacted away */
+    uint64_t copied, reclaimed; /* bytes; reclaimed is net of copied */
+    uint64_t ns;
+} compaction = {-1};
+
+/*
+ * Picks the sealed segment with the most garbage past the threshold,
+ * and finds the oldest segment left.
+ *
+ * Returns the segment, or -1.
+ */
+int compact_pick(int *oldest) {
+    int best = -1;
+    double best_ratio = 0;
+
+    *oldest = -1;
+    pthread_mutex_lock(&log_lock);
+    for (int i = 0; i < n_segments; i++) {
+        struct segment *sg = &segments[i];
+        if (!sg->map || i == log_active) {
+            continue;
+        }
+        if (*oldest < 0 || sg->id < segments[*oldest].id) {
+            *oldest = i;
+        }
+        if (sg->size == 0 || sg->writing > 0) {
+            continue;
+        }
+        double ratio = (double)sg->dead / sg->size;
+        if (ratio * 100 >= compact_garbage && ratio > best_ratio) {
+            best = i;
+            best_ratio = ratio;
+        }
+    }
+    pthread_mutex_unlock(&log_lock);
+    return best;
+}
+
+/*
+ * Checks whether the record at off in seg is what its key's entry points
+ * at, and if so points the entry at to instead. If not, the copy at to
+ * is flagged discarded before the key can change again: a later delete's
+ * tombstone may be compacted away, and the copy must not outlive it.
+ */
+int compact_move(const char *name, uint32_t seg, uint64_t off,
+                 const struct location *to) {
+    uint64_t h = hash_key(name);
+    struct shard *sh = shard_of(h);
+    int live = 0;
+
+    pthread_mutex_lock(&sh->lock);
+    int idx = find_key_index(sh, name, h);
+    if (idx >= 0) {
+        struct entry *e = ENTRY(sh, idx);
+        live = e->state == STATE_VALID && e->loc.seg == seg && e->loc.off == off;
+        if (live && to) {
+            e->loc.seg = to->seg;
+            e->loc.gen = to->gen;
+            e->loc.off = to->off;
+            e->version++; // readers of the old copy try again
+        }
+    }
+    if (!live && to) {
+        log_flag_discarded(to);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return live;
+}
+
+/*
+ * Appends n records of seg, the ones at src[], with one gathered write,
+ * and moves their entries over. Copies whose key was rewritten or
+ * deleted meanwhile are garbage straight away, and flagged as such.
+ *
+ * Returns the segment they went to, or -1.
+ */
+int compact_copy(uint32_t seg, struct record_hdr *hdr, const uint64_t *src,
+                 int n) {
+    struct iovec iov[2 * COMPACT_BATCH];
+    uint64_t off;
+    int dest = log_reserve(hdr, n, &off, NULL);
+
+    if (dest < 0) {
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        iov[2 * i] = (struct iovec){&hdr[i], sizeof(hdr[i])};
+        iov[2 * i + 1] = (struct iovec){
+            segments[seg].map + src[i] + sizeof(hdr[i]), hdr[i].len
+        };
+    }
+    int ok = pwritev_all(segments[dest].fd, iov, 2 * n, off);
+    log_done(dest, n);
+    for (int i = 0; i < n; i++) {
+        uint64_t bytes = sizeof(hdr[i]) + hdr[i].len;
+        struct location to = {
+            dest, hdr[i].len, off, hdr[i].crc,
+            hdr[i].flags >> RECORD_CODEC_SHIFT, segments[dest].gen,
+            hdr[i].expires
+        };
+        if (!ok || (!(hdr[i].flags & RECORD_TOMBSTONE) &&
+                    !compact_move(hdr[i].name, seg, src[i], &to))) {
+            log_mark_dead(dest, bytes);
+        }
+        off += bytes;
+    }
+    if (!ok) {
+        LOG_ERRNO("Cannot append to segment");
+        return -1;
+    }
+    return dest;
+}
+
+/*
+ * Copies a segment's live records to the end of the log, then deletes
+ * it. Snapshots carry on meanwhile: while it runs they point no later
+ * than where its copies start, so that recovery replays the copies and
+ * moves keys over to them (see recover_key()) whether or not the segment
+ * is still there. snapshot_lock is only held to quiesce writes and to
+ * swap the segment out.
+ *
+ * Returns 0 on failure, leaving the segment in place.
+ */
+int compact_segment(uint32_t seg, int drop_tombstones) {
+    struct segment *sg = &segments[seg];
+    struct record_hdr hdr[COMPACT_BATCH];
+    uint64_t src[COMPACT_BATCH];
+    uint64_t start = now_ns(), copied = 0, batch = 0;
+    int64_t first = -1, last = -1;  // ids the copies went to
+    int n = 0, ok = 1;
+
+    pthread_mutex_lock(&snapshot_lock);
+    // nothing still on its way into the segment may be published there
+    writes_quiesce();
+    pthread_mutex_unlock(&snapshot_lock);
+
+    pthread_mutex_lock(&log_lock);
+    uint64_t end = sg->size, id = sg->id;
+    compact_from_id = segments[log_active].id;
+    compact_from_off = segments[log_active].size;
+    pthread_mutex_unlock(&log_lock);
+    __atomic_store_n(&compaction.seg_size, end, __ATOMIC_RELAXED);
+    __atomic_store_n(&compaction.seg_done, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&compaction.seg, id, __ATOMIC_RELAXED);
+
+    // reading the segment counts against the rate as much as writing
+    // the copies: a mostly dead segment costs a full scan
+    for (uint64_t off = 0, mark = 0; ok && (off < end || n > 0); ) {
+        if (off < end && n < COMPACT_BATCH && batch < COMPACT_BATCH_BYTES &&
+            off - mark < COMPACT_BATCH_BYTES) {
+            uint64_t at = off;
+            if (!log_record_ok(sg, off, end, &hdr[n])) {
+                off++; // garbage from a failed write
+                continue;
+            }
+            off += sizeof(hdr[n]) + hdr[n].len;
+            int keep;
+            if (hdr[n].flags & RECORD_DISCARDED) {
+                keep = 0;
+            } else if (hdr[n].flags & RECORD_TOMBSTONE) {
+                keep = !drop_tombstones;
+            } else {
+                keep = compact_move(hdr[n].name, seg, at, NULL);
+            }
+            if (keep) {
+                batch += sizeof(hdr[n]) + hdr[n].len;
+                src[n++] = at;
+            }
+            continue;
+        }
+
+        if (n > 0) {
+            int dest = compact_copy(seg, hdr, src, n);
+            if (dest < 0) {
+                ok = 0;
+                break;
+            }
+            if (first < 0) {
+                first = segments[dest].id;
+            }
+            last = segments[dest].id;
+            copied += batch;
+        }
+        mark = off;
+
+        __atomic_store_n(&compaction.seg_done, off, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&compaction.copied, batch, __ATOMIC_RELAXED);
+        n = 0;
+        batch = 0;
+
+        if (compact_rate > 0) {
+            uint64_t due = (off + copied) * 1000000000 / compact_rate;
+            uint64_t spent = now_ns() - start;
+            if (due > spent) {
+                usleep((due - spent) / 1000);
+            }
+        }
+    }
+
+    // the copies must be on disk before the originals go
+    pthread_mutex_lock(&log_lock);
+    int n_slots = n_segments;
+    pthread_mutex_unlock(&log_lock);
+    for (int i = 0; ok && first >= 0 && i < n_slots; i++) {
+        if (segments[i].map && segments[i].id >= first && segments[i].id <= last &&
+            fdatasync(segments[i].fd) < 0) {
+            LOG_ERRNO("Cannot sync segment");
+            ok = 0;
+        }
+    }
+    if (ok) {
+        __atomic_store_n(&sg->retired, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&sg->readers, __ATOMIC_SEQ_CST) > 0) {
+            usleep(100);
+        }
+    }
+
+    pthread_mutex_lock(&snapshot_lock);
+    if (ok) {
+        char filename[64];
+        segment_name(filename, id);
+        unlink(filename);
+        fsync(data_dir_fd);
+    }
+    char *map = sg->map;
+    int fd = sg->fd;
+    pthread_mutex_lock(&log_lock);
+    compact_from_id = -1;
+    if (ok) {
+        sg->map = NULL;
+        sg->fd = -1;
+        sg->size = sg->dead = 0;
+        sg->dirty = 0;
+    }
+    pthread_mutex_unlock(&log_lock);
+    pthread_mutex_unlock(&snapshot_lock);
+    __atomic_store_n(&compaction.seg, -1, __ATOMIC_RELAXED);
+    if (ok) {
+        __atomic_add_fetch(&compaction.segments, 1, __ATOMIC_RELAXED);
+        // what it freed less what its live records take up again
+        __atomic_add_fetch(&compaction.reclaimed, end - copied, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&compaction.ns, now_ns() - start, __ATOMIC_RELAXED);
+        munmap(map, sg->map_len);
+        close(fd);
+        pthread_mutex_lock(&log_lock);
+        free_slots[n_free++] = seg;
+        pthread_mutex_unlock(&log_lock);
+    }
+
+    if (ok) {
+        LOG(LOG_INFO, "Compacted segment %llu: %llu of %llu bytes copied in %.3f sec\n",
+            (unsigned long long)id, (unsigned long long)copied, (unsigned long long)end,
+            (now_ns() - start) / 1e9);
+    }
+    return ok;
+}
+
+void* compact_thread(void *arg) {
+    while (1) {
+        int oldest, seg;
+        while ((seg = compact_pick(&oldest)) >= 0 &&
+               compact_segment(seg, seg == oldest)) {
+        }
+        sleep(1);
+    }
+    return NULL;
+}
+
+char *format_metrics(size_t *len);
+
+/*
+ * Batches. A batch runs in three passes instead of one request per key:
+ * the index work for all its keys, taking each shard lock once; then
+ * the storage work, with all the writes handed to storage together;
+ * then publishing the writes, again one lock per shard. Keys are sorted
+ * by shard so each lock is taken once per pass.
+ *
+ * Items on the same key take effect in batch order: tickets are taken in
+ * that order, a delete beats a write before it even if the key is new,
+ * and a read after a write or delete of its key answers from that item
+ * rather than the table. In per-core mode a batch isn't split up by
+ * owning core: the connection's core runs it all, under the same shard
+ * locks, which is what keeps it ordered and atomic per shard there too.
+ */
+struct batch_item {
+    char op;
+    char status;                /* K or X */
+    char name[32];
+    uint64_t id;                /* v2 */
+    uint64_t h;
+    struct shard *sh;
+    const char *data;           /* W: the value, in the request body */
+    int len;                    /* W: its length; R: length read */
+    char *packed;               /* W: the value compressed, malloc'd */
+    char *value;                /* R: the value read, malloc'd */
+    char *copy;                 /* copy for the cache, taken over by it */
+    struct write_ctx wc;        /* W: the write; R, D: sh and idx only */
+    struct location loc;        /* R, D: version to read or remove */
+    uint32_t version;           /* R */
+    int pending;                /* storage work still to do */
+    int stored;                 /* W: its batch_write, or -1 */
+    struct batch_item *prev;    /* the last W or D of its key before it */
+};
+
+/*
+ * Splits a batch body into items, framed in the connection's protocol.
+ *
+ * Returns the number of items, or -1 if the body is malformed.
+ */
+int batch_parse(int proto, char *body, int len, struct batch_item *items) {
+    int n = 0, pos = 0;
+
+    while (pos < len) {
+        if (n == BATCH_MAX_KEYS) {
+            return -1;
+        }
+        struct batch_item *it = &items[n++];
+        memset(it, 0, sizeof(*it));
+
+        if (proto == 2) {
+            struct request_v2 h;
+            if (len - pos < sizeof(h)) {
+                return -1;
+            }
+            memcpy(&h, body + pos, sizeof(h));
+            pos += sizeof(h);
+            int key_len = le16toh(h.key_len);
+            uint32_t value_len = le32toh(h.value_len);
+            if (h.magic != REQUEST_V2_MAGIC || h.version != REQUEST_V2_VERSION ||
+                key_len > REQUEST_V2_KEY_MAX || key_len > len - pos ||
+                value_len > BUFFER_LENGTH) {
+                return -1;
+            }
+            memcpy(it->name, body + pos, key_len);
+            pos += key_len;
+            it->op = h.op;
+            it->id = le64toh(h.id);
+            it->len = value_len;
+        } else {
+            struct request *rq = (struct request *)(body + pos);
+            if (len - pos < sizeof(*rq)) {
+                return -1;
+            }
+            pos += sizeof(*rq);
+            it->op = rq->op_status;
+            memcpy(it->name, rq->name, sizeof(rq->name));
+            it->len = it->op == 'W' ? request_len(rq) : 0;
+        }
+
+        if (it->op == 'W') {
+            if (it->len < 0 || it->len > BUFFER_LENGTH || it->len > len - pos) {
+                return -1;
+            }
+            it->data = body + pos;
+            pos += it->len;
+        } else if ((it->op != 'R' && it->op != 'D') || it->len != 0) {
+            return -1;
+        }
+        it->h = hash_key(it->name);
+        it->sh = shard_of(it->h);
+        it->status = 'X';
+        it->stored = -1;
+    }
+    return n;
+}
+
+int batch_item_cmp(const void *a, const void *b) {
+    const struct batch_item *x = *(struct batch_item * const *)a;
+    const struct batch_item *y = *(struct batch_item * const *)b;
+    if (x->sh != y->sh) {
+        return x->sh < y->sh ? -1 : 1;
+    }
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * First pass for one item, under its shard lock: what do_write(),
+ * do_read() and do_delete() do before letting go of the lock.
+ */
+void batch_begin_locked(struct batch_item *it) {
+    struct shard *sh = it->sh;
+    // a delete of a value this batch is still writing
+    int unwrite = it->op == 'D' && it->prev && it->prev->op == 'W' &&
+                  it->prev->status == 'K';
+
+    if (it->op == 'W') {
+        if (write_begin_locked(sh, it->name, it->h, &it->wc)) {
+            it->status = 'K';
+            it->pending = 1;
+        }
+        return;
+    }
+    if (it->op == 'R' && it->prev) {
+        return; // answered from it->prev once that is done
+    }
+
+    int idx = find_key_index(sh, it->name, it->h);
+    if (it->op == 'R') {
+        sketch_add(sh, it->h);
+    }
+    if (unwrite && idx >= 0 && ENTRY(sh, idx)->state != STATE_VALID) {
+        // nothing committed to remove: the later ticket sees the write lose
+        ENTRY(sh, idx)->committed = ++sh->last_ticket;
+        it->status = 'K';
+        return;
+    }
+    if (idx < 0 || ENTRY(sh, idx)->state != STATE_VALID) {
+        return;
+    }
+    struct entry *e = ENTRY(sh, idx);
+    if (entry_expired(e) && !unwrite) {
+        if (it->op == 'R') {
+            STAT_ADD(expired_reads, 1);
+        }
+        return;
+    }
+    it->wc.sh = sh;
+    it->wc.idx = idx;
+    it->loc = e->loc;
+
+    if (it->op == 'R') {
+        evict_touch(sh, idx);
+    }
+    if (it->op == 'D') {
+        e->committed = it->wc.ticket = ++sh->last_ticket;
+        clear_value(sh, idx);
+        it->status = 'K';
+        it->pending = 1;
+    } else if (e->value) {
+        it->value = malloc(e->value_len ? e->value_len : 1);
+        if (it->value) {
+            memcpy(it->value, e->value, e->value_len);
+            it->len = e->value_len;
+            it->status = 'K';
+            lru_unlink(sh, idx);
+            lru_push(sh, idx);
+            sh->cache_hits++;
+        }
+    } else if (e->loc.len <= BUFFER_LENGTH) {
+        // bigger values don't go in batches
+        sh->cache_misses++;
+        it->version = e->version;
+        it->pending = 1;
+    }
+}
+
+/*
+ * Last pass for one item, under its shard lock.
+ */
+void batch_finish_locked(struct batch_item *it, struct batch_write *w) {
+    if (it->op == 'W' && it->stored >= 0) {
+        struct batch_write *bw = &w[it->stored];
+        write_publish_locked(&it->wc, bw->ok, &bw->loc, it->copy, bw->len);
+        it->copy = NULL;
+        it->status = bw->ok ? 'K' : 'X';
+    } else if (it->op == 'R' && it->copy) {
+        // keep a copy, unless the value was rewritten or deleted meanwhile
+        struct entry *e = ENTRY(it->sh, it->wc.idx);
+        if (e->version == it->version && e->state == STATE_VALID && !e->value) {
+            cache_insert(it->sh, it->wc.idx, it->copy, it->len);
+            it->copy = NULL;
+        }
+    }
+}
+
+/*
+ * Executes a batch and queues the reply.
+ *
+ * Returns 0 if the connection should be closed.
+ */
+int do_batch(struct conn *c, char *body, int len) {
+    struct batch_item *items = malloc(BATCH_MAX_KEYS * sizeof(*items));
+    struct batch_item **order = malloc(BATCH_MAX_KEYS * sizeof(*order));
+    struct batch_write *w = malloc(BATCH_MAX_KEYS * sizeof(*w));
+    int n = items && order && w ? batch_parse(c->proto, body, len, items) : -1;
+
+    if (n < 0) {
+        if (!items || !order || !w) {
+            LOG_ERRNO("malloc");
+        }
+        free(items);
+        free(order);
+        free(w);
+        STAT_ADD(fails, 1);
+        return conn_reply(c, 'X', -1);
+    }
+
+    for (int i = 0; i < n; i++) {
+        order[i] = &items[i];
+    }
+    qsort(order, n, sizeof(*order), batch_item_cmp);
+
+    // items on one key share a shard, and keep their order within it
+    for (int i = 1; i < n; i++) {
+        for (int j = i - 1; j >= 0 && order[j]->sh == order[i]->sh; j--) {
+            if (order[j]->op != 'R' && order[j]->h == order[i]->h &&
+                strcmp(order[j]->name, order[i]->name) == 0) {
+                order[i]->prev = order[j];
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < n; ) {
+        struct shard *sh = order[i]->sh;
+        shard_lock(sh);
+        for (; i < n && order[i]->sh == sh; i++) {
+            batch_begin_locked(order[i]);
+        }
+        pthread_mutex_unlock(&sh->lock);
+        evict_release();
+    }
+
+    // storage, without locks: the writes all at once
+    uint64_t t = now_ns();
+    int nw = 0;
+    for (int i = 0; i < n; i++) {
+        struct batch_item *it = &items[i];
+        if (it->op == 'W' && it->pending) {
+            struct batch_write *bw = &w[nw];
+            *bw = (struct batch_write){slot_id(it->sh, it->wc.idx), it->name,
+                                       it->wc.ticket, it->data, it->len};
+            int packed = value_compressible(it->len) &&
+                (it->packed = malloc(it->len)) ?
+                value_compress(it->data, it->len, it->packed, &bw->loc.codec) : 0;
+            if (packed > 0) {
+                bw->data = it->packed;
+                bw->len = packed;
+            }
+            it->stored = nw++;
+        }
+    }
+    if (nw > 0) {
+        storage->write_many(w, nw);
+    }
+    for (int i = 0; i < n; i++) {
+        struct batch_item *it = &items[i];
+        uint32_t slot = slot_id(it->sh, it->wc.idx);
+        if (!it->pending) {
+            continue;
+        }
+        if (it->op == 'W' && w[it->stored].ok && cache_limit > 0) {
+            struct batch_write *bw = &w[it->stored];
+            it->copy = malloc(bw->len ? bw->len : 1);
+            if (it->copy) {
+                memcpy(it->copy, bw->data, bw->len);
+            }
+        } else if (it->op == 'R') {
+            it->value = malloc(it->loc.len ? it->loc.len : 1);
+            it->len = it->value ? storage->read(slot, &it->loc, it->value,
+                                                it->loc.len) : -1;
+            if (it->len < 0) {
+                // replaced under us, most likely: do_read() sorts it out
+                free(it->value);
+                it->value = NULL;
+                continue;
+            }
+            it->status = 'K';
+            it->copy = cache_limit > 0 ? malloc(it->len ? it->len : 1) : NULL;
+            if (it->copy) {
+                memcpy(it->copy, it->value, it->len);
+            }
+        } else if (it->op == 'D') {
+            storage->remove(slot, it->name, it->wc.ticket, &it->loc);
+        }
+    }
+    storage_ns += now_ns() - t;
+
+    for (int i = 0; i < n; ) {
+        struct shard *sh = order[i]->sh;
+        shard_lock(sh);
+        for (; i < n && order[i]->sh == sh; i++) {
+            batch_finish_locked(order[i], w);
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+
+    // reply: one header per item, plus the values read
+    int reply_len = 0;
+    for (int i = 0; i < n; i++) {
+        struct batch_item *it = &items[i];
+        if (it->op == 'W') {
+            write_release(&it->wc);
+        } else if (it->op == 'R' && it->prev) {
+            struct batch_item *from = it->prev;
+            if (from->op == 'W' && from->status == 'K' &&
+                (it->value = malloc(from->len ? from->len : 1))) {
+                memcpy(it->value, from->data, from->len);
+                it->len = from->len;
+                it->status = 'K';
+            }
+        } else if (it->op == 'R' && it->status == 'K' && it->loc.codec) {
+            // read as stored, from the cache or storage
+            char *raw = malloc(BUFFER_LENGTH);
+            it->len = raw ? value_expand(it->loc.codec, it->value, it->len, raw,
+                                         BUFFER_LENGTH) : -1;
+            free(it->value);
+            it->value = raw;
+            if (it->len < 0) {
+                it->status = 'X';
+            }
+        } else if (it->op == 'R' && it->pending && it->status == 'X') {
+            char buf[BUFFER_LENGTH];
+            if (do_read(it->name, buf, &it->len, NULL, NULL) &&
+                (it->value = malloc(it->len ? it->len : 1))) {
+                memcpy(it->value, buf, it->len);
+                it->status = 'K';
+            }
+        }
+        free(it->copy);
+        free(it->packed);
+        reply_len += (c->proto == 2 ? sizeof(struct request_v2) + strlen(it->name)
+                                    : sizeof(struct request)) +
+                     (it->op == 'R' && it->status == 'K' ? it->len : 0);
+        STAT_ADD(reads, it->op == 'R');
+        STAT_ADD(writes, it->op == 'W');
+        STAT_ADD(deletes, it->op == 'D');
+        STAT_ADD(fails, it->status == 'X');
+    }
+
+    int reply_at = c->out_len;
+    int keep = conn_reply(c, 'K', reply_len);
+    for (int i = 0; i < n; i++) {
+        struct batch_item *it = &items[i];
+        int has_value = it->op == 'R' && it->status == 'K';
+        if (c->proto == 2) {
+            struct request_v2 h = {
+                .magic = REQUEST_V2_MAGIC,
+                .version = REQUEST_V2_VERSION,
+                .op = it->status,
+                .key_len = htole16(strlen(it->name)),
+                .value_len = htole32(has_value ? it->len : 0),
+                .id = htole64(it->id),
+            };
+            keep = keep && conn_write_bytes(c, &h, sizeof(h)) &&
+                   conn_write_bytes(c, it->name, strlen(it->name));
+        } else {
+            struct request res;
+            memset(&res, 0, sizeof(res));
+            res.op_status = it->status;
+            memcpy(res.name, it->name, sizeof(res.name));
+            if (has_value) {
+                set_request_len(&res, it->len);
+            }
+            keep = keep && conn_write_bytes(c, &res, sizeof(res));
+        }
+        keep = keep && (!has_value || conn_write_bytes(c, it->value, it->len));
+        free(it->value);
+    }
+    if (keep && (c->req_flags & REQUEST_V2_CHECKSUM)) {
+        // the body is all in out by now, behind the header
+        struct request_v2 *h = (struct request_v2 *)(c->out + reply_at);
+        h->crc = htole32(crc32c(0, c->out + reply_at + sizeof(*h), reply_len));
+    }
+
+    LOG(LOG_DEBUG, "Batch of %d keys\nResponse: op=K len=%d\n", n, reply_len);
+    free(items);
+    free(order);
+    free(w);
+    return keep;
+}
+
+/*
+ * When the request about to start at start came in: queue wait runs from
+ * when the frame arrived, or when a thread-pool connection was handed to
+ * the workers.
+ */
+uint64_t request_arrived(struct conn *c, uint64_t start) {
+    uint64_t arrived = c->queued_at ? c->queued_at : c->filled_at;
+    if (arrived == 0 || arrived > start) {
+        arrived = start;
+    }
+    c->queued_at = 0;
+    return arrived;
+}
+
+/*
+ * Checks a request body against the checksum the client sent with it,
+ * if it sent one.
+ */
+int request_crc_ok(struct conn *c, const char *body, int len) {
+    if (!(c->req_flags & REQUEST_V2_CHECKSUM) || crc32c(0, body, len) == c->req_crc) {
+        return 1;
+    }
+    STAT_ADD(request_crc_errors, 1);
+    LOG(LOG_WARN, "Request body of %d bytes doesn't match its checksum\n", len);
+    return 0;
+}
+
+/*
+ * Executes one complete request frame and queues the response. For writes
+ * and batches, body holds the request_len(req) bytes of data, already
+ * checked by the caller against BUFFER_LENGTH or BATCH_MAX_LENGTH.
+ *
+ * Returns 1 if the connection can carry another request, 0 if the stream
+ * can no longer be trusted and should be closed after the response.
+ */
+int process_request(struct conn *c, struct request *req, char *body) {
+    char status;
+    int keep = 1;
+
+    LOG(LOG_DEBUG, "Got request: op=%c name=%.31s len=%.8s\n",
+        req->op_status, req->name, req->len);
+
+    char op = req->op_status;
+    int length = request_len(req);
+
+    uint64_t start = now_ns();
+    uint64_t arrived = request_arrived(c, start);
+    lock_ns = storage_ns = 0;
+    commit_needed = 0;
+
+    if (op == 'W' || op == 'T') {
+        uint64_t ttl = 0;
+        STAT_ADD(writes, 1);
+
+        // write the data to the database; the checksum covers a TTL
+        // prefix too
+        status = 'X';
+        if ((op == 'W' || length >= REQUEST_TTL_LEN) &&
+            request_crc_ok(c, body, length)) {
+            if (op == 'T') {
+                memcpy(&ttl, body, REQUEST_TTL_LEN);
+                ttl = le64toh(ttl);
+                body += REQUEST_TTL_LEN;
+                length -= REQUEST_TTL_LEN;
+            }
+            // any further off and the expiry time could overflow
+            status = ttl <= REQUEST_TTL_MAX &&
+                do_write(req->name, body, length, ttl) ? 'K' : 'X';
+        }
+        STAT_ADD(fails, status == 'X');
+
+        LOG(LOG_DEBUG, "Wrote %d bytes\nResponse: op=%c\n", length, status);
+        keep = conn_reply(c, status, -1);
+    } else if (op == 'R') {
+        STAT_ADD(reads, 1);
+
+        // read the data from the database
+        char buf[BUFFER_LENGTH];
+        struct value_ref ref;
+        status = do_read(req->name, buf, &length, &ref, &c->reply_crc) ? 'K' : 'X';
+        if (!conn_reply(c, status, length)) {
+            if (status == 'K' && ref.len >= 0 && ref.fd >= 0) {
+                close(ref.fd);
+            }
+            keep = 0;
+        } else if (status == 'K') {
+            // send the data to the client only if the operation was successful
+            keep = ref.len >= 0 ? conn_write_ref(c, &ref)
+                                : conn_write_bytes(c, buf, length);
+        }
+        STAT_ADD(fails, status == 'X');
+
+        LOG(LOG_DEBUG, "Read %d bytes\nResponse: op=%c\n", length, status);
+    } else if (op == 'D') {
+        STAT_ADD(deletes, 1);
+
+        // delete the data from the database
+        status = do_delete(req->name) ? 'K' : 'X';
+        STAT_ADD(fails, status == 'X');
+
+        LOG(LOG_DEBUG, "Deleted\nResponse: op=%c\n", status);
+        keep = conn_reply(c, status, -1);
+    } else if (op == 'B') {
+        STAT_ADD(batches, 1);
+        if (request_crc_ok(c, body, length)) {
+            keep = do_batch(c, body, length);
+        } else {
+            STAT_ADD(fails, 1);
+            keep = conn_reply(c, 'X', -1);
+        }
+    } else if (op == 'S') {
+        // metrics dump; not a data op, so it isn't counted or timed
+        size_t len;
+        char *metrics = format_metrics(&len);
+        status = metrics && len < 10000000 ? 'K' : 'X';
+        if (status == 'K' && (c->req_flags & REQUEST_V2_CHECKSUM)) {
+            c->reply_crc = crc32c(0, metrics, len);
+        }
+        keep = conn_reply(c, status, status == 'K' ? (int)len : 0) &&
+               (status != 'K' || conn_write_bytes(c, metrics, len));
+        free(metrics);
+        return keep;
+    } else {
+        // When the operation is invalid, increment the fails counter. We
+        // don't know how long the frame really was, so hang up afterwards.
+        STAT_ADD(fails, 1);
+        conn_reply(c, 'X', -1);
+        LOG(LOG_DEBUG, "Invalid operation\nResponse: op=X\n");
+        return 0;
+    }
+
+    if (commit_needed) {
+        c->commit_ticket = commit_needed;
+    }
+
+    int op_idx = op_index(op);
+    hist_record(op_idx, PHASE_TOTAL, now_ns() - arrived);
+    hist_record(op_idx, PHASE_QUEUE, start - arrived);
+    hist_record(op_idx, PHASE_LOCK, lock_ns);
+    hist_record(op_idx, PHASE_STORAGE, storage_ns);
+    c->last_op = op_idx;
+    return keep;
+}
+
+/*
+ * Answers a frame whose declared body length is out of range. The body
+ * can't be skipped, so the connection is dropped afterwards.
+ */
+int reject_request(struct conn *c) {
+    STAT_ADD(writes, 1);
+    STAT_ADD(fails, 1);
+    conn_reply(c, 'X', -1); // write error
+    return 0;
+}
+
+/*
+ * Turns a v2 header and the key that came with it into c->req and
+ * c->req_id, so the rest of the server only sees one format.
+ *
+ * Returns 0 if the frame is malformed.
+ */
+int request_from_v2(struct conn *c, const struct request_v2 *h, const char *key) {
+    int key_len = le16toh(h->key_len);
+    uint32_t value_len = le32toh(h->value_len);
+
+    c->req_id = le64toh(h->id);
+    c->req_flags = h->flags;
+    c->req_crc = le32toh(h->crc);
+    c->reply_crc = 0;
+    if (h->magic != REQUEST_V2_MAGIC || h->version != REQUEST_V2_VERSION ||
+        key_len > REQUEST_V2_KEY_MAX || value_len > REQUEST_MAX_LEN ||
+        (value_len > 0 && h->op != 'W' && h->op != 'T' && h->op != 'B')) {
+        return 0;
+    }
+    memset(&c->req, 0, sizeof(c->req));
+    c->req.op_status = h->op;
+    memcpy(c->req.name, key, key_len);
+    set_request_len(&c->req, value_len);
+    return 1;
+}
+
+/*
+ * Takes the next request header out of rbuf into c->req, in whichever
+ * protocol the connection speaks.
+ *
+ * Returns 1 if a header was taken, 0 if it isn't all in yet, -1 if it
+ * is malformed.
+ */
+int conn_take_header(struct conn *c) {
+    int avail = c->rlen - c->rpos;
+
+    if (c->proto == 0 && avail > 0) {
+        c->proto = (uint8_t)c->rbuf[c->rpos] == REQUEST_V2_MAGIC ? 2 : 1;
+    }
+    if (c->proto == 1) {
+        if (avail < sizeof(struct request)) {
+            return 0;
+        }
+        memcpy(&c->req, c->rbuf + c->rpos, sizeof(struct request));
+        c->rpos += sizeof(struct request);
+        return 1;
+    }
+
+    struct request_v2 h;
+    if (avail < (int)sizeof(h)) {
+        return 0;
+    }
+    memcpy(&h, c->rbuf + c->rpos, sizeof(h));
+    int key_len = le16toh(h.key_len);
+    if (key_len > REQUEST_V2_KEY_MAX) {
+        c->req_id = le64toh(h.id);
+        return -1;
+    }
+    if (avail < sizeof(h) + key_len) {
+        return 0;
+    }
+    c->rpos += sizeof(h) + key_len;
+    return request_from_v2(c, &h, c->rbuf + c->rpos - key_len) ? 1 : -1;
+}
+
+/*
+ * The same for a blocking connection, reading as much as it takes.
+ *
+ * Returns 1 on success, 0 on clean EOF before any byte, -1 on a short
+ * read or a malformed header.
+ */
+int conn_read_header(struct conn *c) {
+    if (c->proto == 0) {
+        if (c->rpos == c->rlen && !conn_refill(c)) {
+            return 0;
+        }
+        c->proto = (uint8_t)c->rbuf[c->rpos] == REQUEST_V2_MAGIC ? 2 : 1;
+    }
+    if (c->proto == 1) {
+        return conn_read_bytes(c, &c->req, sizeof(c->req));
+    }
+
+    struct request_v2 h;
+    char key[REQUEST_V2_KEY_MAX];
+    int r = conn_read_bytes(c, &h, sizeof(h));
+    if (r <= 0) {
+        return r;
+    }
+    int key_len = le16toh(h.key_len);
+    if (key_len > sizeof(key)) {
+        c->req_id = le64toh(h.id);
+        return -1;
+    }
+    if (key_len > 0 && conn_read_bytes(c, key, key_len) <= 0) {
+        return -1;
+    }
+    return request_from_v2(c, &h, key) ? 1 : -1;
+}
+
+/*
+ * Length of the body that follows a request header, or -1 if it is not
+ * acceptable. Write bodies over BUFFER_LENGTH are streamed; a batch is
+ * buffered whole, and so is a write with a TTL, which can't be streamed.
+ */
+int request_body_length(struct request *req) {
+    int max;
+    if (req->op_status == 'W') {
+        max = MAX_VALUE_LENGTH;
+    } else if (req->op_status == 'T') {
+        max = REQUEST_TTL_LEN + BUFFER_LENGTH;
+    } else if (req->op_status == 'B') {
+        max = BATCH_MAX_LENGTH;
+    } else {
+        return 0;
+    }
+    int length = request_len(req);
+    return (length < 0 || length > max) ? -1 : length;
+}
+
+/*
+ * Makes room in rbuf for a body of len bytes.
+ */
+int conn_reserve(struct conn *c, int len) {
+    if (c->rcap >= len) {
+        return 1;
+    }
+    char *rbuf = realloc(c->rbuf, len);
+    if (!rbuf) {
+        LOG_ERRNO("realloc");
+        return 0;
+    }
+    c->rbuf = rbuf;
+    c->rcap = len;
+    return 1;
+}
+
+/*
+ * A write whose value is too big to buffer. Its body is handed to storage
+ * as it comes off the socket, a receive buffer at a time, so the memory
+ * it takes doesn't grow with the value. The value isn't cached.
+ *
+ * A stream that can't be stored still reads its whole body, so the
+ * client gets an X and the connection stays in step.
+ */
+struct stream {
+    struct write_ctx wc;
+    struct value_writer w;
+    struct location loc;
+    int started;                /* write_begin()s succeeded, ends owed */
+    int ok;                     /* nothing has failed so far */
+    int left;                   /* body bytes still to come */
+    uint64_t arrived, start;
+    uint64_t lock_ns, storage_ns;
+};
+
+/*
+ * Starts streaming the body of the write request in c->req, growing rbuf
+ * to STREAM_CHUNK.
+ *
+ * Returns 0 if out of memory.
+ */
+int stream_begin(struct conn *c) {
+    struct stream *st = calloc(1, sizeof(*st));
+    char *rbuf = st && c->rcap < STREAM_CHUNK ?
+        realloc(c->rbuf, STREAM_CHUNK) : c->rbuf;
+    if (!st || !rbuf) {
+        LOG_ERRNO("malloc");
+        free(st);
+        return 0;
+    }
+    c->rbuf = rbuf;
+    if (c->rcap < STREAM_CHUNK) {
+        c->rcap = STREAM_CHUNK;
+    }
+
+    STAT_ADD(writes, 1);
+    st->start = now_ns();
+    st->arrived = request_arrived(c, st->start);
+    st->left = c->body_len;
+    lock_ns = storage_ns = 0;
+    if (write_begin(c->req.name, &st->wc)) {
+        uint64_t t = now_ns();
+        st->started = storage->write_begin(slot_id(st->wc.sh, st->wc.idx),
+                                           c->req.name, st->wc.ticket,
+                                           c->body_len, &st->loc, &st->w);
+        storage_ns += now_ns() - t;
+        if (!st->started) {
+            write_finish(&st->wc, 0, NULL, NULL, 0);
+        } else {
+            write_suspend(&st->wc); // the body may be a long time coming
+        }
+    }
+    st->ok = st->started;
+    st->lock_ns = lock_ns;
+    st->storage_ns = storage_ns;
+    c->stream = st;
+    return 1;
+}
+
+/*
+ * Finishes a stream and frees it; the write is published if ok.
+ */
+void stream_end(struct conn *c, int ok) {
+    struct stream *st = c->stream;
+
+    lock_ns = storage_ns = 0;
+    commit_needed = 0;
+    if (ok && st->started && (c->req_flags & REQUEST_V2_CHECKSUM) &&
+        st->w.crc != c->req_crc) {
+        STAT_ADD(request_crc_errors, 1);
+        LOG(LOG_WARN, "Streamed value of %d bytes doesn't match its checksum\n",
+            c->body_len);
+        ok = 0;
+    }
+    if (st->started) {
+        write_resume(&st->wc);
+        uint64_t t = now_ns();
+        ok = storage->write_end(&st->w, &st->loc, ok);
+        storage_ns += now_ns() - t;
+        write_finish(&st->wc, ok, &st->loc, NULL, 0);
+    }
+    st->ok = ok;
+    st->lock_ns += lock_ns;
+    st->storage_ns += storage_ns;
+    c->stream = NULL;
+}
+
+/*
+ * Drops a stream whose client went away mid-body.
+ */
+void stream_abort(struct conn *c) {
+    struct stream *st = c->stream;
+    stream_end(c, 0);
+    free(st);
+}
+
+/*
+ * Passes what rbuf holds of the body on to storage. Once the whole body
+ * is in, queues the response.
+ *
+ * Returns 0 if the connection should be closed; c->stream is cleared
+ * once the request is done.
+ */
+int stream_feed(struct conn *c) {
+    struct stream *st = c->stream;
+    int n = c->rlen - c->rpos < st->left ? c->rlen - c->rpos : st->left;
+
+    if (st->ok && n > 0) {
+        uint64_t t = now_ns();
+        st->ok = value_writer_put(&st->w, c->rbuf + c->rpos, n);
+        st->storage_ns += now_ns() - t;
+    }
+    c->rpos += n;
+    st->left -= n;
+    if (st->left > 0) {
+        return 1;
+    }
+
+    stream_end(c, st->ok);
+    if (commit_needed) {
+        c->commit_ticket = commit_needed;
+    }
+
+    STAT_ADD(fails, !st->ok);
+    LOG(LOG_DEBUG, "Streamed %d bytes\nResponse: op=%c\n",
+        c->body_len, st->ok ? 'K' : 'X');
+    int keep = conn_reply(c, st->ok ? 'K' : 'X', -1);
+
+    hist_record(OP_WRITE, PHASE_TOTAL, now_ns() - st->arrived);
+    hist_record(OP_WRITE, PHASE_QUEUE, st->start - st->arrived);
+    hist_record(OP_WRITE, PHASE_LOCK, st->lock_ns);
+    hist_record(OP_WRITE, PHASE_STORAGE, st->storage_ns);
+    c->last_op = OP_WRITE;
+    free(st);
+    return keep;
+}
+
+/*
+ * Handles one request frame from a blocking connection.
+ *
+ * Returns 1 if the connection can carry another request, 0 once the
+ * client has hung up or the stream can no longer be trusted.
+ */
+int handle_work(struct conn *c) {
+    int r = conn_read_header(c);
+    if (r == 0) {
+        return 0; // client closed the connection between requests
+    }
+    if (r < 0) {
+        conn_reply(c, 'X', -1); // write error
+        return 0;
+    }
+
+    int length = request_body_length(&c->req);
+    if (length < 0) {
+        return reject_request(c);
+    }
+
+    if (c->req.op_status == 'W' && length > BUFFER_LENGTH) {
+        c->body_len = length;
+        if (!stream_begin(c)) {
+            return 0;
+        }
+        int keep = 1;
+        while (c->stream) {
+            if (c->rpos == c->rlen && !conn_refill(c)) {
+                stream_abort(c);
+                return 0;
+            }
+            keep = stream_feed(c);
+        }
+        return keep;
+    }
+
+    // read the data from the client
+    char buf[BUFFER_LENGTH];
+    char *body = length > BUFFER_LENGTH ? malloc(length) : buf;
+    if (!body) {
+        LOG_ERRNO("malloc");
+        return reject_request(c);
+    }
+    if (length > 0 && conn_read_bytes(c, body, length) <= 0) {
+        if (body != buf) {
+            free(body);
+        }
+        return reject_request(c);
+    }
+
+    int keep = process_request(c, &c->req, body);
+    if (body != buf) {
+        free(body);
+    }
+    return keep;
+}
+
+void* listener_thread(void *arg) {
+    while (1) {
+        int fd = accept(server_socket, NULL, NULL);
+        if (fd < 0) {
+            LOG_ERRNO("accept");
+            continue;
+        }
+        int one = 1; // replies are flushed explicitly, don't let Nagle hold them
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        LOG(LOG_DEBUG, "Listener thread running...\n");
+        enqueue_work(&work_queue, fd, now_ns());
+    }
+    return NULL;
+}
+
+/*
+ * Serves one connection at a time, for as long as the client keeps it open.
+ */
+void* worker_thread(void *arg) {
+    struct conn c;
+
+    stats_attach();
+    memset(&c, 0, sizeof(c));
+    c.rbuf = malloc(CONN_BUFFER_LENGTH);
+    if (!c.rbuf) {
+        perror("malloc");
+        exit(1);
+    }
+    c.rcap = CONN_BUFFER_LENGTH;
+    while (1) {
+        c.fd = dequeue_work(&work_queue, &c.queued_at);
+        c.rpos = c.rlen = 0;
+        c.proto = c.req_flags = 0;
+        c.last_op = -1;
+        while (handle_work(&c))
+            ;
+        conn_flush(&c);
+        conn_discard(&c);
+        LOG(LOG_DEBUG, "Worker thread running...\n");
+        close(c.fd);
+    }
+    return NULL;
+}
+
+/*
+ * Epoll mode.
+ *
+ * Each event loop thread owns an epoll instance holding the listening
+ * socket (EPOLLEXCLUSIVE, so a new connection wakes a single loop) and the
+ * connections that loop accepted. Client sockets are non-blocking and
+ * edge-triggered: on every wakeup a connection is read until EAGAIN,
+ * parsed frame by frame and written until EAGAIN. Idle connections hold
+ * no buffers, so tens of thousands of them are cheap.
+ */
+
+// per-core mode, below; NULL on threads that aren't core threads
+static __thread struct core *this_core;
+struct core *key_owner(const char *key_name);
+int conn_forward(struct conn *c, struct core *owner, char *body);
+
+void conn_free(struct conn *c) {
+    close(c->fd); // also removes it from the epoll set
+    if (c->stream) {
+        stream_abort(c);
+    }
+    conn_discard(c);
+    free(c->rbuf);
+    free(c->out);
+    free(c);
+}
+
+/*
+ * Executes every complete frame sitting in rbuf, stopping early when too
+ * much output is queued so a client that doesn't read can't make us
+ * buffer without bound.
+ *
+ * Returns the number of frames executed.
+ */
+int conn_parse(struct conn *c) {
+    int frames = 0;
+
+    // v2 replies needn't keep request order, so v2 frames that don't need
+    // another core go on while one that does is away
+    while (!c->closing && (!c->remote || c->proto == 2) &&
+           c->out_len - c->out_pos + c->ref_bytes < OUT_HIGH_WATER) {
+        int avail = c->rlen - c->rpos;
+
+        if (c->state == CONN_HEADER) {
+            int r = conn_take_header(c);
+            if (r == 0) {
+                break;
+            }
+            c->body_len = r > 0 ? request_body_length(&c->req) : -1;
+            if (c->body_len < 0) {
+                c->closing = !reject_request(c);
+                frames++;
+                break;
+            }
+            if ((c->req.op_status == 'B' || c->req.op_status == 'T') &&
+                c->rpos + c->body_len > c->rcap &&
+                !conn_reserve(c, c->rpos + c->body_len)) {
+                c->closing = 1;
+                break;
+            }
+            if (c->req.op_status == 'W' && c->body_len > BUFFER_LENGTH) {
+                // run here whichever core owns the key: forwarding would
+                // mean buffering the whole value
+                if (!stream_begin(c)) {
+                    c->closing = 1;
+                    break;
+                }
+                c->state = CONN_STREAM;
+                continue;
+            }
+            c->state = CONN_BODY;
+        } else if (c->state == CONN_STREAM) {
+            if (avail == 0) {
+                break;
+            }
+            int keep = stream_feed(c);
+            if (!c->stream) {
+                c->closing = !keep;
+                c->state = CONN_HEADER;
+                frames++;
+            }
+        } else {
+            if (avail < c->body_len) {
+                break;
+            }
+            char op = c->req.op_status;
+            struct core *owner = this_core &&
+                (op == 'W' || op == 'T' || op == 'R' || op == 'D') ?
+                key_owner(c->req.name) : this_core;
+            if (owner != this_core && c->remote) {
+                break; // one away at a time
+            }
+            if (owner != this_core) {
+                c->closing = !conn_forward(c, owner, c->rbuf + c->rpos);
+            } else {
+                c->closing = !process_request(c, &c->req, c->rbuf + c->rpos);
+            }
+            c->rpos += c->body_len;
+            c->state = CONN_HEADER;
+            frames++;
+        }
+    }
+    return frames;
+}
+
+/*
+ * Reads what the socket has, up to the free space in rbuf.
+ *
+ * Returns 1 if bytes arrived, 0 if there was nothing to read, -1 on error.
+ */
+int conn_fill(struct conn *c) {
+    if (c->eof) {
+        return 0;
+    }
+    if (!c->rbuf) {
+        c->rcap = c->stream ? STREAM_CHUNK : CONN_BUFFER_LENGTH;
+        if (c->state == CONN_BODY && c->rcap < c->body_len) {
+            c->rcap = c->body_len; // a batch waiting for the rest of its body
+        }
+        c->rbuf = malloc(c->rcap);
+        if (!c->rbuf) {
+            LOG_ERRNO("malloc");
+            return -1;
+        }
+        c->rpos = c->rlen = 0;
+    } else if (c->rpos > 0) {
+        memmove(c->rbuf, c->rbuf + c->rpos, c->rlen - c->rpos);
+        c->rlen -= c->rpos;
+        c->rpos = 0;
+    }
+    if (c->rlen == c->rcap) {
+        return 0; // a whole frame is already waiting to be parsed
+    }
+
+    int n = read(c->fd, c->rbuf + c->rlen, c->rcap - c->rlen);
+    if (n > 0) {
+        c->rlen += n;
+        c->filled_at = now_ns();
+        return 1;
+    }
+    if (n == 0) {
+        c->eof = 1;
+        return 0;
+    }
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+}
+
+/*
+ * Closes a connection, or leaves that to core_drain() if another core is
+ * still running one of its requests, or to commit_drain() if it is held.
+ */
+void conn_close(struct conn *c) {
+    if (c->remote || c->held) {
+        c->orphaned = 1;
+    } else {
+        conn_free(c);
+    }
+}
+
+/*
+ * Parks a connection on this loop's commit_loop list if its replies are
+ * waiting for a group commit.
+ *
+ * Returns 1 if it was parked.
+ */
+int commit_hold(struct conn *c) {
+    if (c->commit_ticket <= __atomic_load_n(&commit_synced, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    if (!c->held) {
+        c->held = 1;
+        c->held_next = my_commit_loop->held;
+        my_commit_loop->held = c;
+    }
+    return 1;
+}
+
+void serve_conn(struct conn *c);
+
+/*
+ * Resumes the connections a finished group commit has released.
+ */
+void commit_drain(struct commit_loop *l) {
+    uint64_t count;
+    read(l->efd, &count, sizeof(count));
+
+    uint64_t synced = __atomic_load_n(&commit_synced, __ATOMIC_ACQUIRE);
+    struct conn **p = &l->held;
+    while (*p) {
+        struct conn *c = *p;
+        if (c->commit_ticket > synced) {
+            p = &c->held_next;
+            continue;
+        }
+        *p = c->held_next;
+        c->held = 0;
+        if (c->orphaned) {
+            conn_close(c);
+        } else {
+            serve_conn(c); // may park it again, at the head
+        }
+    }
+}
+
+/*
+ * Drives a connection as far as it can go without blocking.
+ */
+void serve_conn(struct conn *c) {
+    if (c->orphaned) {
+        return;
+    }
+    while (1) {
+        int got = conn_fill(c);
+        if (got < 0) {
+            conn_close(c);
+            return;
+        }
+        int frames = conn_parse(c);
+        // parsing may have stopped at OUT_HIGH_WATER: once this goes out,
+        // look again
+        int flushed = c->out_len - c->out_pos + c->ref_bytes > 0;
+        if (commit_hold(c)) {
+            return; // commit_drain() will bring us back
+        }
+        int sent = conn_send(c);
+        if (sent < 0) {
+            conn_close(c);
+            return;
+        }
+        if (sent == 0) {
+            return; // EPOLLOUT will bring us back
+        }
+        if (c->remote) {
+            return; // core_drain() will bring us back
+        }
+        if (c->closing || (c->eof && frames == 0)) {
+            conn_close(c);
+            return;
+        }
+        if (!got && !frames && !flushed) {
+            break;
+        }
+    }
+
+    // nothing buffered between requests: give the memory back
+    if (c->rbuf && c->rpos == c->rlen) {
+        free(c->rbuf);
+        c->rbuf = NULL;
+    }
+}
+
+/*
+ * Accepts every pending connection into this loop's epoll set.
+ */
+void accept_conns(int ep, int listen_fd) {
+    while (1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_ERRNO("accept");
+            }
+            return;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct conn *c = calloc(1, sizeof(*c));
+        if (!c) {
+            LOG_ERRNO("calloc");
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->last_op = -1;
+
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = c
+        };
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            LOG_ERRNO("epoll_ctl");
+            conn_free(c);
+        }
+    }
+}
+
+void* event_loop_thread(void *arg) {
+    stats_attach();
+
+    int ep = epoll_create1(0);
+    if (ep < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLEXCLUSIVE,
+        .data.ptr = NULL
+    };
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, server_socket, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+
+    struct commit_loop *commits = commit_attach(ep);
+
+    struct epoll_event events[64];
+    while (1) {
+        int n = epoll_wait(ep, events, 64, -1);
+        if (n < 0) {
+            if (errno != EINTR) {
+                LOG_ERRNO("epoll_wait");
+            }
+            continue;
+        }
+        int resume = 0;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_conns(ep, server_socket);
+            } else if (events[i].data.ptr == commits) {
+                resume = 1;
+            } else {
+                serve_conn(events[i].data.ptr);
+            }
+        }
+        // last, since it may free connections with events still in the batch
+        if (resume) {
+            commit_drain(commits);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Opens a listening socket on port. With reuseport, several sockets can
+ * be bound to the same port and the kernel spreads new connections
+ * across them.
+ *
+ * Returns the socket, or -1 on failure.
+ */
+int open_listener(int port, int reuseport) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    int one = 1;
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("SO_REUSEPORT");
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in server_address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = 0
+    };
+
+    // bind the socket to the address
+    if (bind(fd, (struct sockaddr*)&server_address, sizeof(server_address)) < 0) {
+        perror("Cannot bind");
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, SOMAXCONN) < 0) {
+        perror("Cannot listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Per-core mode.
+ *
+ * Each core thread has its own SO_REUSEPORT listening socket, its own
+ * epoll instance and the connections it accepted, and it owns the shards
+ * whose number is congruent to its id. A request for a key in another
+ * core's shards is handed to that core through its inbox; the owner runs
+ * it and hands the response back through the inbox of the connection's
+ * core. On that common path, reads, writes with or without a TTL and
+ * deletes, shard locks are only taken by the owning core, so they don't
+ * bounce between CPUs. The exceptions still take the locks, just from
+ * another CPU: a write too big to buffer, which the connection's core
+ * streams itself; a batch, whose keys belong to any number of cores and
+ * which the connection's core runs whole (see do_batch()); the stats
+ * command; and the expiry, snapshot and compaction threads.
+ *
+ * Inboxes are lock-free stacks: senders push with a compare-and-swap and
+ * the owner takes the whole stack at once. The sender that finds an
+ * inbox empty kicks the owner's eventfd. A legacy connection waiting
+ * for a remote response stops parsing until it arrives, so replies keep
+ * the order of the requests; a v2 connection only stops at the next
+ * frame for another core, and its local replies may overtake the remote
+ * one.
+ */
+struct remote_op {
+    struct remote_op *next;
+    struct conn *c;             // on the origin core
+    int origin;
+    int done;                   // response is in out
+    int keep;                   // process_request() kept the stream
+    struct request req;
+    struct conn out;            // response, built by the owner
+    char body[];
+};
+
+struct core {
+    int id;
+    int listen_fd;
+    int ep;
+    int efd;
+    struct remote_op *inbox __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+#define PIN_NONE  0
+#define PIN_CORES 1
+
+static struct core *cores;
+static int n_cores;
+static int pin_policy = PIN_NONE;
+
+/*
+ * The core owning a key's shard.
+ */
+struct core *key_owner(const char *key_name) {
+    return &cores[shard_of(hash_key(key_name))->num % n_cores];
+}
+
+void core_post(struct core *core, struct remote_op *op) {
+    op->next = __atomic_load_n(&core->inbox, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&core->inbox, &op->next, op, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    if (op->next == NULL) {
+        uint64_t one = 1;
+        write(core->efd, &one, sizeof(one));
+    }
+}
+
+/*
+ * Hands the frame in c->req and body to the core owning its key.
+ *
+ * Returns 0 if it couldn't be sent, in which case the connection should
+ * be dropped.
+ */
+int conn_forward(struct conn *c, struct core *owner, char *body) {
+    struct remote_op *op = calloc(1, sizeof(*op) + c->body_len);
+    if (!op) {
+        LOG_ERRNO("calloc");
+        return 0;
+    }
+    op->c = c;
+    op->origin = this_core->id;
+    op->req = c->req;
+    op->out.filled_at = c->filled_at;
+    op->out.proto = c->proto;
+    op->out.req_id = c->req_id;
+    op->out.req_flags = c->req_flags;
+    op->out.req_crc = c->req_crc;
+    memcpy(op->body, body, c->body_len);
+    c->remote = op;
+    core_post(owner, op);
+    return 1;
+}
 
 /*
- * Enqueues a new work item to the work queue.
+ * Appends a response built on another core to a connection's output,
+ * taking over its refs.
  */
-void enqueue_work(int fd) {
+int conn_splice(struct conn *c, struct conn *from) {
+    int base = c->out_len;
 
-    pthread_mutex_lock(&q_lock);
-
-    struct work_item *item = malloc(sizeof(*item));
-    if (!item) {
-        perror("malloc");
-        exit(1);
+    if (from->commit_ticket > c->commit_ticket) {
+        c->commit_ticket = from->commit_ticket;
     }
-    item->fd = fd;
-    item->next   = NULL;
+    if (from->out_len > 0 && !conn_write_bytes(c, from->out, from->out_len)) {
+        conn_discard(from);
+        free(from->out);
+        return 0;
+    }
+    for (struct out_ref *r = from->refs; r; r = r->next) {
+        r->mark += base;
+    }
+    if (from->refs) {
+        if (c->refs_tail) {
+            c->refs_tail->next = from->refs;
+        } else {
+            c->refs = from->refs;
+        }
+        c->refs_tail = from->refs_tail;
+        c->ref_bytes += from->ref_bytes;
+    }
+    free(from->out);
+    return 1;
+}
 
-    if (work_queue.tail) {
-        work_queue.tail->next = item;
-        work_queue.tail = item;
-    } else {
-        work_queue.head = item;
-        work_queue.tail = item;
+/*
+ * Runs requests sent to this core and delivers responses coming back.
+ */
+void core_drain(struct core *core) {
+    uint64_t count;
+    read(core->efd, &count, sizeof(count));
+
+    struct remote_op *list = __atomic_exchange_n(&core->inbox, NULL, __ATOMIC_ACQUIRE);
+    struct remote_op *fifo = NULL;
+    while (list) {
+        struct remote_op *op = list;
+        list = op->next;
+        op->next = fifo;
+        fifo = op;
     }
 
-    printf("Enqueue work: %d\n", fd);
+    while (fifo) {
+        struct remote_op *op = fifo;
+        fifo = op->next;
+
+        if (!op->done) {
+            op->keep = process_request(&op->out, &op->req, op->body);
+            op->done = 1;
+            core_post(&cores[op->origin], op);
+            continue;
+        }
 
-    pthread_cond_signal(&q_cond);
-    pthread_mutex_unlock(&q_lock);
+        struct conn *c = op->c;
+        c->remote = NULL;
+        if (!conn_splice(c, &op->out) || !op->keep) {
+            c->closing = 1;
+        }
+        free(op);
+        if (c->orphaned) {
+            conn_close(c);
+        } else {
+            serve_conn(c);
+        }
+    }
 }
 
 /*
- * Dequeues a work item from the work queue.
+ * Pins the calling thread according to pin_policy.
  */
-int dequeue_work(void) {
-    pthread_mutex_lock(&q_lock);
-
-    while (work_queue.head == NULL) {
-        pthread_cond_wait(&q_cond, &q_lock);
+void core_pin(int id) {
+    if (pin_policy == PIN_NONE) {
+        return;
     }
-
-    struct work_item *item = work_queue.head;
-    work_queue.head = item->next;
-    if (work_queue.head == NULL) {
-        work_queue.tail = NULL;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(id % sysconf(_SC_NPROCESSORS_ONLN), &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err) {
+        LOG(LOG_WARN, "Cannot pin core %d: %s\n", id, strerror(err));
     }
+}
 
-    printf("Dequeue work: %d\n", item->fd);
+void* core_thread(void *arg) {
+    struct core *core = arg;
 
-    int fd = item->fd;
-    free(item);
+    this_core = core;
+    core_pin(core->id);
+    stats_attach();
+    struct commit_loop *commits = commit_attach(core->ep);
 
-    pthread_mutex_unlock(&q_lock);
-    return fd;
+    struct epoll_event events[64];
+    while (1) {
+        int n = epoll_wait(core->ep, events, 64, -1);
+        if (n < 0) {
+            if (errno != EINTR) {
+                LOG_ERRNO("epoll_wait");
+            }
+            continue;
+        }
+        int drain = 0, resume = 0;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_conns(core->ep, core->listen_fd);
+            } else if (events[i].data.ptr == core) {
+                drain = 1;
+            } else if (events[i].data.ptr == commits) {
+                resume = 1;
+            } else {
+                serve_conn(events[i].data.ptr);
+            }
+        }
+        // last, since they may free connections with events still in the batch
+        if (drain) {
+            core_drain(core);
+        }
+        if (resume) {
+            commit_drain(commits);
+        }
+    }
+    return NULL;
 }
 
 /*
- * Reads a fixed number of bytes from a file descriptor.
+ * Starts the core threads. Everything they share is set up before any
+ * of them runs: a core may hear from the others as soon as it accepts
+ * its first connection, and a bind failure is reported at startup.
  */
-int read_bytes(int fd, void *buf, int count) {
-    int n;
-    int bytes_read = 0;
-    while (bytes_read < count) {
-        n = read(fd, buf + bytes_read, count - bytes_read);
-        if (n <= 0) {
-            return 0;
+void start_cores(int port) {
+    cores = aligned_alloc(64, n_cores * sizeof(struct core));
+    memset(cores, 0, n_cores * sizeof(struct core));
+    for (int i = 0; i < n_cores; i++) {
+        struct core *core = &cores[i];
+        core->id = i;
+        core->listen_fd = open_listener(port, 1);
+        if (core->listen_fd < 0) {
+            exit(1);
+        }
+        fcntl(core->listen_fd, F_SETFL, O_NONBLOCK);
+
+        core->ep = epoll_create1(0);
+        core->efd = eventfd(0, EFD_NONBLOCK);
+        if (core->ep < 0 || core->efd < 0) {
+            perror("epoll_create1/eventfd");
+            exit(1);
+        }
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+        if (epoll_ctl(core->ep, EPOLL_CTL_ADD, core->listen_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+        ev.data.ptr = core;
+        if (epoll_ctl(core->ep, EPOLL_CTL_ADD, core->efd, &ev) < 0) {
+            perror("epoll_ctl");
+            exit(1);
         }
-        bytes_read += n;
     }
-    return 1;
+    for (int i = 0; i < n_cores; i++) {
+        pthread_t t;
+        pthread_create(&t, NULL, core_thread, &cores[i]);
+    }
 }
 
 /*
- * Writes a fixed number of bytes to a file descriptor.
+ * Upper bound of the bucket holding the sample at fraction p of a
+ * histogram, in nanoseconds.
  */
-int write_bytes(int fd, void *buf, int count) {
-    int n;
-    int bytes_written = 0;
-    while (bytes_written < count) {
-        n = write(fd, buf + bytes_written, count - bytes_written);
-        if (n <= 0) {
-            return 0;
+uint64_t hist_percentile(const uint64_t *hist, uint64_t count, double p) {
+    uint64_t want = count * p, seen = 0;
+
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > want) {
+            return hist_bound(b);
         }
-        bytes_written += n;
     }
-    return 1;
+    return hist_bound(HIST_BUCKETS - 1);
 }
 
-int find_key_index(const char *key_name);
-int find_free_slot(void);
+void print_latencies(struct thread_stats *total) {
+    static const char ops[N_OPS] = {'R', 'W', 'D', 'B'};
+    static const char *phases[N_PHASES] = {
+        "total", "queue wait", "lock wait", "storage", "socket write"
+    };
 
-int write_to_file(const char *filename, const char *data, int len, int idx);
-int read_from_file(const char *filename, char *buf, int len, int idx);
+    for (int op = 0; op < N_OPS; op++) {
+        for (int ph = 0; ph < N_PHASES; ph++) {
+            uint64_t *hist = total->hist[op][ph];
+            uint64_t count = 0;
+            for (int b = 0; b < HIST_BUCKETS; b++) {
+                count += hist[b];
+            }
+            if (count == 0) {
+                continue;
+            }
+            printf("latency %c %s: n=%llu p50=%.1fus p90=%.1fus p99=%.1fus p99.9=%.1fus\n",
+                   ops[op], phases[ph], (unsigned long long)count,
+                   hist_percentile(hist, count, 0.5) / 1e3,
+                   hist_percentile(hist, count, 0.9) / 1e3,
+                   hist_percentile(hist, count, 0.99) / 1e3,
+                   hist_percentile(hist, count, 0.999) / 1e3);
+        }
+    }
+}
 
 /*
- * Writes data to the database and stores it in a file.
+ * Everything the stats command and the metrics op report, collected in
+ * one pass.
  */
-int do_write(const char *key_name, const char *data, int len) {
+struct stats_snapshot {
+    struct thread_stats total;
+    int table_size, table_slots, queue_size, nseg;
+    size_t memory, cached;
+    uint64_t hits, misses, evictions;
+    int timers;
+    size_t key_bytes;
+    uint64_t key_evictions, evicted_bytes, admit_rejects;
+    uint64_t log_bytes, log_dead;
+    uint64_t commits, committed, commit_ns;
+    uint64_t snapshots, snapshot_ns;
+    uint64_t log_appended;
+    long long compact_seg;
+    uint64_t compact_size, compact_done, compacted, compact_copied,
+             compact_reclaimed, compact_ns;
+};
 
-    pthread_mutex_lock(&db_lock);
+void gather_stats(struct stats_snapshot *st) {
+    memset(st, 0, sizeof(*st));
+    for (int i = 0; i < n_shards; i++) {
+        struct shard *sh = &shards[i];
+        pthread_mutex_lock(&sh->lock);
+        st->table_size += sh->cur.used + (sh->old.buckets ? sh->old.used : 0);
+        st->table_slots += sh->n_chunks * CHUNK_KEYS;
+        st->memory += sh->mem_used;
+        st->cached += sh->cache_bytes;
+        st->hits += sh->cache_hits;
+        st->misses += sh->cache_misses;
+        st->evictions += sh->cache_evictions;
+        st->timers += sh->timers;
+        st->key_bytes += sh->key_bytes;
+        st->key_evictions += sh->key_evictions;
+        st->evicted_bytes += sh->evicted_bytes;
+        st->admit_rejects += sh->admit_rejects;
+        pthread_mutex_unlock(&sh->lock);
+    }
 
-    int idx = find_key_index(key_name);
+    st->queue_size = work_queue_depth(&work_queue);
 
-    // if the key does not exist, find a free slot
-    if (idx < 0) {
-        idx = find_free_slot();
-        if (idx < 0) {
-            pthread_mutex_unlock(&db_lock);
-            return 0;
-        }
-        strncpy(table[idx].name, key_name, sizeof(table[idx].name) - 1);
-        table[idx].name[sizeof(table[idx].name) - 1] = '\0';
-        table[idx].state = STATE_BUSY;
-    } else {
-        // if the key exists, check if it is busy
-        if (table[idx].state == STATE_BUSY) {
-            pthread_mutex_unlock(&db_lock);
-            return 0;
+    pthread_mutex_lock(&all_stats_lock);
+    for (struct thread_stats *ts = all_stats; ts; ts = ts->next) {
+        uint64_t *from = (uint64_t *)ts, *to = (uint64_t *)&st->total;
+        // every field before next is a counter
+        for (int i = 0; i < offsetof(struct thread_stats, next) / sizeof(uint64_t); i++) {
+            to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
         }
-        table[idx].state = STATE_BUSY;
     }
+    pthread_mutex_unlock(&all_stats_lock);
 
-    pthread_mutex_unlock(&db_lock);
+    pthread_mutex_lock(&log_lock);
+    for (int i = 0; i < n_segments; i++) {
+        st->log_bytes += segments[i].size;
+        st->log_dead += segments[i].dead;
+    }
+    st->nseg = n_segments - n_free;
+    st->log_appended = log_appended;
+    pthread_mutex_unlock(&log_lock);
+    st->compact_seg = __atomic_load_n(&compaction.seg, __ATOMIC_RELAXED);
+    st->compact_size = __atomic_load_n(&compaction.seg_size, __ATOMIC_RELAXED);
+    st->compact_done = __atomic_load_n(&compaction.seg_done, __ATOMIC_RELAXED);
+    st->compacted = __atomic_load_n(&compaction.segments, __ATOMIC_RELAXED);
+    st->compact_copied = __atomic_load_n(&compaction.copied, __ATOMIC_RELAXED);
+    st->compact_reclaimed = __atomic_load_n(&compaction.reclaimed, __ATOMIC_RELAXED);
+    st->compact_ns = __atomic_load_n(&compaction.ns, __ATOMIC_RELAXED);
 
-    char filename[64];
-    sprintf(filename, "/tmp/data.%d", idx);
-    if (!write_to_file(filename, data, len, idx)) {
-        return 0;
+    pthread_mutex_lock(&commit_lock);
+    st->commits = commit_syncs;
+    st->committed = commit_synced;
+    st->commit_ns = commit_sync_ns;
+    pthread_mutex_unlock(&commit_lock);
+
+    st->snapshots = __atomic_load_n(&snapshots, __ATOMIC_RELAXED);
+    st->snapshot_ns = __atomic_load_n(&snapshot_ns, __ATOMIC_RELAXED);
+}
+
+void print_stats() {
+    struct stats_snapshot *st = malloc(sizeof(*st));
+    if (!st) {
+        perror("malloc");
+        return;
     }
+    gather_stats(st);
 
-    // update the state of the key, lock the database
-    pthread_mutex_lock(&db_lock);
-    table[idx].state = STATE_VALID;
-    pthread_mutex_unlock(&db_lock);
-    return 1;
+    printf("Stats:\nwrites=%llu\nreads=%llu\ndeletes=%llu\nfails=%llu\ncurrent table size=%d\ncurrent queue size=%d\n",
+           (unsigned long long)st->total.writes, (unsigned long long)st->total.reads,
+           (unsigned long long)st->total.deletes, (unsigned long long)st->total.fails,
+           st->table_size, st->queue_size);
+    printf("shards=%d\ntable slots=%d\ntable memory=%zu\nmemory limit=%zu\n",
+           n_shards, st->table_slots, st->memory, mem_limit);
+    printf("storage=%s\nsegments=%d\nlog bytes=%llu\nlog dead bytes=%llu\n",
+           storage->name, st->nseg, (unsigned long long)st->log_bytes,
+           (unsigned long long)st->log_dead);
+    printf("uring submit calls=%llu\nuring sqes=%llu\n",
+           (unsigned long long)__atomic_load_n(&uring_submit_calls, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&uring_submitted, __ATOMIC_RELAXED));
+    static const char *durabilities[] = {"none", "group", "sync"};
+    printf("durability=%s\ngroup commits=%llu\ngroup committed writes=%llu\n",
+           durabilities[durability], (unsigned long long)st->commits,
+           (unsigned long long)st->committed);
+    if (st->commits > 0) {
+        printf("writes per group commit=%.1f\ngroup commit sync time=%.1f us avg\n",
+               (double)st->committed / st->commits,
+               st->commit_ns / 1000.0 / st->commits);
+    }
+    if (storage == &log_storage) {
+        printf("recovered keys=%llu (%llu from snapshot)\nrecovery time=%.3f sec\n"
+               "replayed records=%llu\nreplayed bytes=%llu\nsnapshots=%llu\n",
+               (unsigned long long)recovery.keys,
+               (unsigned long long)recovery.snapshot_keys, recovery.ns / 1e9,
+               (unsigned long long)recovery.records,
+               (unsigned long long)recovery.bytes, (unsigned long long)st->snapshots);
+        if (st->snapshots > 0) {
+            printf("snapshot time=%.3f sec avg\n", st->snapshot_ns / 1e9 / st->snapshots);
+        }
+        if (st->compact_seg >= 0) {
+            printf("compacting segment %lld: %.0f%%\n", st->compact_seg,
+                   st->compact_size ? 100.0 * st->compact_done / st->compact_size : 100.0);
+        }
+        // bytes the log took per byte requests wrote
+        uint64_t user = st->log_appended - st->compact_copied;
+        printf("segments compacted=%llu\ncompaction bytes copied=%llu\n"
+               "compaction bytes reclaimed=%llu\ncompaction time=%.3f sec\n"
+               "write amplification=%.2f\n",
+               (unsigned long long)st->compacted, (unsigned long long)st->compact_copied,
+               (unsigned long long)st->compact_reclaimed, st->compact_ns / 1e9,
+               user ? (double)st->log_appended / user : 1.0);
+    }
+    struct thread_stats *t = &st->total;
+    printf("compression=%s\nvalues compressed=%llu of %llu tried\n",
+           codec_names[compress_codec], (unsigned long long)t->compress_kept,
+           (unsigned long long)t->compress_tried);
+    if (t->compress_tried > 0) {
+        // over every value tried, the ones stored as they were included
+        printf("compression ratio=%.2f\ncompression bytes saved=%llu\n"
+               "compress time=%.2f us avg (%.0f MB/s)\n",
+               t->compress_out ? (double)t->compress_in / t->compress_out : 1.0,
+               (unsigned long long)(t->compress_in - t->compress_out),
+               t->compress_ns / 1000.0 / t->compress_tried,
+               t->compress_ns ? t->compress_in * 1000.0 / t->compress_ns : 0.0);
+    }
+    if (t->expanded > 0) {
+        printf("values expanded=%llu\nexpand time=%.2f us avg\n",
+               (unsigned long long)t->expanded, t->expand_ns / 1000.0 / t->expanded);
+    }
+    printf("keys with a TTL=%d\nTTL writes=%llu\nkeys expired=%llu\n"
+           "reads of expired keys=%llu\n",
+           st->timers, (unsigned long long)t->ttl_writes,
+           (unsigned long long)t->expired, (unsigned long long)t->expired_reads);
+    printf("batches=%llu\n", (unsigned long long)st->total.batches);
+    printf("zero-copy reads=%llu\n", (unsigned long long)st->total.zero_copy);
+    printf("checksum errors=%llu (storage), %llu (requests)\n",
+           (unsigned long long)st->total.storage_crc_errors,
+           (unsigned long long)st->total.request_crc_errors);
+    printf("cache hits=%llu\ncache misses=%llu\ncache evictions=%llu\n"
+           "cache bytes=%zu\ncache limit=%zu\n",
+           (unsigned long long)st->hits, (unsigned long long)st->misses,
+           (unsigned long long)st->evictions, st->cached, cache_limit);
+    static const char *policies[] = {"none", "lru", "clock"};
+    printf("eviction=%s%s\nkey bytes=%zu\neviction budget=%zu\n"
+           "keys evicted=%llu\nevicted bytes=%llu\nkeys refused admission=%llu\n",
+           policies[evict_policy], evict_admission ? " + tinylfu" : "",
+           st->key_bytes, evict_budget, (unsigned long long)st->key_evictions,
+           (unsigned long long)st->evicted_bytes, (unsigned long long)st->admit_rejects);
+    print_latencies(&st->total);
+    fflush(stdout);
+    free(st);
 }
 
 /*
- * Reads data from the database.
+ * The same numbers for machines, in the Prometheus text format: one
+ * "name{labels} value" sample per line. Latency histograms are given as
+ * cumulative buckets (only the non-empty ones, upper bounds in
+ * nanoseconds) plus precomputed quantiles.
+ *
+ * Returns a malloc'd buffer, or NULL.
  */
-int do_read(char *key_name, char *buf, int *length) {
-
-    pthread_mutex_lock(&db_lock);
+char *format_metrics(size_t *len) {
+    static const char ops[N_OPS] = {'R', 'W', 'D', 'B'};
+    static const char *phases[N_PHASES] = {
+        "total", "queue", "lock", "storage", "write"
+    };
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    char *buf = NULL;
+    FILE *f = open_memstream(&buf, len);
+    struct stats_snapshot *st = malloc(sizeof(*st));
 
-    int idx = find_key_index(key_name);
-    if (idx < 0 || table[idx].state != STATE_VALID) {
-        pthread_mutex_unlock(&db_lock);
-        return 0;
+    if (!f || !st) {
+        LOG_ERRNO("metrics");
+        if (f) {
+            fclose(f);
+            free(buf);
+        }
+        free(st);
+        return NULL;
     }
+    gather_stats(st);
 
-    pthread_mutex_unlock(&db_lock);
-
-    char filename[64];
-    sprintf(filename, "/tmp/data.%d", idx);
+    fprintf(f, "db_requests_total{op=\"R\"} %llu\n", (unsigned long long)st->total.reads);
+    fprintf(f, "db_requests_total{op=\"W\"} %llu\n", (unsigned long long)st->total.writes);
+    fprintf(f, "db_requests_total{op=\"D\"} %llu\n", (unsigned long long)st->total.deletes);
+    fprintf(f, "db_requests_total{op=\"B\"} %llu\n", (unsigned long long)st->total.batches);
+    fprintf(f, "db_failures_total %llu\n", (unsigned long long)st->total.fails);
+    fprintf(f, "db_zero_copy_reads_total %llu\n", (unsigned long long)st->total.zero_copy);
+    fprintf(f, "db_uring_submit_calls_total %llu\n",
+            (unsigned long long)__atomic_load_n(&uring_submit_calls, __ATOMIC_RELAXED));
+    fprintf(f, "db_uring_sqes_total %llu\n",
+            (unsigned long long)__atomic_load_n(&uring_submitted, __ATOMIC_RELAXED));
+    fprintf(f, "db_group_commits_total %llu\n", (unsigned long long)st->commits);
+    fprintf(f, "db_group_committed_writes_total %llu\n", (unsigned long long)st->committed);
+    fprintf(f, "db_group_commit_sync_ns_total %llu\n", (unsigned long long)st->commit_ns);
+    fprintf(f, "db_recovery_seconds %.6f\n", recovery.ns / 1e9);
+    fprintf(f, "db_recovered_keys %llu\n", (unsigned long long)recovery.keys);
+    fprintf(f, "db_recovered_snapshot_keys %llu\n", (unsigned long long)recovery.snapshot_keys);
+    fprintf(f, "db_recovery_replayed_records %llu\n", (unsigned long long)recovery.records);
+    fprintf(f, "db_recovery_replayed_bytes %llu\n", (unsigned long long)recovery.bytes);
+    fprintf(f, "db_snapshots_total %llu\n", (unsigned long long)st->snapshots);
+    fprintf(f, "db_log_appended_bytes_total %llu\n", (unsigned long long)st->log_appended);
+    fprintf(f, "db_compacted_segments_total %llu\n", (unsigned long long)st->compacted);
+    fprintf(f, "db_compaction_copied_bytes_total %llu\n", (unsigned long long)st->compact_copied);
+    fprintf(f, "db_compaction_reclaimed_bytes_total %llu\n",
+            (unsigned long long)st->compact_reclaimed);
+    fprintf(f, "db_compaction_ns_total %llu\n", (unsigned long long)st->compact_ns);
+    fprintf(f, "db_compaction_segment %lld\n", st->compact_seg);
+    fprintf(f, "db_snapshot_ns_total %llu\n", (unsigned long long)st->snapshot_ns);
+    fprintf(f, "db_checksum_errors_total{source=\"storage\"} %llu\n",
+            (unsigned long long)st->total.storage_crc_errors);
+    fprintf(f, "db_checksum_errors_total{source=\"request\"} %llu\n",
+            (unsigned long long)st->total.request_crc_errors);
+    fprintf(f, "db_compress_tried_total %llu\n", (unsigned long long)st->total.compress_tried);
+    fprintf(f, "db_compress_kept_total %llu\n", (unsigned long long)st->total.compress_kept);
+    fprintf(f, "db_compress_in_bytes_total %llu\n", (unsigned long long)st->total.compress_in);
+    fprintf(f, "db_compress_out_bytes_total %llu\n", (unsigned long long)st->total.compress_out);
+    fprintf(f, "db_compress_ratio %.4f\n", st->total.compress_out ?
+            (double)st->total.compress_in / st->total.compress_out : 1.0);
+    fprintf(f, "db_compress_ns_total %llu\n", (unsigned long long)st->total.compress_ns);
+    fprintf(f, "db_expanded_total %llu\n", (unsigned long long)st->total.expanded);
+    fprintf(f, "db_expand_ns_total %llu\n", (unsigned long long)st->total.expand_ns);
+    fprintf(f, "db_ttl_writes_total %llu\n", (unsigned long long)st->total.ttl_writes);
+    fprintf(f, "db_expired_keys_total %llu\n", (unsigned long long)st->total.expired);
+    fprintf(f, "db_expired_reads_total %llu\n", (unsigned long long)st->total.expired_reads);
+    fprintf(f, "db_ttl_keys %d\n", st->timers);
+    fprintf(f, "db_queue_depth %d\n", st->queue_size);
+    fprintf(f, "db_shards %d\n", n_shards);
+    fprintf(f, "db_table_keys %d\n", st->table_size);
+    fprintf(f, "db_table_slots %d\n", st->table_slots);
+    fprintf(f, "db_table_memory_bytes %zu\n", st->memory);
+    fprintf(f, "db_table_memory_limit_bytes %zu\n", mem_limit);
+    fprintf(f, "db_cache_hits_total %llu\n", (unsigned long long)st->hits);
+    fprintf(f, "db_cache_misses_total %llu\n", (unsigned long long)st->misses);
+    fprintf(f, "db_cache_evictions_total %llu\n", (unsigned long long)st->evictions);
+    fprintf(f, "db_cache_hit_ratio %.4f\n", st->hits + st->misses ?
+            (double)st->hits / (st->hits + st->misses) : 0.0);
+    fprintf(f, "db_cache_bytes %zu\n", st->cached);
+    fprintf(f, "db_cache_limit_bytes %zu\n", cache_limit);
+    fprintf(f, "db_key_bytes %zu\n", st->key_bytes);
+    fprintf(f, "db_evict_budget_bytes %zu\n", evict_budget);
+    fprintf(f, "db_key_evictions_total %llu\n", (unsigned long long)st->key_evictions);
+    fprintf(f, "db_evicted_bytes_total %llu\n", (unsigned long long)st->evicted_bytes);
+    fprintf(f, "db_admission_rejects_total %llu\n", (unsigned long long)st->admit_rejects);
+    fprintf(f, "db_log_segments %d\n", st->nseg);
+    fprintf(f, "db_log_bytes %llu\n", (unsigned long long)st->log_bytes);
+    fprintf(f, "db_log_dead_bytes %llu\n", (unsigned long long)st->log_dead);
 
-    if (!read_from_file(filename, buf, BUFFER_LENGTH, idx)) {
-        return 0;
+    for (int op = 0; op < N_OPS; op++) {
+        for (int ph = 0; ph < N_PHASES; ph++) {
+            uint64_t *hist = st->total.hist[op][ph];
+            uint64_t count = 0;
+            for (int b = 0; b < HIST_BUCKETS; b++) {
+                if (hist[b]) {
+                    count += hist[b];
+                    fprintf(f, "db_latency_ns_bucket{op=\"%c\",phase=\"%s\",le=\"%llu\"} %llu\n",
+                            ops[op], phases[ph], (unsigned long long)hist_bound(b),
+                            (unsigned long long)count);
+                }
+            }
+            if (count == 0) {
+                continue;
+            }
+            fprintf(f, "db_latency_ns_bucket{op=\"%c\",phase=\"%s\",le=\"+Inf\"} %llu\n",
+                    ops[op], phases[ph], (unsigned long long)count);
+            fprintf(f, "db_latency_ns_count{op=\"%c\",phase=\"%s\"} %llu\n",
+                    ops[op], phases[ph], (unsigned long long)count);
+            for (int q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+                fprintf(f, "db_latency_ns{op=\"%c\",phase=\"%s\",quantile=\"%g\"} %llu\n",
+                        ops[op], phases[ph], quantiles[q],
+                        (unsigned long long)hist_percentile(hist, count, quantiles[q]));
+            }
+        }
     }
 
-    // update the length of the data
-    *length = strlen(buf);
-    return 1;
+    free(st);
+    if (fclose(f) != 0) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
 }
 
 /*
- * Deletes data from the database.
+ * Queue microbenchmark (--bench-queue): pushes fds through the work queue
+ * from as many producer threads as there are consumers, and compares it
+ * with the mutex + condition variable linked list it replaced.
  */
-int do_delete(const char *key_name) {
-
-    pthread_mutex_lock(&db_lock);
+#define BENCH_QUEUE_ITEMS 2000000
 
-    int idx = find_key_index(key_name);
-    if (idx < 0 || table[idx].state != STATE_VALID) {
-        pthread_mutex_unlock(&db_lock);
-        return 0;
-    }
+struct list_item {
+    int fd;
+    struct list_item *next;
+};
 
-    table[idx].state = STATE_INVALID;
-    table[idx].name[0] = '\0';
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct list_item *head, *tail;
+} list_queue = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
 
-    pthread_mutex_unlock(&db_lock);
+static void list_push(int fd) {
+    pthread_mutex_lock(&list_queue.lock);
+    struct list_item *item = malloc(sizeof(*item));
+    item->fd = fd;
+    item->next = NULL;
+    if (list_queue.tail) {
+        list_queue.tail->next = item;
+    } else {
+        list_queue.head = item;
+    }
+    list_queue.tail = item;
+    pthread_cond_signal(&list_queue.cond);
+    pthread_mutex_unlock(&list_queue.lock);
+}
 
-    char filename[64];
-    sprintf(filename, "/tmp/data.%d", idx);
-    unlink(filename); // delete the file by unlinking it
-    return 1;
+static int list_pop(void) {
+    pthread_mutex_lock(&list_queue.lock);
+    while (list_queue.head == NULL) {
+        pthread_cond_wait(&list_queue.cond, &list_queue.lock);
+    }
+    struct list_item *item = list_queue.head;
+    list_queue.head = item->next;
+    if (list_queue.head == NULL) {
+        list_queue.tail = NULL;
+    }
+    int fd = item->fd;
+    free(item);
+    pthread_mutex_unlock(&list_queue.lock);
+    return fd;
 }
 
-/*
- * Finds the index of a key in the database.
- */
-int find_key_index(const char *key_name) {
-    for (int i = 0; i < MAX_KEYS; i++) {
-        if (table[i].state == STATE_VALID && strcmp(table[i].name, key_name) == 0) {
-            return i;
+static struct work_queue bench_queue;
+static int bench_per_thread;
+static int bench_use_list;
+
+static void *bench_producer(void *arg) {
+    for (int i = 0; i < bench_per_thread; i++) {
+        if (bench_use_list) {
+            list_push(i);
+        } else {
+            enqueue_work(&bench_queue, i, 0);
         }
     }
-    return -1;
+    return NULL;
 }
 
-/*
- * Finds a free slot in the database.
- */
-int find_free_slot(void) {
-    for (int i = 0; i < MAX_KEYS; i++) {
-        if (table[i].state == STATE_INVALID) {
-            return i;
+static void *bench_consumer(void *arg) {
+    uint64_t queued_at;
+
+    for (int i = 0; i < bench_per_thread; i++) {
+        if (bench_use_list) {
+            list_pop();
+        } else {
+            dequeue_work(&bench_queue, &queued_at);
         }
     }
-    return -1;
+    return NULL;
 }
 
-/*
- * Writes data to a file.
- */
-int write_to_file(const char *filename, const char *data, int len, int idx) {
-
-    pthread_mutex_lock(&db_lock);
+static double bench_queue_run(int use_list, int nthreads) {
+    pthread_t producers[nthreads], consumers[nthreads];
+    struct timespec t0, t1;
 
-    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+    work_queue_init(&bench_queue);
+    bench_use_list = use_list;
+    bench_per_thread = BENCH_QUEUE_ITEMS / nthreads;
 
-    if (fd < 0) {
-        perror("Cannot open file");
-        table[idx].state = STATE_INVALID;
-        pthread_mutex_unlock(&db_lock);
-        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_create(&consumers[i], NULL, bench_consumer, NULL);
+        pthread_create(&producers[i], NULL, bench_producer, NULL);
     }
-
-    int n = write(fd, data, len);
-    close(fd);
-
-    if (n != len || n < 0) {
-        perror("Cannot write to file");
-        table[idx].state = STATE_INVALID;
-        pthread_mutex_unlock(&db_lock);
-        return 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(producers[i], NULL);
+        pthread_join(consumers[i], NULL);
     }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
 
-    pthread_mutex_unlock(&db_lock);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    return bench_per_thread * nthreads / secs;
+}
 
-    return 1;
+void bench_queue_main(int nthreads) {
+    printf("%d producers, %d consumers, %d items\n",
+           nthreads, nthreads, BENCH_QUEUE_ITEMS);
+    printf("mutex list queue: %.0f items/sec\n", bench_queue_run(1, nthreads));
+    printf("lock-free ring:   %.0f items/sec\n", bench_queue_run(0, nthreads));
 }
 
+#define MODE_THREADS 0
+#define MODE_EPOLL   1
+#define MODE_PERCORE 2
+
+static struct argp_option options[] = {
+    {"mode",    'm', "MODE", 0, "threads (listener + worker pool, default), epoll or percore"},
+    {"threads", 't', "NUM",  0, "worker threads, event loops in epoll mode (default 4), or cores in percore mode (default: one per CPU)"},
+    {"pin",     'p', "POLICY", 0, "percore mode: none (default) or cores, to pin core thread N to CPU N"},
+    {"max-memory", 'M', "BYTES", 0, "ceiling for table and index memory, with optional K/M/G suffix"},
+    {"cache-size", 'c', "BYTES", 0, "memory for cached values (default 64M, 0 disables)"},
+    {"zero-copy", 'z', "BYTES", 0, "send uncached values of at least BYTES straight from storage (default 16K, 0 disables)"},
+    {"verify-zero-copy", 'V', 0, 0, "check the CRC32C of values sent straight from storage first, at the cost of reading them twice"},
+    {"shards", 'S', "NUM", 0, "lock shards the key table is split into (default 16)"},
+    {"storage", 's', "BACKEND", 0, "file (one file per key, default), uring (the same files through io_uring) or log (append-only segments)"},
+    {"durability", 'd', "MODE", 0, "when a write is acknowledged: none (once written, default), group (after a sync shared with concurrent writes) or sync (after a sync of its own)"},
+    {"commit-interval", 'i', "MS", 0, "group commit: sync at most MS milliseconds after the first write waiting (default 2)"},
+    {"commit-bytes", 'b', "BYTES", 0, "group commit: sync early once BYTES are waiting (default 1M)"},
+    {"snapshot-interval", 'N', "SEC", 0, "log storage: snapshot the index every SEC seconds for a fast restart (default 60, 0 = only on quit)"},
+    {"compact-garbage", 'g', "PCT", 0, "log storage: compact a segment once PCT percent of it is garbage (default 50, 0 = never)"},
+    {"compact-rate", 'r', "BYTES", 0, "log storage: copy at most BYTES per second while compacting, K/M/G suffix ok (default 32M, 0 = no limit)"},
+    {"compress", 'C', "CODEC", 0, "pack values with none (default), zlib (deflate, fastest level) or lz4"},
+    {"compress-min", 'T', "BYTES", 0, "compression: only try values of at least BYTES (default 256)"},
+    {"compress-save", 'P', "PCT", 0, "compression: store a value packed only if that saves PCT percent of it (default 10)"},
+    {"evict", 'E', "POLICY", 0, "cache mode: make room for new keys by evicting others, lru (sampled) or clock, instead of failing writes; none (default) is off"},
+    {"evict-budget", 'e', "BYTES", 0, "cache mode: evict once keys and their values take BYTES, K/M/G suffix ok (default 0, only when the table is full)"},
+    {"admission", 'A', "FILTER", 0, "cache mode: none (default), or tinylfu to only evict for keys used more often than the one evicted"},
+    {"fresh", 'f', 0, 0, "log storage: start empty instead of recovering what the last run stored"},
+    {"log-level", 'l', "LEVEL", 0, "error, warn, info (default) or debug, which logs every request"},
+    {"bench-queue", 'B', 0, 0, "benchmark the work queue against a mutex-protected list with --threads producers and consumers, then exit"},
+    {0}
+};
+
+static struct {
+    int port;
+    int mode;
+    int nthreads;
+    int bench_queue;
+    int fresh;
+} config = {5000, MODE_THREADS, 0};
+
 /*
- * Reads data from a file.
+ * Parses a byte count with an optional K/M/G suffix.
  */
-int read_from_file(const char *filename, char *buf, int len, int idx) {
-    int fd = open(filename, O_RDONLY);
-
-    if (fd < 0) {
-        perror("Cannot open file");
-        table[idx].state = STATE_INVALID;
-        return 0;
+static size_t parse_size(struct argp_state *state, char *arg) {
+    char *end;
+    unsigned long long n = strtoull(arg, &end, 10);
+    switch (*end) {
+    case 'G': case 'g': n <<= 10; /* fall through */
+    case 'M': case 'm': n <<= 10; /* fall through */
+    case 'K': case 'k': n <<= 10; end++; break;
     }
+    if (*end != '\0') {
+        argp_error(state, "invalid size: %s", arg);
+    }
+    return n;
+}
 
-    int n = read(fd, buf, len);
-    close(fd);
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+    switch (key) {
+    case 'm':
+        if (strcmp(arg, "threads") == 0) {
+            config.mode = MODE_THREADS;
+        } else if (strcmp(arg, "epoll") == 0) {
+            config.mode = MODE_EPOLL;
+        } else if (strcmp(arg, "percore") == 0) {
+            config.mode = MODE_PERCORE;
+        } else {
+            argp_error(state, "unknown mode: %s", arg);
+        }
+        break;
 
-    if (n < 0) {
-        perror("Cannot read from file");
-        table[idx].state = STATE_INVALID;
-        return 0;
-    }
+    case 't':
+        config.nthreads = atoi(arg);
+        if (config.nthreads <= 0) {
+            argp_error(state, "invalid thread count: %s", arg);
+        }
+        break;
 
-    printf("read_from_file: read %d bytes. First few bytes: '%.*s'\n",
-           n, n > 20 ? 20 : n, buf);
+    case 'p':
+        if (strcmp(arg, "none") == 0) {
+            pin_policy = PIN_NONE;
+        } else if (strcmp(arg, "cores") == 0) {
+            pin_policy = PIN_CORES;
+        } else {
+            argp_error(state, "unknown pinning policy: %s", arg);
+        }
+        break;
 
-    if (n < len) {
-        buf[n] = '\0';
-    }
+    case 'M':
+        mem_limit = parse_size(state, arg);
+        break;
 
-    return 1;
-}
+    case 'c':
+        cache_limit = parse_size(state, arg);
+        break;
 
-void handle_work(int fd) {
-    struct request req;
-    struct request res;
+    case 'z':
+        zero_copy_min = parse_size(state, arg);
+        break;
 
-    if (!read_bytes(fd, &req, sizeof(req))) {
-        res.op_status = 'X';
-        write_bytes(fd, &res, sizeof(res)); // write error
-        close(fd);
-        return;
-    }
+    case 'V':
+        zero_copy_verify = 1;
+        break;
 
-    printf("Got request: op=%c name=%s len=%s\n",
-           req.op_status, req.name, req.len);
+    case 'B':
+        config.bench_queue = 1;
+        break;
 
-    char op = req.op_status;
-    int length = atoi(req.len);
+    case 'd':
+        if (strcmp(arg, "none") == 0) {
+            durability = DURABLE_NONE;
+        } else if (strcmp(arg, "group") == 0) {
+            durability = DURABLE_GROUP;
+        } else if (strcmp(arg, "sync") == 0) {
+            durability = DURABLE_SYNC;
+        } else {
+            argp_error(state, "unknown durability mode: %s", arg);
+        }
+        break;
 
-    if (op == 'W') {
-        stats_writes++;
+    case 'i':
+        commit_interval_ms = atoi(arg);
+        if (commit_interval_ms < 0) {
+            argp_error(state, "invalid commit interval: %s", arg);
+        }
+        break;
 
-        // check the length of the data
-        if (length < 0 || length > BUFFER_LENGTH) {
-            stats_fails++;
-            res.op_status = 'X';
-            write_bytes(fd, &res, sizeof(res)); // write error
-            return;
+    case 'b':
+        commit_bytes = parse_size(state, arg);
+        break;
+
+    case 'N':
+        snapshot_interval = atoi(arg);
+        if (snapshot_interval < 0) {
+            argp_error(state, "invalid snapshot interval: %s", arg);
         }
+        break;
 
-        // read the data from the client
-        char buf[BUFFER_LENGTH];
-        if (!read_bytes(fd, buf, length)) {
-            stats_fails++;
-            res.op_status = 'X';
-            write_bytes(fd, &res, sizeof(res)); // write error
-            return;
+    case 'f':
+        config.fresh = 1;
+        break;
+
+    case 'g':
+        compact_garbage = atoi(arg);
+        if (compact_garbage < 0 || compact_garbage > 100) {
+            argp_error(state, "invalid garbage percentage: %s", arg);
         }
+        break;
 
-        // write the data to the database
-        res.op_status = do_write(req.name, buf, length) ? 'K' : 'X';
-        write_bytes(fd, &res, sizeof(res));
-        stats_fails += res.op_status == 'X';
+    case 'r':
+        compact_rate = parse_size(state, arg);
+        break;
 
-        printf("Wrote %d bytes\n", length);
-        printf("Response: op=%c\n", res.op_status);
-    } else if (op == 'R') {
-        stats_reads++;
+    case 'C':
+        compress_codec = -1;
+        for (int i = 0; i < N_CODECS; i++) {
+            if (strcmp(arg, codec_names[i]) == 0) {
+                compress_codec = i;
+            }
+        }
+        if (compress_codec < 0) {
+            argp_error(state, "unknown codec: %s", arg);
+        }
+        break;
 
-        // read the data from the database
-        char buf[BUFFER_LENGTH];
-        res.op_status = do_read(req.name, buf, &length) ? 'K' : 'X';
-        sprintf(res.len, "%d", length);
-        write_bytes(fd, &res, sizeof(res));
+    case 'T':
+        compress_min = parse_size(state, arg);
+        break;
 
-        // send the data to the client only if the operation was successful
-        if (res.op_status == 'K') {
-            write_bytes(fd, buf, length);
+    case 'E':
+        if (strcmp(arg, "none") == 0) {
+            evict_policy = EVICT_NONE;
+        } else if (strcmp(arg, "lru") == 0) {
+            evict_policy = EVICT_LRU;
+        } else if (strcmp(arg, "clock") == 0) {
+            evict_policy = EVICT_CLOCK;
+        } else {
+            argp_error(state, "unknown eviction policy: %s", arg);
         }
-        stats_fails += res.op_status == 'X';
+        break;
 
-        printf("Read %d bytes\n", length);
-        printf("Response: op=%c len=%s\n", res.op_status, res.len);
-    } else if (op == 'D') {
-        stats_deletes++;
+    case 'e':
+        evict_budget = parse_size(state, arg);
+        break;
 
-        // delete the data from the database
-        res.op_status = do_delete(req.name) ? 'K' : 'X';
-        write_bytes(fd, &res, sizeof(res));
-        stats_fails += res.op_status == 'X';
+    case 'A':
+        if (strcmp(arg, "none") == 0) {
+            evict_admission = 0;
+        } else if (strcmp(arg, "tinylfu") == 0) {
+            evict_admission = 1;
+        } else {
+            argp_error(state, "unknown admission filter: %s", arg);
+        }
+        break;
 
-        printf("Deleted\n");
-        printf("Response: op=%c\n", res.op_status);
-    } else {
-        // When the operation is invalid, increment the fails counter
-        stats_fails++;
-        res.op_status = 'X';
-        write_bytes(fd, &res, sizeof(res));
-        printf("Invalid operation\n");
-        printf("Response: op=%c\n", res.op_status);
-    }
+    case 'P':
+        compress_save = atoi(arg);
+        if (compress_save < 0 || compress_save > 99) {
+            argp_error(state, "invalid saving percentage: %s", arg);
+        }
+        break;
 
-}
+    case 'l':
+        if (strcmp(arg, "error") == 0) {
+            log_level = LOG_ERROR;
+        } else if (strcmp(arg, "warn") == 0) {
+            log_level = LOG_WARN;
+        } else if (strcmp(arg, "info") == 0) {
+            log_level = LOG_INFO;
+        } else if (strcmp(arg, "debug") == 0) {
+            log_level = LOG_DEBUG;
+        } else {
+            argp_error(state, "unknown log level: %s", arg);
+        }
+        break;
 
-void* listener_thread(void *arg) {
-    while (1) {
-        int fd = accept(server_socket, NULL, NULL);
-        if (fd < 0) {
-            perror("accept");
-            continue;
+    case 'S':
+        n_shards = atoi(arg);
+        if (n_shards <= 0 || n_shards > MAX_SHARDS) {
+            argp_error(state, "invalid shard count: %s", arg);
         }
-        printf("Listener thread running...\n");
-        enqueue_work(fd);
-    }
-    return NULL;
-}
+        break;
 
-void* worker_thread(void *arg) {
-    while (1) {
-        int fd = dequeue_work();
-        handle_work(fd);
-        printf("Worker thread running...\n");
-        close(fd);
-    }
-    return NULL;
-}
+    case 's':
+        if (strcmp(arg, "file") == 0) {
+            storage = &file_storage;
+        } else if (strcmp(arg, "uring") == 0) {
+            storage = &uring_storage;
+        } else if (strcmp(arg, "log") == 0) {
+            storage = &log_storage;
+        } else {
+            argp_error(state, "unknown storage backend: %s", arg);
+        }
+        break;
 
-void print_stats() {
-    int table_size = 0;
-    pthread_mutex_lock(&db_lock);
-    for (int i = 0; i < MAX_KEYS; i++) {
-        if (table[i].state == STATE_VALID) {
-            table_size++;
+    case ARGP_KEY_ARG:
+        if (state->arg_num > 0) {
+            argp_usage(state);
         }
-    }
-    pthread_mutex_unlock(&db_lock);
+        config.port = atoi(arg);
+        if (config.port <= 0) {
+            fprintf(stderr, "Invalid port number: %s\n", arg);
+            exit(1);
+        }
+        break;
 
-    int queue_size = 0;
-    pthread_mutex_lock(&q_lock);
-    struct work_item *item = work_queue.head;
-    while (item) {
-        queue_size++;
-        item = item->next;
+    default:
+        return ARGP_ERR_UNKNOWN;
     }
-    pthread_mutex_unlock(&q_lock);
-
-    printf("Stats:\nwrites=%d\nreads=%d\ndeletes=%d\nfails=%d\ncurrent table size=%d\ncurrent queue size=%d\n",
-           stats_writes, stats_reads, stats_deletes, stats_fails, table_size, queue_size);
+    return 0;
 }
 
+static struct argp argp = {options, parse_opt, "[PORT]", NULL};
+
 int main(int argc, char **argv) {
-    system("rm -f /tmp/data.*");
+    storage = &file_storage;
+    argp_parse(&argp, argc, argv, 0, 0, NULL);
 
-    // initialize the database
-    for (int i = 0; i < MAX_KEYS; i++) {
-        table[i].name[0] = '\0';
-        table[i].state = STATE_INVALID;
+    if (config.nthreads == 0) {
+        config.nthreads = config.mode == MODE_PERCORE ?
+            sysconf(_SC_NPROCESSORS_ONLN) : 4;
     }
-
-    // initialize the server socket and bind it to the port
-    int port = 5000;
-    if (argc > 1) {
-        port = atoi(argv[1]);
-        if (port <= 0) {
-            fprintf(stderr, "Invalid port number: %s\n", argv[1]);
+    if (config.mode == MODE_PERCORE) {
+        // every core owns the same number of shards
+        n_cores = config.nthreads;
+        n_shards = (n_shards + n_cores - 1) / n_cores * n_cores;
+        if (n_shards > MAX_SHARDS) {
+            fprintf(stderr, "Too many cores\n");
             exit(1);
         }
     }
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
 
-    struct sockaddr_in server_address = {
-        .sin_family = AF_INET,
-        .sin_port = htons(port),
-        .sin_addr.s_addr = 0
-    };
+    if (config.bench_queue) {
+        bench_queue_main(config.nthreads);
+        return 0;
+    }
 
-    // bind the socket to the address
-    if (bind(server_socket, (struct sockaddr*)&server_address, sizeof(server_address)) < 0) {
-        perror("Cannot bind");
+    // too many files for a shell glob once the table has grown; the log
+    // is kept for log_recover() below
+    if (storage != &log_storage) {
+        system("find /tmp -maxdepth 1 -name 'data.*' -delete");
+    } else if (config.fresh) {
+        system("find /tmp -maxdepth 1 \\( -name 'seg.*' -o -name 'index.snap*' \\) -delete");
+    }
+
+    data_dir_fd = open("/tmp", O_RDONLY | O_DIRECTORY);
+    if (data_dir_fd < 0) {
+        perror("/tmp");
         exit(1);
     }
 
-    // listen for incoming connections
-    if (listen(server_socket, 2) < 0) {
-        perror("Cannot listen");
+    if (storage == &uring_storage && uring_init(URING_ENTRIES, URING_FILES) < 0) {
+        perror("io_uring");
+        exit(1);
+    }
+
+    if (durability == DURABLE_GROUP) {
+        // timed waits are against CLOCK_MONOTONIC, like now_ns()
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&commit_work, &attr);
+        pthread_condattr_destroy(&attr);
+
+        pthread_t committer;
+        pthread_create(&committer, NULL, committer_thread, NULL);
+    }
+
+    // a client hanging up on a kept-alive connection must not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t flusher;
+    pthread_create(&flusher, NULL, log_flusher_thread, NULL);
+
+    // initialize the database; the shards' tables grow on demand, but
+    // each needs room for its first index array and chunk of entries
+    size_t shard_min = MIN_BUCKETS * sizeof(struct bucket) +
+                       CHUNK_KEYS * sizeof(struct entry);
+    if (mem_limit && mem_limit / n_shards < shard_min) {
+        fprintf(stderr, "Memory limit too small: %d shards need at least %zuK\n",
+                n_shards, (shard_min * n_shards + 1023) / 1024);
         exit(1);
     }
+    shards = aligned_alloc(64, n_shards * sizeof(struct shard));
+    memset(shards, 0, n_shards * sizeof(struct shard));
+    for (int i = 0; i < n_shards; i++) {
+        struct shard *sh = &shards[i];
+        pthread_mutex_init(&sh->lock, NULL);
+        sh->num = i;
+        sh->lru_head = sh->lru_tail = LRU_NONE;
+        memset(sh->wheel, 0xff, sizeof(sh->wheel));
+        sh->wheel_tick = wall_ms() / WHEEL_TICK_MS;
+        sh->evict_rand = 2463534242u + i;
+        if (evict_policy != EVICT_NONE && evict_admission &&
+            !(sh->sketch = calloc(SKETCH_ROWS * SKETCH_WIDTH, 1))) {
+            perror("calloc");
+            exit(1);
+        }
+        if (!index_alloc(sh, &sh->cur, MIN_BUCKETS)) {
+            fprintf(stderr, "Memory limit too small\n");
+            exit(1);
+        }
+    }
 
-    printf("Server listening on port %d\n", port);
+    if (storage == &log_storage) {
+        log_recover();
+        if (snapshot_interval > 0) {
+            pthread_t snapshotter;
+            pthread_create(&snapshotter, NULL, snapshot_thread, NULL);
+        }
+        if (compact_garbage > 0) {
+            pthread_t compactor;
+            pthread_create(&compactor, NULL, compact_thread, NULL);
+        }
+    }
+    pthread_t expirer;
+    pthread_create(&expirer, NULL, expire_thread, NULL);
+
+    work_queue_init(&work_queue);
+
+    int port = config.port;
+
+    if (config.mode == MODE_PERCORE) {
+        // each core listens on a socket of its own
+        server_socket = -1;
+        start_cores(port);
+    } else {
+        server_socket = open_listener(port, 0);
+        if (server_socket < 0) {
+            exit(1);
+        }
+    }
+
+    LOG(LOG_INFO, "Server listening on port %d\n", port);
+
+    if (config.mode == MODE_EPOLL) {
+        // the listening socket is shared by all loops, accept must not block
+        fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL) | O_NONBLOCK);
 
-    // create the listener thread
-    pthread_t lt;
-    pthread_create(&lt, NULL, listener_thread, NULL);
+        pthread_t loops[config.nthreads];
+        for (int i = 0; i < config.nthreads; i++) {
+            pthread_create(&loops[i], NULL, event_loop_thread, NULL);
+        }
+    } else if (config.mode == MODE_THREADS) {
+        // create the listener thread
+        pthread_t lt;
+        pthread_create(&lt, NULL, listener_thread, NULL);
 
-    // create 4 worker threads
-    pthread_t workers[4];
-    for (int i = 0; i < 4; i++) {
-        pthread_create(&workers[i], NULL, worker_thread, NULL);
+        // create the worker threads
+        pthread_t workers[config.nthreads];
+        for (int i = 0; i < config.nthreads; i++) {
+            pthread_create(&workers[i], NULL, worker_thread, NULL);
+        }
     }
 
     // blocked until a client connects
@@ -499,12 +6720,21 @@ int main(int argc, char **argv) {
         }
 
         if (strncmp(line, "quit", 4) == 0) {
-            close(server_socket);
-            exit(0);
+            if (server_socket >= 0) {
+                close(server_socket);
+            }
+            break;
         } else if (strncmp(line, "stats", 5) == 0) {
             print_stats();
+        } else if (strncmp(line, "snapshot", 8) == 0 && storage == &log_storage) {
+            snapshot_take();
         }
     }
 
-    return  0;
+    // the next start has nothing to replay
+    if (storage == &log_storage) {
+        snapshot_take();
+    }
+    log_flush();
+    exit(0);
 }
\ No newline at end of file
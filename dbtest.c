@@ -12,13 +12,18 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <zlib.h>
 #include <pthread.h>
 #include <argp.h>
 #include <assert.h>
+#include <time.h>
+#include <endian.h>
+#include <math.h>
 
 #include "proj2.h"
+#include "crc32c.h"
 
 /* --------- argument parsing ---------- */
 
@@ -33,11 +38,24 @@ static struct argp_option options[] = {
     {"max",          'm', "NUM",  0, "max number of keys (default 200)"},
     {"test",         'T',  0,     0, "10 simultaneous requests"},
     {"log",          'l', "FILE", 0, "log output to FILE"},
-    {"overload",     'O',  0,     0, "try to create >200 keys"},
+    {"overload",     'O',  0,     0, "try to create 25% more than --max keys"},
+    {"keepalive",    'k',  0,     0, "reuse one connection per thread"},
+    {"pipeline",     'P', "NUM",  0, "send NUM requests before reading replies"},
+    {"readbench",    'r',  0,     0, "store --max values, then read them back at random"},
+    {"writebench",   'w',  0,     0, "overwrite --max keys from --threads connections, reporting throughput and latency percentiles"},
+    {"fill",         'f',  0,     0, "store --max keys of --value-size bytes and leave them there"},
+    {"value-size",   'v', "BYTES", 0, "value size for --readbench and --writebench, K/M suffixes ok (default 4096, up to 64M)"},
+    {"stats",        's',  0,     0, "print the server's metrics"},
+    {"zipf",         'z', "S",    0, "read-through cache traffic: --count reads of --max keys picked with Zipf exponent S, writing back misses; reports the hit rate"},
+    {"ttl",          'e', "MS",   0, "--set and --fill keys that expire after MS milliseconds (values up to 4096 bytes)"},
+    {"batch",        'b', "NUM",  0, "write, read and delete --max keys one at a time, then NUM per batch request"},
+    {"proto",        'V', "N",    0, "protocol for --overload, --readbench, --writebench and --batch: 1 (default) or 2"},
+    {"checksum",     'c',  0,     0, "with --proto=2, send CRC32C checksums and check the ones that come back"},
+    {"crc-bench",    'C',  0,     0, "time CRC32C against zlib crc32 and exit"},
     {0}
 };
 
-enum {OP_SET = 1, OP_GET = 2, OP_DELETE = 3, OP_QUIT = 4};
+enum {OP_SET = 1, OP_GET = 2, OP_DELETE = 3, OP_QUIT = 4, OP_STATS = 5};
 
 struct args {
     int nthreads;
@@ -47,6 +65,18 @@ struct args {
     int op;
     int test;
     int overload;
+    int keepalive;
+    int pipeline;
+    int readbench;
+    int writebench;
+    int fill;
+    int value_size;
+    int batch;
+    int proto;
+    int checksum;
+    int crc_bench;
+    double zipf;
+    unsigned long long ttl;
     char *key;
     char *val;
     char *logfile;
@@ -61,9 +91,12 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
     switch (key) {
     case ARGP_KEY_INIT:
         a->nthreads = 1;
+        a->proto = 1;
         a->count = 1000;
         a->port = 5000;
         a->max = 200;
+        a->pipeline = 1;
+        a->value_size = 4096;
         a->logfp = NULL;
         pthread_mutex_init(&a->logm, NULL);
         break;
@@ -71,6 +104,73 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
     case 'O':
         a->overload = 1;
         break;
+
+    case 'k':
+        a->keepalive = 1;
+        break;
+
+    case 'r':
+        a->readbench = 1;
+        break;
+
+    case 'w':
+        a->writebench = 1;
+        break;
+
+    case 'f':
+        a->fill = 1;
+        break;
+
+    case 'v': {
+        char *end;
+        long size = strtol(arg, &end, 10);
+        if (*end == 'k' || *end == 'K')
+            size <<= 10, end++;
+        else if (*end == 'm' || *end == 'M')
+            size <<= 20, end++;
+        if (*end != 0 || size < 1 || size > (64 << 20))
+            printf("value size must be 1 to 64M\n"), argp_usage(state);
+        a->value_size = size;
+        break;
+    }
+
+    case 'V':
+        a->proto = atoi(arg);
+        if (a->proto != 1 && a->proto != 2)
+            printf("protocol must be 1 or 2\n"), argp_usage(state);
+        break;
+
+    case 'c':
+        a->checksum = 1;
+        break;
+
+    case 'C':
+        a->crc_bench = 1;
+        break;
+
+    case 'z':
+        a->zipf = atof(arg);
+        if (a->zipf <= 0)
+            printf("Zipf exponent must be > 0\n"), argp_usage(state);
+        break;
+
+    case 'e':
+        a->ttl = strtoull(arg, NULL, 10);
+        if (a->ttl < 1)
+            printf("TTL must be >= 1 ms\n"), argp_usage(state);
+        break;
+
+    case 'b':
+        a->batch = atoi(arg);
+        if (a->batch < 1 || a->batch > BATCH_MAX_KEYS)
+            printf("batch size must be 1 to %d\n", BATCH_MAX_KEYS), argp_usage(state);
+        break;
+
+    case 'P':
+        a->pipeline = atoi(arg);
+        if (a->pipeline < 1)
+            printf("pipeline depth must be >= 1\n"), argp_usage(state);
+        break;
         
     case 'l':
         a->logfile = arg;
@@ -86,6 +186,10 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
     case 'q':
         a->op = OP_QUIT;
         break;
+
+    case 's':
+        a->op = OP_STATS;
+        break;
         
     case 'm':
         a->max = atoi(arg);
@@ -122,6 +226,15 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
         a->port = atoi(arg);
         break;
         
+    case ARGP_KEY_END:
+        if (a->checksum && a->proto != 2)
+            printf("--checksum needs --proto=2\n"), argp_usage(state);
+        if (a->zipf && a->value_size > 4096)
+            printf("--zipf values must be <= 4096 bytes\n"), argp_usage(state);
+        if (a->ttl && a->fill && a->value_size > 4096)
+            printf("--ttl values must be <= 4096 bytes\n"), argp_usage(state);
+        break;
+
     case ARGP_KEY_ARG:
         if (state->arg_num == 0 && a->op == OP_SET)
             a->val = arg;
@@ -136,6 +249,18 @@ static struct argp argp = { options, parse_opt, NULL, NULL};
         
 /* --------- everything else ---------- */
 
+/* a T body: the TTL, little-endian, then len bytes of data. Returns a
+ * malloc'd buffer of REQUEST_TTL_LEN + len bytes.
+ */
+char *ttl_body(unsigned long long ttl, void *data, int len)
+{
+    char *body = malloc(REQUEST_TTL_LEN + len);
+    uint64_t le = htole64(ttl);
+    memcpy(body, &le, REQUEST_TTL_LEN);
+    memcpy(body + REQUEST_TTL_LEN, data, len);
+    return body;
+}
+
 /* keep track of the requests we've sent
  */
 struct {
@@ -143,7 +268,8 @@ struct {
     int len;
     int crc;
     int busy;
-} table[150];
+} *table;
+int n_table;                    /* --max entries */
 int n_objects;
 pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER;
 
@@ -173,7 +299,7 @@ int pick_random(void)
     pthread_mutex_lock(&m);
     int num;
     for (int i = 0; i < 20; i++) {
-        num = random() % 150;
+        num = random() % n_table;
         if (table[num].len > 0 && !table[num].busy) {
             table[num].busy = 1;
             pthread_mutex_unlock(&m);
@@ -186,15 +312,20 @@ int pick_random(void)
 
 int get_free(void)
 {
+    static int next;            /* resume where the last search ended */
     int num;
     pthread_mutex_lock(&m);
-    for (num = 0; num < 150; num++)
-        if (table[num].len == 0 && !table[num].busy)
-            break;
-    table[num].busy = 1;
+    for (int i = 0; i < n_table; i++) {
+        num = (next + i) % n_table;
+        if (table[num].len == 0 && !table[num].busy) {
+            next = num + 1;
+            table[num].busy = 1;
+            pthread_mutex_unlock(&m);
+            return num;
+        }
+    }
     pthread_mutex_unlock(&m);
-
-    return num;
+    return -1;
 }
 
 void randstr(char *buf, int len)
@@ -208,145 +339,219 @@ int do_connect(struct sockaddr_in *addr)
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0 || connect(sock, (struct sockaddr*)addr, sizeof(*addr)) < 0)
         fprintf(stderr, "can't connect: %s\n", strerror(errno)), exit(0);
+    int one = 1; /* header and body go out as separate writes */
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
     return sock;
 }
 
-void *thread(void *_ptr)
+/* read exactly len bytes unless the connection fails first
+ */
+int read_all(int sock, void *buf, int len)
 {
-    struct args *a = _ptr;
-    struct sockaddr_in *addr = &a->addr;
-    struct request rq;
-    int val, num, saved_crc, saved_len;
+    int done = 0;
+    while (done < len) {
+        int n = read(sock, buf + done, len - done);
+        if (n < 0)
+            return n;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+/* one request in flight on a connection
+ */
+struct op {
+    char op;
+    int num;
+    char name[32];
+    int len;
+    int crc;
+    int saved_crc;
+    int saved_len;
     char buf[4096];
+};
 
-    for (int i = 0; i < a->count / a->nthreads; i++) {
-        int sock = do_connect(addr);
-        char op = get_op(a);
-        char name[32];
+/* choose the next request and reserve its table entry. If wait is
+ * zero, give up instead of waiting for a busy entry (we may be the
+ * ones holding it, further up the pipeline)
+ */
+int prepare_op(struct args *a, struct op *o, int wait)
+{
+    int num;
+    char op = get_op(a);
 
-        memset(&rq, 0, sizeof(rq));
-        
-        if (op == 'W') {
-            int num = -1;
-            if (random() % 10 < 2)
-                num = pick_random();
-            int rewrite = (num != -1);
-
-            if (rewrite) {
-                assert(table[num].busy);
-                pthread_mutex_lock(&m);
-                strcpy(name, table[num].name);
-                pthread_mutex_unlock(&m);
-            }
-            else {
-                pthread_mutex_lock(&m);
-                n_objects++;
-                pthread_mutex_unlock(&m);
-                memset(name, 0, sizeof(name));
-                randstr(name, 16);
-                num = get_free(); /* sets busy=1 */
-                assert(table[num].busy);
-                strcpy(table[num].name, name);
-            }
-            
-            /* invariant: name == table[num].name, busy=1 
-             */
-            int len = 20 + random() % 600;
-            randstr(buf, len);
-            int _crc = crc32(-1, (unsigned char*)buf, len);
-
-            if (a->logfp) {
-                pthread_mutex_lock(&a->logm);
-                fprintf(a->logfp, "W %s = %d,%d\n", name, len, _crc);
-                pthread_mutex_unlock(&a->logm);
-            }
-                
-            rq.op_status = op;
-            sprintf(rq.len, "%d", len);
-            sprintf(rq.name, "%s", name);
-            write(sock, &rq, sizeof(rq));
-            write(sock, buf, len);
-            val = read(sock, &rq, sizeof(rq));
-
-            if (val < 0)
-                printf("WRITE: REPLY: READ ERROR: %s\n", strerror(errno));
-            else if (val < sizeof(rq))
-                printf("WRITE: REPLY: SHORT READ: %d\n", val);
-
-            pthread_mutex_lock(&m);
-            assert(strcmp(table[num].name, name) == 0);
-            strcpy(table[num].name, name);
-            table[num].len = len;
-            table[num].crc = _crc;
-            table[num].busy = 0; 
-            pthread_mutex_unlock(&m); /* make helgrind happy */
+    o->op = op;
+    if (op == 'W') {
+        num = -1;
+        if (random() % 10 < 2)
+            num = pick_random();
+        if (num == -1)
+            num = get_free(); /* sets busy=1 */
+        /* table full: rewrite an existing key instead */
+        while (num == -1) {
+            if (!wait)
+                return 0;
+            usleep(100);
+            num = pick_random();
         }
-        else if (op == 'R' || op == 'D') {
-            for (num = pick_random(); num == -1; ) {
-                usleep(100);
-                num = pick_random();
-            }
-            
-            pthread_mutex_lock(&m);
-            strcpy(name, table[num].name);
-            saved_crc = table[num].crc;
-            saved_len = table[num].len;
-            pthread_mutex_unlock(&m); /* make helgrind happy */
-            
-            rq.op_status = op;
-            sprintf(rq.len, "0");
-            sprintf(rq.name, "%s", name);
-            write(sock, &rq, sizeof(rq));
-
-            val = read(sock, &rq, sizeof(rq));
-            if (val < 0)
-                printf("%c HDR: REPLY: READ ERROR: %s\n", op, strerror(errno));
-            else if (val < sizeof(rq)) 
-               printf("%c HDR: REPLY: SHORT READ: %d\n", op, val);
-
-            if (op == 'R') {
-                int len = atol(rq.len);
-                for (void *ptr = buf, *max = ptr+len; ptr < max;) {
-                    int n = read(sock, ptr, max-ptr);
-                    if (n < 0) {
-                        printf("READ DATA: READ ERROR: %s\n", strerror(errno));
-                        break;
-                    }
-                    ptr += n;
-                }
-                
-                int _crc = crc32(-1, (unsigned char*)buf, len);
-
-                if (a->logfp) {
-                    pthread_mutex_lock(&a->logm);
-                    fprintf(a->logfp, "R %s = %d,%d %d\n\n", name,
-                            len, _crc, saved_len);
-                    pthread_mutex_unlock(&a->logm);
-                }
-                    
-                if (len != saved_len)
-                    printf("READ %s: bad len %d (should be %d)\n",
-                           name, len, saved_len);
-                if (_crc != saved_crc)
-                    printf("READ %s: bad cksum %d (should be %d)\n",
-                           name, _crc, saved_crc);
-
-                pthread_mutex_lock(&m);
-                table[num].busy = 0;
-                pthread_mutex_unlock(&m);
-            }
-            else if (op == 'D') {
-                pthread_mutex_lock(&m);
-                table[num].len = 0;
-                table[num].busy = 0;
-                n_objects--;
-                pthread_mutex_unlock(&m);
-            }
+        assert(table[num].busy);
+
+        pthread_mutex_lock(&m);
+        int rewrite = table[num].len > 0;
+        if (rewrite)
+            strcpy(o->name, table[num].name);
+        else {
+            n_objects++;
+            memset(o->name, 0, sizeof(o->name));
+            randstr(o->name, 16);
+            strcpy(table[num].name, o->name);
         }
+        pthread_mutex_unlock(&m);
+
+        /* invariant: name == table[num].name, busy=1
+         */
+        o->num = num;
+        o->len = 20 + random() % 600;
+        randstr(o->buf, o->len);
+        o->crc = crc32(-1, (unsigned char*)o->buf, o->len);
+
+        if (a->logfp) {
+            pthread_mutex_lock(&a->logm);
+            fprintf(a->logfp, "W %s = %d,%d\n", o->name, o->len, o->crc);
+            pthread_mutex_unlock(&a->logm);
+        }
+    }
+    else {
+        for (num = pick_random(); num == -1; ) {
+            if (!wait)
+                return 0;
+            usleep(100);
+            num = pick_random();
+        }
+
+        pthread_mutex_lock(&m);
+        o->num = num;
+        strcpy(o->name, table[num].name);
+        o->saved_crc = table[num].crc;
+        o->saved_len = table[num].len;
+        pthread_mutex_unlock(&m); /* make helgrind happy */
+    }
+    return 1;
+}
+
+void send_op(int sock, struct op *o)
+{
+    struct request rq;
+
+    memset(&rq, 0, sizeof(rq));
+    rq.op_status = o->op;
+    set_request_len(&rq, o->op == 'W' ? o->len : 0);
+    sprintf(rq.name, "%s", o->name);
+    write(sock, &rq, sizeof(rq));
+    if (o->op == 'W')
+        write(sock, o->buf, o->len);
+}
+
+void finish_op(int sock, struct args *a, struct op *o)
+{
+    struct request rq;
+    char op = o->op;
+    int num = o->num;
+    int val = read_all(sock, &rq, sizeof(rq));
+
+    if (op == 'W') {
+        if (val < 0)
+            printf("WRITE: REPLY: READ ERROR: %s\n", strerror(errno));
+        else if (val < sizeof(rq))
+            printf("WRITE: REPLY: SHORT READ: %d\n", val);
+
+        pthread_mutex_lock(&m);
+        assert(strcmp(table[num].name, o->name) == 0);
+        table[num].len = o->len;
+        table[num].crc = o->crc;
+        table[num].busy = 0;
+        pthread_mutex_unlock(&m); /* make helgrind happy */
+        return;
+    }
+
+    if (val < 0)
+        printf("%c HDR: REPLY: READ ERROR: %s\n", op, strerror(errno));
+    else if (val < sizeof(rq))
+        printf("%c HDR: REPLY: SHORT READ: %d\n", op, val);
+
+    if (op == 'R') {
+        int len = val == sizeof(rq) && rq.op_status == 'K' ? request_len(&rq) : 0;
+        if (len > sizeof(o->buf))
+            len = sizeof(o->buf);
+        val = read_all(sock, o->buf, len);
+        if (val < 0)
+            printf("READ DATA: READ ERROR: %s\n", strerror(errno));
+
+        int _crc = crc32(-1, (unsigned char*)o->buf, len);
+
+        if (a->logfp) {
+            pthread_mutex_lock(&a->logm);
+            fprintf(a->logfp, "R %s = %d,%d %d\n\n", o->name,
+                    len, _crc, o->saved_len);
+            pthread_mutex_unlock(&a->logm);
+        }
+
+        if (len != o->saved_len)
+            printf("READ %s: bad len %d (should be %d)\n",
+                   o->name, len, o->saved_len);
+        if (_crc != o->saved_crc)
+            printf("READ %s: bad cksum %d (should be %d)\n",
+                   o->name, _crc, o->saved_crc);
+
+        pthread_mutex_lock(&m);
+        table[num].busy = 0;
+        pthread_mutex_unlock(&m);
+    }
+    else if (op == 'D') {
+        pthread_mutex_lock(&m);
+        table[num].len = 0;
+        table[num].busy = 0;
+        n_objects--;
+        pthread_mutex_unlock(&m);
+    }
+}
+
+/* random load. Each batch of up to --pipeline requests is written out
+ * before any reply is read; with --keepalive the same connection
+ * carries all of a thread's batches.
+ */
+void *thread(void *_ptr)
+{
+    struct args *a = _ptr;
+    struct op *ops = calloc(a->pipeline, sizeof(*ops));
+    int total = a->count / a->nthreads;
+    int sock = -1;
+
+    for (int i = 0; i < total; ) {
+        int n = 0;
+        while (n < a->pipeline && i + n < total &&
+               prepare_op(a, &ops[n], n == 0))
+            n++;
+
+        if (sock < 0)
+            sock = do_connect(&a->addr);
+        for (int j = 0; j < n; j++)
+            send_op(sock, &ops[j]);
+        for (int j = 0; j < n; j++)
+            finish_op(sock, a, &ops[j]);
         /* try some bad accesses here */
-        
-        close(sock);
+
+        i += n;
+        if (!a->keepalive) {
+            close(sock);
+            sock = -1;
+        }
     }
+    if (sock >= 0)
+        close(sock);
+    free(ops);
     return NULL;
 }
 
@@ -381,11 +586,18 @@ void do_set(struct args *args, char *name, void *data, int len, char *result, in
     struct request rq;
     snprintf(rq.name, sizeof(rq.name), "%s", name);
     int val;
-    
+    char *body = NULL;
+
     rq.op_status = 'W';
-    sprintf(rq.len, "%d", len);
+    if (args->ttl) {
+        rq.op_status = 'T';
+        data = body = ttl_body(args->ttl, data, len);
+        len += REQUEST_TTL_LEN;
+    }
+    set_request_len(&rq, len);
     write(sock, &rq, sizeof(rq));
     write(sock, data, len);
+    free(body);
     if ((val = read(sock, &rq, sizeof(rq))) < 0)
         printf("WRITE: REPLY: READ ERROR: %s\n", strerror(errno));
     else if (val < sizeof(rq))
@@ -409,6 +621,32 @@ void do_quit(struct args *args)
     /* if both sides close-on-exit you won't get TIME_WAIT */
 }
 
+/* fetch the server's metrics and copy them to stdout
+ */
+void do_stats(struct args *args)
+{
+    int sock = do_connect(&args->addr);
+    struct request rq;
+
+    memset(&rq, 0, sizeof(rq));
+    rq.op_status = 'S';
+    set_request_len(&rq, 0);
+    write(sock, &rq, sizeof(rq));
+    if (read_all(sock, &rq, sizeof(rq)) != sizeof(rq) || rq.op_status != 'K') {
+        printf("STATS: bad reply\n");
+        close(sock);
+        return;
+    }
+    int len = request_len(&rq);
+    char *buf = malloc(len);
+    if (read_all(sock, buf, len) != len)
+        printf("STATS: SHORT READ\n");
+    else
+        fwrite(buf, 1, len, stdout);
+    free(buf);
+    close(sock);
+}
+
 void do_get(struct args *args, char *name, void *data, int *len_p, char *result)
 {
     int val, sock = do_connect(&args->addr);
@@ -416,7 +654,7 @@ void do_get(struct args *args, char *name, void *data, int *len_p, char *result)
     snprintf(rq.name, sizeof(rq.name), "%s", name);
     
     rq.op_status = 'R';
-    sprintf(rq.len, "%d", 0);
+    set_request_len(&rq, 0);
     write(sock, &rq, sizeof(rq));
     if ((val = read(sock, &rq, sizeof(rq))) < 0)
         printf("READ: REPLY: READ ERROR: %s\n", strerror(errno));
@@ -425,7 +663,7 @@ void do_get(struct args *args, char *name, void *data, int *len_p, char *result)
     else if (rq.op_status != 'K')
         printf("READ: FAILED (%c)\n", rq.op_status);
     else {
-        int len = atoi(rq.len);
+        int len = request_len(&rq);
         char buf[len];
 
         for (void *ptr = buf, *max = ptr+len; ptr < max; ) {
@@ -541,40 +779,796 @@ void do_test(struct args *a)
     printf("%s", test_log);
 }
 
+/* the longest request header make_header() builds */
+#define HDR_MAX (sizeof(struct request_v2) + 32)
+
+/* build a request header for name and len bytes of data in the
+ * --proto format in buf, returning its length. id and the checksum only
+ * go out with v2.
+ */
+int make_header(struct args *a, char *buf, char op, const char *name,
+                const void *data, int len, uint64_t id)
+{
+    int key_len = strlen(name);
+
+    if (a->proto == 2) {
+        struct request_v2 h = {
+            .magic = REQUEST_V2_MAGIC,
+            .version = REQUEST_V2_VERSION,
+            .op = op,
+            .key_len = htole16(key_len),
+            .value_len = htole32(len),
+            .id = htole64(id),
+        };
+        if (a->checksum) {
+            h.flags = REQUEST_V2_CHECKSUM;
+            h.crc = htole32(crc32c(0, data, len));
+        }
+        memcpy(buf, &h, sizeof(h));
+        memcpy(buf + sizeof(h), name, key_len);
+        return sizeof(h) + key_len;
+    }
+    struct request rq;
+    memset(&rq, 0, sizeof(rq));
+    rq.op_status = op;
+    snprintf(rq.name, sizeof(rq.name), "%s", name);
+    set_request_len(&rq, len);
+    memcpy(buf, &rq, sizeof(rq));
+    return sizeof(rq);
+}
+
+/* read a reply header in the --proto format, with the checksum of its
+ * value in crc (0 without --checksum). Returns 1, or 0 on a short read
+ * or garbage.
+ */
+int read_reply(struct args *a, int sock, char *status, int *len, uint64_t *id,
+               uint32_t *crc)
+{
+    if (a->proto == 2) {
+        struct request_v2 h;
+        if (read_all(sock, &h, sizeof(h)) != sizeof(h) || h.magic != REQUEST_V2_MAGIC)
+            return 0;
+        *status = h.op;
+        *len = le32toh(h.value_len);
+        *id = le64toh(h.id);
+        *crc = le32toh(h.crc);
+        if (a->checksum && *status == 'K' && !(h.flags & REQUEST_V2_CHECKSUM))
+            return 0;
+        return 1;
+    }
+    struct request rq;
+    if (read_all(sock, &rq, sizeof(rq)) != sizeof(rq))
+        return 0;
+    *status = rq.op_status;
+    *len = request_len(&rq);
+    *id = 0;
+    *crc = 0;
+    return 1;
+}
+
+/* send op for each of n keys over one connection, keeping --pipeline
+ * requests in flight. Writes all store the same len bytes of data.
+ * With v2 the replies may come back in any order, so each is matched
+ * to its request by id.
+ * Returns the number of requests that succeeded.
+ */
+int send_many(struct args *a, int sock, char op, char (*names)[32], int n,
+              void *data, int len)
+{
+    char hdr[HDR_MAX];
+    char *seen = calloc(a->pipeline, 1);
+    int ok = 0;
+
+    for (int i = 0; i < n; i += a->pipeline) {
+        int batch = (n - i < a->pipeline) ? n - i : a->pipeline;
+
+        for (int j = i; j < i + batch; j++) {
+            int has_data = op == 'W' || op == 'T';
+            write(sock, hdr, make_header(a, hdr, op, names[j], data,
+                                         has_data ? len : 0, j));
+            if (has_data)
+                write(sock, data, len);
+        }
+        memset(seen, 0, batch);
+        for (int j = i; j < i + batch; j++) {
+            char status;
+            int vlen;
+            uint64_t id;
+            uint32_t crc, value_crc = 0;
+            if (!read_reply(a, sock, &status, &vlen, &id, &crc)) {
+                printf("%c %s: REPLY: SHORT READ\n", op, names[j]);
+                goto out;
+            }
+            if (a->proto == 2 && (id < i || id >= i + batch || seen[id - i]++)) {
+                printf("%c: REPLY: UNEXPECTED ID %llu\n", op, (unsigned long long)id);
+                goto out;
+            }
+            ok += (status == 'K');
+            /* values read are skipped; big ones aren't read this way */
+            if (op != 'R' || status != 'K')
+                vlen = 0;
+            char skip[4096];
+            for (int n; vlen > 0; vlen -= n)
+                if ((n = read_all(sock, skip, vlen < sizeof(skip) ? vlen : sizeof(skip))) > 0) {
+                    if (a->checksum)
+                        value_crc = crc32c(value_crc, skip, n);
+                } else {
+                    printf("%c %s: REPLY DATA: SHORT READ\n", op, names[j]);
+                    goto out;
+                }
+            if (a->checksum && value_crc != crc) {
+                printf("%c %s: REPLY DATA: CHECKSUM MISMATCH\n", op, names[j]);
+                ok--;
+            }
+        }
+    }
+out:
+    free(seen);
+    return ok;
+}
+
+/* create 25% more keys than --max, report how many the server took and
+ * how fast, then delete them all again.
+ */
 void do_overload(struct args *a)
 {
-    char name[30];
+    int nkeys = a->max + a->max / 4;
+    char (*names)[32] = malloc(nkeys * sizeof(*names));
     char data[100];
+    struct timespec t0, t1;
+
+    for (int i = 0; i < nkeys; i++)
+        sprintf(names[i], "KEY-%04d", i);
+    randstr(data, sizeof(data));
+
+    int sock = do_connect(&a->addr);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int stored = send_many(a, sock, 'W', names, nkeys, data, sizeof(data));
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("overload: stored %d of %d keys in %.3f sec (%.0f writes/sec)\n",
+           stored, nkeys, secs, secs > 0 ? nkeys / secs : 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int deleted = send_many(a, sock, 'D', names, nkeys, NULL, 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("overload: deleted %d keys in %.3f sec (%.0f deletes/sec)\n",
+           deleted, secs, secs > 0 ? nkeys / secs : 0);
+
+    close(sock);
+    free(names);
+}
     
-    for (int i = 0; i < 250; i++) {
-        sprintf(name, "KEY-%04d", i);
-        randstr(data, sizeof(data));
-        do_set(a, name, data, sizeof(data), NULL, 1);
+/* --readbench: every thread reads random keys out of names[] over its
+ * own connection, --pipeline requests at a time
+ */
+char (*rb_names)[32];
+long long rb_bytes, rb_fails;
+
+/* big values are read back a piece at a time */
+#define RB_BUF_MAX (1 << 20)
+
+void *readbench_thread(void *_ptr)
+{
+    struct args *a = _ptr;
+    char hdr[HDR_MAX];
+    int buf_len = a->value_size < RB_BUF_MAX ? a->value_size : RB_BUF_MAX;
+    char *buf = malloc(buf_len);
+    int sock = do_connect(&a->addr);
+    long long bytes = 0, fails = 0;
+    int total = a->count / a->nthreads;
+
+    for (int i = 0; i < total; i += a->pipeline) {
+        int batch = (total - i < a->pipeline) ? total - i : a->pipeline;
+
+        for (int j = 0; j < batch; j++)
+            write(sock, hdr, make_header(a, hdr, 'R', rb_names[random() % a->max],
+                                         NULL, 0, i + j));
+        for (int j = 0; j < batch; j++) {
+            char status;
+            int len;
+            uint64_t id;
+            uint32_t crc, value_crc = 0;
+            if (!read_reply(a, sock, &status, &len, &id, &crc)) {
+                printf("READ: REPLY: SHORT READ\n");
+                goto out;
+            }
+            if (status != 'K') {
+                fails++;
+                continue;
+            }
+            for (int done = 0; done < len; ) {
+                int n = read_all(sock, buf, len - done < buf_len ?
+                                 len - done : buf_len);
+                if (n <= 0) {
+                    printf("READ DATA: SHORT READ\n");
+                    goto out;
+                }
+                if (a->checksum)
+                    value_crc = crc32c(value_crc, buf, n);
+                done += n;
+            }
+            if (a->checksum && value_crc != crc) {
+                printf("READ DATA: CHECKSUM MISMATCH\n");
+                fails++;
+            }
+            bytes += len;
+        }
     }
+out:
+    pthread_mutex_lock(&m);
+    rb_bytes += bytes;
+    rb_fails += fails;
+    pthread_mutex_unlock(&m);
+    close(sock);
+    free(buf);
+    return NULL;
+}
+
+void do_readbench(struct args *a)
+{
+    char *data = malloc(a->value_size);
+    struct timespec t0, t1;
+
+    rb_names = malloc(a->max * sizeof(*rb_names));
+    for (int i = 0; i < a->max; i++)
+        sprintf(rb_names[i], "RB-%06d", i);
+    randstr(data, a->value_size);
+
+    int sock = do_connect(&a->addr);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int stored = send_many(a, sock, 'W', rb_names, a->max, data, a->value_size);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (stored < a->max)
+        printf("readbench: only %d of %d keys stored\n", stored, a->max);
+
+    double wsecs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("readbench: %d writes of %d bytes in %.3f sec: %.0f req/sec, "
+           "%.1f MB/sec\n", a->max, a->value_size, wsecs,
+           wsecs > 0 ? a->max / wsecs : 0,
+           wsecs > 0 ? (double)stored * a->value_size / wsecs / (1 << 20) : 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_t th[a->nthreads];
+    for (int i = 0; i < a->nthreads; i++)
+        pthread_create(&th[i], NULL, readbench_thread, a);
+    for (int i = 0; i < a->nthreads; i++)
+        pthread_join(th[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    int reads = a->count / a->nthreads * a->nthreads;
+    printf("readbench: %d reads of %d bytes in %.3f sec: %.0f req/sec, "
+           "%.1f MB/sec, %lld failed\n", reads, a->value_size, secs,
+           secs > 0 ? reads / secs : 0,
+           secs > 0 ? rb_bytes / secs / (1 << 20) : 0, rb_fails);
+
+    send_many(a, sock, 'D', rb_names, a->max, NULL, 0);
+    close(sock);
+    free(rb_names);
+    free(data);
+}
+
+/* --fill: loads the server up with --max keys, FILL-0000000 on, for
+ * testing restarts. With --ttl they are written to expire.
+ */
+void do_fill(struct args *a)
+{
+    char (*names)[32] = malloc(a->max * sizeof(*names));
+    char *data = malloc(a->value_size);
+    struct timespec t0, t1;
 
-    for (int i = 0; i < 250; i++) {
-        sprintf(name, "KEY-%04d", i);
-        randstr(data, sizeof(data));
-        do_del(a, name, NULL, 1);
+    for (int i = 0; i < a->max; i++)
+        sprintf(names[i], "FILL-%07d", i);
+    randstr(data, a->value_size);
+
+    int sock = do_connect(&a->addr);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int stored;
+    if (a->ttl) {
+        char *body = ttl_body(a->ttl, data, a->value_size);
+        stored = send_many(a, sock, 'T', names, a->max, body,
+                           REQUEST_TTL_LEN + a->value_size);
+        free(body);
+    } else
+        stored = send_many(a, sock, 'W', names, a->max, data, a->value_size);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    close(sock);
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("fill: %d of %d keys stored in %.3f sec (%.0f req/sec)\n", stored,
+           a->max, secs, secs > 0 ? stored / secs : 0);
+    free(names);
+    free(data);
+}
+
+/* --writebench: every thread overwrites its share of --max keys over its
+ * own connection, --pipeline requests at a time, timing each write from
+ * when it is sent until its reply is in. The server's --durability
+ * decides how long that is.
+ */
+char (*wb_names)[32];
+char *wb_data;
+double *wb_lat;                 /* microseconds, total per thread */
+int wb_next;
+long long wb_fails;
+
+static double ts_us(struct timespec *t)
+{
+    return t->tv_sec * 1e6 + t->tv_nsec / 1e3;
+}
+
+void *writebench_thread(void *_ptr)
+{
+    struct args *a = _ptr;
+    char hdr[HDR_MAX];
+    int total = a->count / a->nthreads;
+    double *sent = malloc(a->pipeline * sizeof(*sent));
+    int sock = do_connect(&a->addr);
+    long long fails = 0;
+
+    pthread_mutex_lock(&m);
+    int t = wb_next++;
+    pthread_mutex_unlock(&m);
+    double *lat = wb_lat + (size_t)t * total;
+
+    for (int i = 0; i < total; i += a->pipeline) {
+        int batch = (total - i < a->pipeline) ? total - i : a->pipeline;
+
+        for (int j = 0; j < batch; j++) {
+            struct timespec now;
+            char *name = wb_names[((i + j) * a->nthreads + t) % a->max];
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            sent[j] = ts_us(&now);
+            write(sock, hdr, make_header(a, hdr, 'W', name, wb_data,
+                                         a->value_size, j));
+            write(sock, wb_data, a->value_size);
+        }
+        for (int j = 0; j < batch; j++) {
+            char status;
+            int len;
+            uint64_t id;
+            uint32_t crc;
+            struct timespec now;
+            if (!read_reply(a, sock, &status, &len, &id, &crc) ||
+                (a->proto == 2 && id >= batch)) {
+                printf("W: REPLY: SHORT READ\n");
+                fails += total - i - j;
+                goto out;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            /* v2 replies may overtake each other */
+            lat[i + j] = ts_us(&now) - sent[a->proto == 2 ? id : j];
+            fails += status != 'K';
+        }
     }
+out:
+    pthread_mutex_lock(&m);
+    wb_fails += fails;
+    pthread_mutex_unlock(&m);
+    close(sock);
+    free(sent);
+    return NULL;
 }
-    
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+void do_writebench(struct args *a)
+{
+    struct timespec t0, t1;
+    int writes = a->count / a->nthreads * a->nthreads;
+
+    wb_names = malloc(a->max * sizeof(*wb_names));
+    for (int i = 0; i < a->max; i++)
+        sprintf(wb_names[i], "WB-%06d", i);
+    wb_data = malloc(a->value_size);
+    randstr(wb_data, a->value_size);
+    wb_lat = calloc(writes, sizeof(*wb_lat));
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_t th[a->nthreads];
+    for (int i = 0; i < a->nthreads; i++)
+        pthread_create(&th[i], NULL, writebench_thread, a);
+    for (int i = 0; i < a->nthreads; i++)
+        pthread_join(th[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    qsort(wb_lat, writes, sizeof(*wb_lat), cmp_double);
+    printf("writebench: %d writes of %d bytes from %d threads in %.3f sec: "
+           "%.0f req/sec, %.1f MB/sec, %lld failed\n", writes, a->value_size,
+           a->nthreads, secs, secs > 0 ? writes / secs : 0,
+           secs > 0 ? (double)writes * a->value_size / secs / (1 << 20) : 0,
+           wb_fails);
+    if (writes > 0)
+        printf("writebench: latency usec: p50 %.0f, p90 %.0f, p99 %.0f, "
+               "p99.9 %.0f, max %.0f\n", wb_lat[writes / 2],
+               wb_lat[(int)(writes * 0.9)], wb_lat[(int)(writes * 0.99)],
+               wb_lat[(int)(writes * 0.999)], wb_lat[writes - 1]);
+
+    int sock = do_connect(&a->addr);
+    send_many(a, sock, 'D', wb_names, a->max, NULL, 0);
+    close(sock);
+    free(wb_names);
+    free(wb_data);
+    free(wb_lat);
+}
+
+/* --zipf: what a server used as a cache sees. Each thread reads keys
+ * picked by a Zipf distribution over --max keys, ZIPF-0000000 the most
+ * popular, and writes each one that missed back. Against a server that
+ * can't keep all --max keys (--evict with a budget) the hit rate shows
+ * how well it picks which to keep.
+ */
+char (*zf_names)[32];
+char *zf_data;
+double *zf_cdf;
+long long zf_gets, zf_hits, zf_fails;
+
+int zipf_pick(struct args *a, unsigned *seed)
+{
+    double u = rand_r(seed) / (RAND_MAX + 1.0);
+    int lo = 0, hi = a->max - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zf_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void *zipf_thread(void *_ptr)
+{
+    struct args *a = _ptr;
+    char hdr[HDR_MAX], buf[4096];
+    int total = a->count / a->nthreads;
+    int sock = do_connect(&a->addr);
+    unsigned seed = random();
+    long long hits = 0, fails = 0;
+
+    for (int i = 0; i < total; i++) {
+        char *name = zf_names[zipf_pick(a, &seed)];
+        char status;
+        int len;
+        uint64_t id;
+        uint32_t crc;
+
+        write(sock, hdr, make_header(a, hdr, 'R', name, NULL, 0, i));
+        if (!read_reply(a, sock, &status, &len, &id, &crc) ||
+            (status == 'K' && (len > sizeof(buf) || read_all(sock, buf, len) != len))) {
+            printf("R %s: REPLY: SHORT READ\n", name);
+            break;
+        }
+        if (status == 'K') {
+            hits++;
+            continue;
+        }
+        write(sock, hdr, make_header(a, hdr, 'W', name, zf_data, a->value_size, i));
+        write(sock, zf_data, a->value_size);
+        if (!read_reply(a, sock, &status, &len, &id, &crc)) {
+            printf("W %s: REPLY: SHORT READ\n", name);
+            break;
+        }
+        fails += status != 'K';
+    }
+    pthread_mutex_lock(&m);
+    zf_gets += total;
+    zf_hits += hits;
+    zf_fails += fails;
+    pthread_mutex_unlock(&m);
+    close(sock);
+    return NULL;
+}
+
+void do_zipf(struct args *a)
+{
+    struct timespec t0, t1;
+    double sum = 0;
+
+    zf_names = malloc(a->max * sizeof(*zf_names));
+    zf_cdf = malloc(a->max * sizeof(*zf_cdf));
+    for (int i = 0; i < a->max; i++) {
+        sprintf(zf_names[i], "ZIPF-%07d", i);
+        zf_cdf[i] = sum += 1 / pow(i + 1, a->zipf);
+    }
+    for (int i = 0; i < a->max; i++)
+        zf_cdf[i] /= sum;
+    zf_data = malloc(a->value_size);
+    randstr(zf_data, a->value_size);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_t th[a->nthreads];
+    for (int i = 0; i < a->nthreads; i++)
+        pthread_create(&th[i], NULL, zipf_thread, a);
+    for (int i = 0; i < a->nthreads; i++)
+        pthread_join(th[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("zipf: %lld reads of %d keys (s=%.2f) from %d threads in %.3f sec: "
+           "%.0f req/sec, hit rate %.2f%%, %lld writes failed\n", zf_gets,
+           a->max, a->zipf, a->nthreads, secs, secs > 0 ? zf_gets / secs : 0,
+           zf_gets ? 100.0 * zf_hits / zf_gets : 0, zf_fails);
+
+    int sock = do_connect(&a->addr);
+    send_many(a, sock, 'D', zf_names, a->max, NULL, 0);
+    close(sock);
+    free(zf_names);
+    free(zf_cdf);
+    free(zf_data);
+}
+
+/* send op for each of n keys over one connection, up to a->batch keys
+ * per batch request. Reads are checked against data. Returns the number
+ * of keys that succeeded, or -1 if a reply was wrong.
+ */
+int send_batch(struct args *a, int sock, char op, char (*names)[32], int n,
+               void *data, int len)
+{
+    int item = HDR_MAX + (op == 'W' ? len : 0);
+    char *body = malloc(a->batch * item);
+    char *reply = malloc(a->batch * (HDR_MAX + 4096));
+    char hdr[HDR_MAX];
+    int ok = 0;
+
+    for (int i = 0; i < n; i += a->batch) {
+        int batch = (n - i < a->batch) ? n - i : a->batch;
+        int blen = 0;
+
+        for (int j = 0; j < batch; j++) {
+            blen += make_header(a, body + blen, op, names[i + j], data,
+                                op == 'W' ? len : 0, i + j);
+            if (op == 'W') {
+                memcpy(body + blen, data, len);
+                blen += len;
+            }
+        }
+        write(sock, hdr, make_header(a, hdr, 'B', "", body, blen, i));
+        write(sock, body, blen);
+
+        char status = 0;
+        int rlen;
+        uint64_t id;
+        uint32_t crc;
+        if (!read_reply(a, sock, &status, &rlen, &id, &crc) || status != 'K' ||
+            rlen > a->batch * (HDR_MAX + 4096)) {
+            printf("B: REPLY: %s\n", status == 'X' ? "X" : "SHORT READ");
+            ok = -1;
+            break;
+        }
+        if (read_all(sock, reply, rlen) != rlen) {
+            printf("B: REPLY DATA: SHORT READ\n");
+            ok = -1;
+            break;
+        }
+        if (a->checksum && crc32c(0, reply, rlen) != crc) {
+            printf("B: REPLY DATA: CHECKSUM MISMATCH\n");
+            ok = -1;
+            break;
+        }
+        char *p = reply;
+        for (int j = 0; j < batch; j++) {
+            char name[32] = {0};
+            int vlen;
+            if (a->proto == 2) {
+                struct request_v2 h;
+                memcpy(&h, p, sizeof(h));
+                int key_len = le16toh(h.key_len) < 31 ? le16toh(h.key_len) : 31;
+                memcpy(name, p + sizeof(h), key_len);
+                p += sizeof(h) + le16toh(h.key_len);
+                status = h.op;
+                vlen = le32toh(h.value_len);
+                id = le64toh(h.id);
+            } else {
+                struct request *r = (struct request *)p;
+                memcpy(name, r->name, sizeof(r->name));
+                p += sizeof(*r);
+                status = r->op_status;
+                vlen = status == 'K' && op == 'R' ? request_len(r) : 0;
+                id = i + j;
+            }
+            if (strcmp(name, names[i + j]) || id != i + j ||
+                (vlen && (vlen != len || memcmp(p, data, len)))) {
+                printf("B: %c %s: WRONG REPLY\n", op, names[i + j]);
+                ok = -1;
+                goto out;
+            }
+            ok += status == 'K';
+            p += vlen;
+        }
+    }
+out:
+    free(body);
+    free(reply);
+    return ok;
+}
+
+/* one batch of W, R, W, R, D, R on a single key, each read having to
+ * see the item before it. Returns 1 if the replies say so.
+ */
+int batch_in_order(struct args *a, int sock)
+{
+    static const char ops[] = "WRWRDR";
+    static const char *values[] = {"first", "", "second", "", "", ""};
+    static const char *expect[] = {"", "first", "", "second", "", NULL};
+    char body[6 * (HDR_MAX + 8)], reply[6 * (HDR_MAX + 8)], hdr[HDR_MAX];
+    int blen = 0, ok = 1;
+
+    for (int j = 0; j < 6; j++) {
+        int len = strlen(values[j]);
+        blen += make_header(a, body + blen, ops[j], "BT-order", values[j], len, j);
+        memcpy(body + blen, values[j], len);
+        blen += len;
+    }
+    write(sock, hdr, make_header(a, hdr, 'B', "", body, blen, 0));
+    write(sock, body, blen);
+
+    char status = 0;
+    int rlen;
+    uint64_t id;
+    uint32_t crc;
+    if (!read_reply(a, sock, &status, &rlen, &id, &crc) || status != 'K' ||
+        rlen > sizeof(reply) || read_all(sock, reply, rlen) != rlen)
+        return 0;
+    char *p = reply;
+    for (int j = 0; j < 6; j++) {
+        int vlen;
+        if (a->proto == 2) {
+            struct request_v2 h;
+            memcpy(&h, p, sizeof(h));
+            p += sizeof(h) + le16toh(h.key_len);
+            status = h.op;
+            vlen = le32toh(h.value_len);
+        } else {
+            struct request *r = (struct request *)p;
+            p += sizeof(*r);
+            status = r->op_status;
+            vlen = status == 'K' && ops[j] == 'R' ? request_len(r) : 0;
+        }
+        if (status != (expect[j] ? 'K' : 'X') ||
+            (expect[j] && (vlen != strlen(expect[j]) || memcmp(p, expect[j], vlen))))
+            ok = 0;
+        p += vlen;
+    }
+    return ok;
+}
+
+/* --batch: the same keys written, read and deleted with single-key
+ * requests (pipelined per --pipeline) and then with batch requests
+ */
+void do_batchbench(struct args *a)
+{
+    int len = a->value_size < 4096 ? a->value_size : 4096;
+    char (*names)[32] = malloc(a->max * sizeof(*names));
+    char *data = malloc(len);
+    struct timespec t0, t1;
+    static const char ops[] = "WRD";
+    double rate[2][3];
+    int failed = 0;
+
+    for (int i = 0; i < a->max; i++)
+        sprintf(names[i], "BT-%06d", i);
+    randstr(data, len);
+
+    int sock = do_connect(&a->addr);
+    for (int batched = 0; batched < 2; batched++) {
+        for (int k = 0; k < 3; k++) {
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            int ok = batched ?
+                send_batch(a, sock, ops[k], names, a->max, data, len) :
+                send_many(a, sock, ops[k], names, a->max, data, len);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+            rate[batched][k] = secs > 0 ? a->max / secs : 0;
+            if (ok != a->max) {
+                printf("batch: %c %s: %d of %d keys ok\n", ops[k],
+                       batched ? "batched" : "single", ok, a->max);
+                failed = 1;
+            }
+        }
+    }
+    if (!batch_in_order(a, sock)) {
+        printf("batch: items on one key not applied in order\n");
+        failed = 1;
+    }
+    close(sock);
+
+    for (int k = 0; k < 3; k++)
+        printf("batch: %c %d keys of %d bytes: single %.0f ops/sec, "
+               "%d per batch %.0f ops/sec (%.1fx)\n", ops[k], a->max, len,
+               rate[0][k], a->batch, rate[1][k],
+               rate[0][k] > 0 ? rate[1][k] / rate[0][k] : 0);
+    if (failed)
+        printf("batch: FAILED\n");
+    free(names);
+    free(data);
+}
+
+/* --crc-bench: GB/s of each checksum over buffers of several sizes, 1GB
+ * of data per measurement, from a 64MB pool so it isn't all in cache.
+ */
+void do_crcbench(void)
+{
+    const size_t pool = 64 << 20, total = 1ul << 30;
+    static const int sizes[] = {100, 4096, 65536, 1 << 20};
+    unsigned char *buf = malloc(pool);
+
+    randstr((char *)buf, pool);
+    if (crc32c(0, "123456789", 9) != 0xe3069283 ||
+        crc32c_portable(0, "123456789", 9) != 0xe3069283)
+        printf("crc-bench: CRC32C FAILED its check value\n");
+
+    printf("crc-bench: GB/s   %12s %12s %12s\n", "crc32c", "crc32c", "zlib");
+    printf("crc-bench: size   %12s %12s %12s\n", crc32c_impl, "table", "crc32");
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        double rate[3];
+        size_t step = sizes[i];
+        for (int k = 0; k < 3; k++) {
+            struct timespec t0, t1;
+            uint32_t sum = 0;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            for (size_t done = 0, off = 0; done < total; done += step) {
+                if (off + step > pool)
+                    off = 0;
+                if (k == 0)
+                    sum += crc32c(0, buf + off, step);
+                else if (k == 1)
+                    sum += crc32c_portable(0, buf + off, step);
+                else
+                    sum += crc32(0, buf + off, step);
+                off += step;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+            rate[k] = total / secs / 1e9;
+            if (sum == 1) /* keep the loop from being optimized away */
+                printf(" ");
+        }
+        printf("crc-bench: %-7d %11.2f %12.2f %12.2f\n", sizes[i],
+               rate[0], rate[1], rate[2]);
+    }
+    free(buf);
+}
+
 int main(int argc, char **argv)
 {
     struct args args;
     memset(&args, 0, sizeof(args));
     
     argp_parse(&argp, argc, argv, 0, 0, &args);
+
+    n_table = args.max;
+    table = calloc(n_table, sizeof(*table));
             
     args.addr = (struct sockaddr_in){
         .sin_family = AF_INET,
         .sin_port = htons(args.port),
         .sin_addr.s_addr = inet_addr("127.0.0.1")}; /* localhost */
 
-    if (args.test)
+    if (args.crc_bench)
+        do_crcbench();
+    else if (args.test)
         do_test(&args);
     else if (args.overload)
         do_overload(&args);
+    else if (args.batch)
+        do_batchbench(&args);
+    else if (args.readbench)
+        do_readbench(&args);
+    else if (args.writebench)
+        do_writebench(&args);
+    else if (args.zipf)
+        do_zipf(&args);
+    else if (args.fill)
+        do_fill(&args);
     else if (args.op == OP_SET)
         do_set(&args, args.key, args.val, strlen(args.val), NULL, 0);
     else if (args.op == OP_GET)
@@ -583,18 +1577,37 @@ int main(int argc, char **argv)
         do_del(&args, args.key, NULL, 0);
     else if (args.op == OP_QUIT)
         do_quit(&args);
-    else if (args.nthreads == 1)
-        thread(&args);
+    else if (args.op == OP_STATS)
+        do_stats(&args);
     else {
-        pthread_t th[args.nthreads];
-        for (int i = 0; i < args.nthreads; i++)
-            pthread_create(&th[i], NULL, thread, &args);
-        void *tmp;
-        for (int i = 0; i < args.nthreads; i++)
-            pthread_join(th[i], &tmp); /* will wait forever */
-    }
-    for (int i = 0; i < 150; i++)
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (args.nthreads == 1)
+            thread(&args);
+        else {
+            pthread_t th[args.nthreads];
+            for (int i = 0; i < args.nthreads; i++)
+                pthread_create(&th[i], NULL, thread, &args);
+            void *tmp;
+            for (int i = 0; i < args.nthreads; i++)
+                pthread_join(th[i], &tmp); /* will wait forever */
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        int done = args.count / args.nthreads * args.nthreads;
+        printf("%d requests in %.3f sec (%.0f req/sec)\n", done, secs,
+               secs > 0 ? done / secs : 0);
+    }
+    char (*names)[32] = malloc(n_table * sizeof(*names));
+    int n = 0;
+    for (int i = 0; i < n_table; i++)
         if (table[i].len > 0)
-            do_del(&args, table[i].name, NULL, 1);
+            strcpy(names[n++], table[i].name);
+    if (n > 0) {
+        int sock = do_connect(&args.addr);
+        send_many(&args, sock, 'D', names, n, NULL, 0);
+        close(sock);
+    }
+    free(names);
 }
 
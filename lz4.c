@@ -0,0 +1,200 @@
+/*
+ * file:        lz4.c
+ * description: LZ4 block compression, just the block format: no frames,
+ *              checksums or dictionaries
+ *
+ * A block is a run of sequences, each a token byte (literal count in the
+ * high nibble, match length minus 4 in the low one, 15 meaning more
+ * length bytes follow), the literals, then a two-byte offset back to the
+ * match. The last sequence has literals only. The compressor finds
+ * matches through a hash of the next four bytes, one candidate per
+ * hash, and gives up on ratio for speed like the reference one does.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4.h"
+
+#define HASH_LOG     12
+#define MIN_MATCH    4
+#define MF_LIMIT     12         // a match can't start in the last 12 bytes...
+#define LAST_LITERALS 5         // ...nor run into the last 5
+#define MAX_OFFSET   65535
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+/*
+ * Writes what's left of a length over 15 as 255s and a final byte.
+ * Returns NULL if it wouldn't fit before end.
+ */
+static uint8_t *put_length(uint8_t *op, uint8_t *end, int len) {
+    for (; len >= 255; len -= 255) {
+        if (op >= end) {
+            return NULL;
+        }
+        *op++ = 255;
+    }
+    if (op >= end) {
+        return NULL;
+    }
+    *op++ = len;
+    return op;
+}
+
+/*
+ * Writes a sequence: lit literals from anchor, then, if mlen is at least
+ * MIN_MATCH, a match of mlen bytes off bytes back.
+ */
+static uint8_t *put_sequence(uint8_t *op, uint8_t *end, const uint8_t *anchor,
+                             int lit, int off, int mlen) {
+    if (op >= end) {
+        return NULL;
+    }
+    uint8_t *token = op++;
+    *token = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15 && !(op = put_length(op, end, lit - 15))) {
+        return NULL;
+    }
+    if (lit > end - op) {
+        return NULL;
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+    if (mlen < MIN_MATCH) {
+        return op;
+    }
+
+    if (end - op < 2) {
+        return NULL;
+    }
+    *op++ = off & 0xff;
+    *op++ = off >> 8;
+    mlen -= MIN_MATCH;
+    *token |= mlen < 15 ? mlen : 15;
+    if (mlen >= 15 && !(op = put_length(op, end, mlen - 15))) {
+        return NULL;
+    }
+    return op;
+}
+
+int lz4_compress(const char *src, int len, char *dst, int cap) {
+    const uint8_t *base = (const uint8_t *)src;
+    const uint8_t *ip = base, *anchor = base, *end = base + len;
+    uint8_t *op = (uint8_t *)dst, *oend = op + cap;
+    uint32_t table[1 << HASH_LOG];
+
+    if (len >= MF_LIMIT + 1) {
+        const uint8_t *mf_limit = end - MF_LIMIT;
+        const uint8_t *match_limit = end - LAST_LITERALS;
+
+        memset(table, 0, sizeof(table));
+        ip++;
+        while (ip < mf_limit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash4(seq);
+            const uint8_t *ref = base + table[h];
+            table[h] = ip - base;
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            // stretch the match both ways
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *m = ip + MIN_MATCH, *r = ref + MIN_MATCH;
+            while (m < match_limit && *m == *r) {
+                m++;
+                r++;
+            }
+
+            op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, m - ip);
+            if (!op) {
+                return 0;
+            }
+            ip = anchor = m;
+            if (ip < mf_limit) {
+                // the position just before often starts the next match
+                table[hash4(read32(ip - 2))] = ip - 2 - base;
+            }
+        }
+    }
+
+    op = put_sequence(op, oend, anchor, end - anchor, 0, 0);
+    return op ? op - (uint8_t *)dst : 0;
+}
+
+/*
+ * Reads the rest of a length whose nibble was 15 into *len.
+ */
+static const uint8_t *get_length(const uint8_t *ip, const uint8_t *end,
+                                 size_t *len) {
+    unsigned b;
+
+    do {
+        if (ip >= end) {
+            return NULL;
+        }
+        b = *ip++;
+        *len += b;
+    } while (b == 255);
+    return ip;
+}
+
+int lz4_decompress(const char *src, int len, char *dst, int cap) {
+    const uint8_t *ip = (const uint8_t *)src, *iend = ip + len;
+    uint8_t *op = (uint8_t *)dst, *oend = op + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && !(ip = get_length(ip, iend, &lit))) {
+            return -1;
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) {
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) {
+            break; // the last sequence has no match
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t off = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && !(ip = get_length(ip, iend, &mlen))) {
+            return -1;
+        }
+        mlen += MIN_MATCH;
+        if (off == 0 || off > (size_t)(op - (uint8_t *)dst) ||
+            mlen > (size_t)(oend - op)) {
+            return -1;
+        }
+        const uint8_t *m = op - off;
+        if (off >= mlen) {
+            memcpy(op, m, mlen);
+        } else {
+            // overlapping: a repeating pattern, copied forwards
+            for (size_t i = 0; i < mlen; i++) {
+                op[i] = m[i];
+            }
+        }
+        op += mlen;
+    }
+    return op - (uint8_t *)dst;
+}
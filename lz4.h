@@ -0,0 +1,20 @@
+/*
+ * file:        lz4.h
+ * description: LZ4 block compression, just the block format: no frames,
+ *              checksums or dictionaries
+ */
+#ifndef __LZ4_H__
+#define __LZ4_H__
+
+/* Compresses len bytes of src into dst, which has room for cap bytes.
+ * Returns the compressed length, or 0 if it wouldn't fit in cap.
+ */
+int lz4_compress(const char *src, int len, char *dst, int cap);
+
+/* Expands len bytes of compressed src into dst, which has room for cap
+ * bytes. Returns the expanded length, or -1 if src is malformed or
+ * expands to more than cap.
+ */
+int lz4_decompress(const char *src, int len, char *dst, int cap);
+
+#endif
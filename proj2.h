@@ -5,10 +5,102 @@
 #ifndef __PROJ2_H__
 #define __PROJ2_H__
 
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+/* Ops: R(ead), W(rite), D(elete), and S(tats), which returns the
+ * server's metrics as text, one "name{labels} value" line each.
+ * Replies: K (ok, len bytes follow for R and S) or X (failed).
+ *
+ * T is W with a time to live: its body is the TTL in milliseconds,
+ * REQUEST_TTL_LEN bytes little-endian, then the value (at most 4096
+ * bytes); len counts both. Once the TTL is up the key reads as missing
+ * and the server reclaims it. A W, or a T with a TTL of 0, stores a
+ * key that doesn't expire. A TTL over REQUEST_TTL_MAX (a hundred years)
+ * gets an X. T can't go in a batch.
+ *
+ * B(atch) carries up to BATCH_MAX_KEYS R/W/D requests in its len bytes
+ * of body, each a struct request followed by its value for W (at most
+ * 4096 bytes in a batch). The reply is K with len bytes holding one
+ * struct request per item, in order, with K/X for that key and, for a
+ * successful R, its len and value; or a bare X if the batch itself was
+ * malformed. Items on the same key take effect in order, so a read sees
+ * the batch's own earlier write or delete of its key; items on distinct
+ * keys run as if concurrently. This holds in every server mode: in
+ * per-core mode a batch is run whole by the connection's core rather
+ * than handed to the cores owning its keys.
+ */
 struct request {
-    char op_status;             /* R/W/D, K/X */
+    char op_status;             /* R/W/T/D/S, K/X */
     char name[31];              /* null-padded, max strlen = 30 */
     char len[8];                /* text, decimal, null-padded */
 };
 
+/* Values can be up to REQUEST_MAX_LEN bytes. len can hold all 8
+ * digits, leaving no room for a terminating null, so use these rather
+ * than atoi()/sprintf() on it.
+ */
+#define REQUEST_MAX_LEN 99999999
+#define BATCH_MAX_KEYS  1024
+#define REQUEST_TTL_LEN 8
+#define REQUEST_TTL_MAX 3153600000000ULL
+
+/* Protocol v2, binary. A connection whose first byte is
+ * REQUEST_V2_MAGIC speaks v2 for as long as it stays open; any other
+ * first byte means the struct request format above. A v2 frame is a
+ * struct request_v2 followed by key_len bytes of key (no null) and then
+ * value_len bytes of value; the reply is a struct request_v2 with op
+ * set to K or X, key_len 0, and value_len bytes of value. All numbers
+ * are little-endian.
+ *
+ * The reply carries the request's id back, and replies on a connection
+ * may arrive in a different order than the requests were sent, so a
+ * client with several requests in flight should match them up by id.
+ * Keys are at most REQUEST_V2_KEY_MAX bytes. In a v2 batch, the items
+ * in the body and in the reply are v2 frames too, with the key echoed
+ * in each item reply.
+ *
+ * A request with REQUEST_V2_CHECKSUM in flags carries the CRC32C of its
+ * value in crc, and the server answers X rather
+ * than store a value that doesn't match. Its reply comes back with the
+ * flag set and the CRC32C of the reply's value in crc. For a batch both
+ * cover the whole body.
+ */
+#define REQUEST_V2_MAGIC   0xdb
+#define REQUEST_V2_VERSION 2
+#define REQUEST_V2_KEY_MAX 30
+
+#define REQUEST_V2_CHECKSUM 0x01
+
+struct request_v2 {
+    uint8_t magic;              /* REQUEST_V2_MAGIC */
+    uint8_t version;            /* REQUEST_V2_VERSION */
+    uint8_t op;                 /* R/W/T/D/S/B, K/X */
+    uint8_t flags;              /* REQUEST_V2_CHECKSUM, or 0 */
+    uint16_t key_len;
+    uint16_t reserved;          /* 0 */
+    uint32_t value_len;
+    uint32_t crc;               /* with REQUEST_V2_CHECKSUM, else 0 */
+    uint64_t id;                /* chosen by the client, echoed back */
+};
+
+static inline int request_len(const struct request *rq)
+{
+    int n = 0, i = 0;
+    if (rq->len[0] == '-')
+        return -1;
+    for (; i < sizeof(rq->len) && rq->len[i] >= '0' && rq->len[i] <= '9'; i++)
+        n = n * 10 + rq->len[i] - '0';
+    return n;
+}
+
+static inline void set_request_len(struct request *rq, int n)
+{
+    char tmp[16];
+    int k = snprintf(tmp, sizeof(tmp), "%d", n);
+    memset(rq->len, 0, sizeof(rq->len));
+    memcpy(rq->len, tmp, k < sizeof(rq->len) ? k : sizeof(rq->len));
+}
+
 #endif
@@ -3,40 +3,353 @@
 # testing.sh
 #
 
-PORT=$((5000 + RANDOM % 1000))
-TIMEOUT=5
-
-# Start dbserver in background, and send "quit" after a timeout
-(
-  sleep $TIMEOUT
-  echo "quit"
-) | ./dbserver $PORT &
-
-# Record the server's PID
-SERVER_PID=$!
-
-sleep 0.5
-
-# Simple tests
-echo "==> Testing single commands..."
-./dbtest --port=$PORT --set=foo hello
-./dbtest --port=$PORT --get=foo
-./dbtest --port=$PORT --delete=foo
-
-# Concurrency tests
-echo "==> Testing concurrency with 5 threads & 50 requests..."
-./dbtest --port=$PORT --threads=5 --count=50
-echo "==> Testing concurrency with 10 threads & 100 requests..."
-./dbtest --port=$PORT --threads=10 --count=100
-echo "==> Testing concurrency with 20 threads & 200 requests..."
-./dbtest --port=$PORT --threads=20 --count=200
-
-# Wait for the server to exit
+FAILED=0
+
+# start_server ARGS...: starts dbserver on a random port with the given
+# options, reading commands from fd 3, and waits until it accepts
+# connections
+start_server() {
+  PORT=$((5000 + RANDOM % 1000))
+  exec 3> >(exec ./dbserver "$@" $PORT)
+  SERVER_PID=$!
+  for i in $(seq 100); do
+    if (: > /dev/tcp/127.0.0.1/$PORT) 2> /dev/null; then
+      return 0
+    fi
+    kill -0 $SERVER_PID 2> /dev/null || break
+    sleep 0.1
+  done
+  echo "FAILED: dbserver $* did not start" >&2
+  FAILED=1
+  return 1
+}
+
+# stop_server: tells the server to quit and waits for it, leaving its
+# exit status in STATUS
+stop_server() {
+  echo "quit" >&3
+  exec 3>&-
+  wait $SERVER_PID
+  STATUS=$?
+}
+
+# Runs the test suite against a dbserver started with the given options
+run_tests() {
+  start_server --fresh "$@" || return
+
+  # Simple tests
+  echo "==> Testing single commands..."
+  ./dbtest --port=$PORT --set=foo hello
+  ./dbtest --port=$PORT --get=foo
+  ./dbtest --port=$PORT --delete=foo
+  for KEY in ttl1 ttl2 ttl3 ttl4 ttl5 ttl6 ttl7 ttl8; do
+    ./dbtest --port=$PORT --ttl=600000 --set=$KEY hello > /dev/null
+    if ! ./dbtest --port=$PORT --get=$KEY | grep -q '^="hello"'; then
+      echo "FAILED: key with a TTL on dbserver $*"
+      FAILED=1
+    fi
+    ./dbtest --port=$PORT --delete=$KEY > /dev/null
+  done
+
+  # Concurrency tests
+  echo "==> Testing concurrency with 5 threads & 50 requests..."
+  ./dbtest --port=$PORT --threads=5 --count=50
+  echo "==> Testing concurrency with 10 threads & 100 requests..."
+  ./dbtest --port=$PORT --threads=10 --count=100
+  echo "==> Testing concurrency with 20 threads & 200 requests..."
+  ./dbtest --port=$PORT --threads=20 --count=200
+
+  # Persistent connections
+  echo "==> Testing keep-alive with 4 threads & 400 requests..."
+  ./dbtest --port=$PORT --threads=4 --count=400 --keepalive
+  echo "==> Testing pipelining with 4 threads & 400 requests, depth 8..."
+  ./dbtest --port=$PORT --threads=4 --count=400 --keepalive --pipeline=8
+
+  # Growth past the old 200-key limit
+  echo "==> Testing table growth with 2500 keys..."
+  ./dbtest --port=$PORT --overload --max=2000 --pipeline=16
+
+  # Many keys per request
+  echo "==> Testing batches of 64 keys..."
+  if ./dbtest --port=$PORT --batch=64 --max=1000 --value-size=100 | grep FAILED; then
+    echo "FAILED: batches on dbserver $*"
+    FAILED=1
+  fi
+
+  # Binary protocol with request ids
+  echo "==> Testing protocol v2..."
+  if ./dbtest --port=$PORT --proto=2 --batch=64 --max=1000 --value-size=100 | grep FAILED ||
+     ! ./dbtest --port=$PORT --proto=2 --readbench --max=100 --count=2000 --pipeline=16 | grep -q ', 0 failed'; then
+    echo "FAILED: protocol v2 on dbserver $*"
+    FAILED=1
+  fi
+
+  # End-to-end checksums, streamed values included
+  echo "==> Testing protocol v2 checksums..."
+  if ./dbtest --port=$PORT --proto=2 --checksum --batch=64 --max=1000 --value-size=100 | grep FAILED ||
+     ! ./dbtest --port=$PORT --proto=2 --checksum --readbench --value-size=100K --max=20 --count=200 --pipeline=4 | grep -q ', 0 failed'; then
+    echo "FAILED: checksums on dbserver $*"
+    FAILED=1
+  fi
+
+  # Values bigger than the server's buffers
+  echo "==> Testing streamed values of 8M..."
+  if ! ./dbtest --port=$PORT --readbench --value-size=8M --max=4 --count=8 | grep -q ', 0 failed'; then
+    echo "FAILED: large values on dbserver $*"
+    FAILED=1
+  fi
+
+  # Acknowledged writes, timed
+  echo "==> Testing write latency with 8 threads..."
+  if ! ./dbtest --port=$PORT --writebench --threads=8 --count=2000 --max=500 --value-size=1000 --pipeline=4 | grep -q ', 0 failed'; then
+    echo "FAILED: writebench on dbserver $*"
+    FAILED=1
+  fi
+
+  # Metrics over the socket
+  echo "==> Testing stats op..."
+  if ! ./dbtest --port=$PORT --stats | grep -q '^db_requests_total{op="W"}'; then
+    echo "FAILED: no metrics from dbserver $*"
+    FAILED=1
+  fi
+
+  stop_server
+  if [ $STATUS -ne 0 ]; then
+    echo "FAILED: dbserver $* exited with code $STATUS"
+    FAILED=1
+  fi
+}
+
+echo "==> Thread-pool server"
+run_tests --mode=threads
+echo "==> Epoll server"
+run_tests --mode=epoll
+echo "==> Thread-pool server, io_uring storage"
+run_tests --mode=threads --storage=uring
+echo "==> Epoll server, log storage"
+run_tests --mode=epoll --storage=log
+echo "==> Per-core server, zero-copy reads verified"
+run_tests --mode=percore --threads=4 --verify-zero-copy
+echo "==> Thread-pool server, group commit"
+run_tests --mode=threads --durability=group
+echo "==> Per-core server, log storage, group commit"
+run_tests --mode=percore --threads=4 --storage=log --durability=group
+echo "==> Epoll server, io_uring storage, sync per write"
+run_tests --mode=epoll --storage=uring --durability=sync
+echo "==> Epoll server, log storage, zlib compression"
+run_tests --mode=epoll --storage=log --compress=zlib --compress-min=64
+echo "==> Thread-pool server, lz4 compression"
+run_tests --mode=threads --compress=lz4 --compress-min=64 --compress-save=0
+
+# Keys stored on the log survive a restart, packed ones unpacked after
+# it whatever the new --compress
+echo "==> Log storage, restart"
+PACKED=$(printf 'hello %.0s' {1..100})
+start_server --storage=log --fresh --compress=lz4 > /dev/null
+./dbtest --port=$PORT --set=restart hello
+./dbtest --port=$PORT --set=packed "$PACKED"
+./dbtest --port=$PORT --set=gone hello
+./dbtest --port=$PORT --delete=gone
+stop_server
+start_server --storage=log > /dev/null
+if ! ./dbtest --port=$PORT --get=restart | grep -q '^="hello"'; then
+  echo "FAILED: key lost across a restart"
+  FAILED=1
+fi
+if ! ./dbtest --port=$PORT --get=packed | grep -qF "=\"$PACKED\""; then
+  echo "FAILED: compressed key lost across a restart"
+  FAILED=1
+fi
+if ./dbtest --port=$PORT --get=gone | grep -q '^="'; then
+  echo "FAILED: deleted key back after a restart"
+  FAILED=1
+fi
+stop_server
+
+# Keys written with a TTL read back until it is up, then are reclaimed;
+# the log keeps the TTL across a restart
+echo "==> Log storage, key expiry"
+start_server --storage=log --fresh > /dev/null
+./dbtest --port=$PORT --ttl=500 --set=brief hello
+./dbtest --port=$PORT --ttl=600000 --set=lasting hello
+./dbtest --port=$PORT --ttl=800 --set=restarted hello
+./dbtest --port=$PORT --ttl=500 --fill --max=1000 --value-size=100 --pipeline=16 > /dev/null
+if ! ./dbtest --port=$PORT --ttl=3153600000000 --set=century hello | grep -q '^ok' ||
+   ! ./dbtest --port=$PORT --get=century | grep -q '^="hello"'; then
+  echo "FAILED: key with the longest TTL not kept"
+  FAILED=1
+fi
+if ./dbtest --port=$PORT --ttl=3153600000001 --set=toolong hello | grep -q '^ok' ||
+   ./dbtest --port=$PORT --ttl=18446744073709551615 --set=toolong hello | grep -q '^ok' ||
+   ./dbtest --port=$PORT --get=toolong | grep -q '^="'; then
+  echo "FAILED: key with a TTL past the limit accepted"
+  FAILED=1
+fi
+if ! ./dbtest --port=$PORT --get=brief | grep -q '^="hello"'; then
+  echo "FAILED: key with a TTL gone too soon"
+  FAILED=1
+fi
+sleep 1
+if ./dbtest --port=$PORT --get=brief | grep -q '^="'; then
+  echo "FAILED: key with a TTL outlived it"
+  FAILED=1
+fi
+if ! ./dbtest --port=$PORT --stats | grep -q '^db_expired_keys_total 100[1-9]'; then
+  echo "FAILED: expired keys not reclaimed"
+  FAILED=1
+fi
+stop_server
+start_server --storage=log > /dev/null
+if ! ./dbtest --port=$PORT --get=lasting | grep -q '^="hello"' ||
+   ./dbtest --port=$PORT --get=restarted | grep -q '^="'; then
+  echo "FAILED: TTL not kept across a restart"
+  FAILED=1
+fi
+stop_server
+
+# As a cache, the server evicts to stay within its budget rather than
+# failing writes (bar those admission turns away), and a skewed workload
+# still mostly hits
+for POLICY in "--evict=lru" "--evict=clock --admission=tinylfu"; do
+  echo "==> Cache mode, $POLICY"
+  start_server --fresh --mode=epoll $POLICY --evict-budget=300K > /dev/null
+  if ! ./dbtest --port=$PORT --zipf=0.99 --max=5000 --count=10000 --value-size=100 |
+       grep -q 'hit rate [1-9][0-9]\.'; then
+    echo "FAILED: cache mode hit rate, dbserver $POLICY"
+    FAILED=1
+  fi
+  ./dbtest --port=$PORT --fill --max=5000 --value-size=100 --pipeline=16 > /dev/null
+  STATS=$(./dbtest --port=$PORT --stats)
+  if ! echo "$STATS" | grep -q '^db_key_evictions_total [1-9]' ||
+     [ "$(echo "$STATS" | sed -n 's/^db_key_bytes //p')" -gt 320000 ]; then
+    echo "FAILED: budget not kept, dbserver $POLICY"
+    FAILED=1
+  fi
+  stop_server
+done
+
+# A client that stalls partway through a streamed value holds up neither
+# the snapshot taken on quit nor the keys written meanwhile
+echo "==> Log storage, stalled stream"
+start_server --storage=log --fresh > /dev/null
+exec 4<> /dev/tcp/127.0.0.1/$PORT
+{ printf 'Wstalled'; head -c 24 /dev/zero; printf '1000000\0'; head -c 65536 /dev/zero; } >&4
+./dbtest --port=$PORT --set=meanwhile hello
+echo "quit" >&3
+exec 3>&-
+for i in $(seq 100); do
+  kill -0 $SERVER_PID 2> /dev/null || break
+  sleep 0.1
+done
+if kill -0 $SERVER_PID 2> /dev/null; then
+  echo "FAILED: dbserver held up on quit by a stalled stream"
+  FAILED=1
+  kill -9 $SERVER_PID
+fi
+wait $SERVER_PID
+exec 4>&-
+start_server --storage=log > /dev/null
+if ! ./dbtest --port=$PORT --get=meanwhile | grep -q '^="hello"'; then
+  echo "FAILED: key written during a stalled stream lost across a restart"
+  FAILED=1
+fi
+stop_server
+
+# A segment with nothing whole in it, here one given over to a big value
+# cut off by a crash, doesn't stop recovery of the segments after it
+echo "==> Log storage, recovery past a torn segment"
+start_server --storage=log --fresh > /dev/null
+exec 4<> /dev/tcp/127.0.0.1/$PORT
+{ printf 'Wtorn'; head -c 27 /dev/zero; printf '80000000'; head -c 65536 /dev/zero; } >&4
+for i in $(seq 50); do
+  ./dbtest --port=$PORT --stats | grep -q '^db_log_segments 1$' && break
+  sleep 0.1
+done
+./dbtest --port=$PORT --set=after hello > /dev/null
+kill -9 $SERVER_PID
+wait $SERVER_PID
+exec 3>&- 4>&-
+start_server --storage=log > /dev/null
+if ! ./dbtest --port=$PORT --get=after | grep -q '^="hello"'; then
+  echo "FAILED: key after a torn segment lost in recovery"
+  FAILED=1
+fi
+stop_server
+
+# Recovering more keys than the table may hold is an error, not a
+# silently partial table
+echo "==> Log storage, recovery into too small a table"
+start_server --storage=log --fresh > /dev/null
+./dbtest --port=$PORT --fill --max=20000 --value-size=10 --pipeline=16 > /dev/null
+stop_server
+rm -f /tmp/index.snap
+./dbserver --storage=log --shards=1 --max-memory=1M $PORT < /dev/null > /dev/null 2>&1
+if [ $? -eq 0 ]; then
+  echo "FAILED: dbserver recovered into too small a table"
+  FAILED=1
+fi
+
+# A memory limit too small for even one chunk of entries per shard is
+# refused at startup, rather than every write being
+echo "==> Memory limit too small for the shards"
+if ! ./dbserver --max-memory=1M $PORT < /dev/null 2>&1 | grep -q 'Memory limit too small'; then
+  echo "FAILED: dbserver started with too small a memory limit"
+  FAILED=1
+fi
+
+# Overwritten segments get compacted away, live keys moved along
+echo "==> Log storage, compaction"
+start_server --storage=log --fresh --compact-rate=0 --compress=zlib > /dev/null
+./dbtest --port=$PORT --set=kept hello
+./dbtest --port=$PORT --writebench --threads=4 --count=40000 --max=200 --value-size=4K --pipeline=4 > /dev/null
+for i in $(seq 100); do
+  ./dbtest --port=$PORT --stats | grep -q '^db_compacted_segments_total [1-9]' && break
+  sleep 0.1
+done
+if ! ./dbtest --port=$PORT --stats | grep -q '^db_compacted_segments_total [1-9]'; then
+  echo "FAILED: no segments compacted"
+  FAILED=1
+fi
+if ! ./dbtest --port=$PORT --get=kept | grep -q '^="hello"'; then
+  echo "FAILED: key lost in compaction"
+  FAILED=1
+fi
+stop_server
+
+# The slots of compacted segments get reused for new ones, which a
+# restart has to put back in order
+start_server --storage=log --compact-rate=0 --compress=zlib > /dev/null
+./dbtest --port=$PORT --writebench --threads=4 --count=40000 --max=200 --value-size=4K --pipeline=4 > /dev/null
+stop_server
+start_server --storage=log > /dev/null
+if ! ./dbtest --port=$PORT --get=kept | grep -q '^="hello"'; then
+  echo "FAILED: key lost after reusing a compacted segment's slot"
+  FAILED=1
+fi
+stop_server
+
+# Keys deleted while compaction copies them stay deleted after a crash,
+# when the whole log is replayed
+echo "==> Log storage, deletes during compaction"
+start_server --storage=log --fresh --compact-rate=64M > /dev/null
+./dbtest --port=$PORT --set=kept hello
+./dbtest --port=$PORT --writebench --threads=4 --count=40000 --max=2000 --value-size=4K --pipeline=4 > /dev/null
+for i in $(seq 100); do
+  ./dbtest --port=$PORT --stats | grep -q '^db_compacted_segments_total [1-9]' && break
+  sleep 0.1
+done
+kill -9 $SERVER_PID
 wait $SERVER_PID
-STATUS=$?
+exec 3>&-
+start_server --storage=log > /dev/null
+if ! ./dbtest --port=$PORT --stats | grep -q '^db_table_keys 1$' ||
+   ! ./dbtest --port=$PORT --get=kept | grep -q '^="hello"'; then
+  echo "FAILED: keys deleted during compaction back after a restart"
+  FAILED=1
+fi
+stop_server
 
-if [ $STATUS -ne 0 ]; then
-  echo "FAILED: dbserver exited with code $STATUS"
+if [ $FAILED -ne 0 ]; then
   exit 1
 else
   echo "PASSED: All tests completed successfully."
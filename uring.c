@@ -0,0 +1,227 @@
+/*
+ * file:        uring.c
+ * description: a shared io_uring on the raw system calls, no liburing
+ *
+ * One ring serves the whole server. Submitting threads take sq_lock only
+ * to fill in SQEs; the io_uring_enter() that follows passes on everything
+ * queued by then, so ops from concurrent requests go into the kernel
+ * together with whichever thread gets there first. A reaper thread
+ * sleeps on the completion queue and wakes each op's waiter.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "uring.h"
+
+static int ring_fd = -1;
+
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned sq_entries;
+static unsigned sq_local_tail;      // SQEs filled in, under sq_lock
+static struct io_uring_sqe *sqes;
+static pthread_mutex_t sq_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+
+static int *free_files;             // stack of unused file slots
+static int n_free_files;
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t uring_submit_calls, uring_submitted;
+
+static int uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                   flags, NULL, 0);
+}
+
+/*
+ * Hands the kernel whatever has been published, retrying while it is
+ * out of room for completions.
+ */
+static void uring_flush(void) {
+    int n;
+
+    while ((n = uring_enter(sq_entries, 0, 0)) < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            return;
+        }
+        sched_yield();
+    }
+    if (n > 0) {
+        __atomic_add_fetch(&uring_submit_calls, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&uring_submitted, n, __ATOMIC_RELAXED);
+    }
+}
+
+void uring_lock(void) {
+    pthread_mutex_lock(&sq_lock);
+}
+
+void uring_prep(struct uring_op *op, int n, struct io_uring_sqe **sqe) {
+    // the SQ is full: let the kernel have what's complete and wait for
+    // it to take it
+    while (sq_local_tail + n - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >
+           sq_entries) {
+        __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+        uring_flush();
+    }
+
+    op->left = n;
+    op->done = 0;
+    op->detached = 0;
+    for (int i = 0; i < n; i++) {
+        unsigned idx = (sq_local_tail + i) & *sq_mask;
+        sqe[i] = &sqes[idx];
+        memset(sqe[i], 0, sizeof(*sqe[i]));
+        sqe[i]->user_data = (uint64_t)(uintptr_t)op | i;
+    }
+    sq_local_tail += n;
+}
+
+void uring_submit(void) {
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&sq_lock);
+    uring_flush();
+}
+
+void uring_wait(struct uring_op *op) {
+    uint32_t v = 0;
+
+    if (__atomic_compare_exchange_n(&op->done, &v, 2, 0, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_ACQUIRE)) {
+        v = 2;
+    }
+    while (v == 2) {
+        syscall(SYS_futex, &op->done, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+        v = __atomic_load_n(&op->done, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void *uring_reaper(void *arg) {
+    for (;;) {
+        if (uring_enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR &&
+            errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            sleep(1);
+        }
+
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            struct uring_op *op = (struct uring_op *)(uintptr_t)(cqe->user_data & ~7ull);
+
+            op->res[cqe->user_data & 7] = cqe->res;
+            if (--op->left > 0) {
+                continue;
+            }
+            if (op->detached) {
+                free(op);
+            } else if (__atomic_exchange_n(&op->done, 1, __ATOMIC_RELEASE) == 2) {
+                syscall(SYS_futex, &op->done, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+            }
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+int uring_init(unsigned entries, unsigned n_files) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = 4 * entries;     // room for every SQE plus detached ones
+    ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring_fd < 0) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+        close(ring_fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // one mapping for both rings, another for the SQEs
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_len = sq_len > cq_len ? sq_len : cq_len;
+    char *ring = mmap(NULL, ring_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        close(ring_fd);
+        return -1;
+    }
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        munmap(ring, ring_len);
+        close(ring_fd);
+        return -1;
+    }
+
+    sq_head = (unsigned *)(ring + p.sq_off.head);
+    sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+    sq_array = (unsigned *)(ring + p.sq_off.array);
+    sq_entries = p.sq_entries;
+    sq_local_tail = *sq_tail;
+    for (unsigned i = 0; i < sq_entries; i++) {
+        sq_array[i] = i;            // SQE i always sits in slot i
+    }
+    cq_head = (unsigned *)(ring + p.cq_off.head);
+    cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    // an empty file table for the chains to open into
+    struct io_uring_rsrc_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.nr = n_files;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    free_files = malloc(n_files * sizeof(*free_files));
+    if (!free_files ||
+        syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_FILES2,
+                &reg, sizeof(reg)) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < n_files; i++) {
+        free_files[n_free_files++] = n_files - 1 - i;
+    }
+
+    pthread_t reaper;
+    if (pthread_create(&reaper, NULL, uring_reaper, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(reaper);
+    return 0;
+}
+
+int uring_file_get(void) {
+    int slot = -1;
+
+    pthread_mutex_lock(&files_lock);
+    if (n_free_files > 0) {
+        slot = free_files[--n_free_files];
+    }
+    pthread_mutex_unlock(&files_lock);
+    return slot;
+}
+
+void uring_file_put(int slot) {
+    pthread_mutex_lock(&files_lock);
+    free_files[n_free_files++] = slot;
+    pthread_mutex_unlock(&files_lock);
+}
@@ -0,0 +1,53 @@
+/*
+ * file:        uring.h
+ * description: a shared io_uring on the raw system calls, no liburing
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#define URING_MAX_CHAIN 8     /* user_data keeps the index in 3 bits */
+
+/* One request's SQEs, usually linked into a chain. Once all of them
+ * have completed, res[i] holds the result of the i'th and done is set;
+ * a detached op is freed instead, so it must come from malloc() and be
+ * the first member of whatever holds the buffers its SQEs point to.
+ * uring_prep() clears detached; set it before uring_submit().
+ */
+struct uring_op {
+    int res[URING_MAX_CHAIN];
+    int left;                   /* completions still to come */
+    uint32_t done;              /* 0, 1 when done, 2 while waited on */
+    int detached;
+} __attribute__((aligned(8)));  /* user_data keeps the index in the low bits */
+
+/* Sets up the ring with room for entries SQEs and n_files registered
+ * file slots, and starts the thread reaping its completions. Returns 0
+ * on success, -1 with errno set.
+ */
+int uring_init(unsigned entries, unsigned n_files);
+
+/* Queuing: uring_lock(), then uring_prep() for each op, filling in the
+ * n SQEs it hands back (opcode, fd, flags and so on; they are zeroed
+ * and their user_data is set), then uring_submit(), which unlocks and
+ * passes everything queued so far to the kernel, other threads' ops
+ * included.
+ */
+void uring_lock(void);
+void uring_prep(struct uring_op *op, int n, struct io_uring_sqe **sqe);
+void uring_submit(void);
+
+/* waits for a submitted op that isn't detached */
+void uring_wait(struct uring_op *op);
+
+/* registered file slots, for IORING_OP_OPENAT's file_index and
+ * IOSQE_FIXED_FILE; uring_file_get() returns -1 when all are taken */
+int uring_file_get(void);
+void uring_file_put(int slot);
+
+/* io_uring_enter() calls that submitted something, and SQEs submitted */
+extern uint64_t uring_submit_calls, uring_submitted;
+
+#endif